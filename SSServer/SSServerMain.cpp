@@ -13,27 +13,43 @@
 #include "ss_client.h"
 #include "spreadsheet_manager.h"
 #include "ss_message.h"
+#include "ss_config.h"
 #include <boost/thread.hpp>
 #include <pthread.h>
 #include <signal.h>
 
 bool test_spreadsheet_manager();
+bool parse_option(std::string arg, ss::ss_config& config);
 
 //srv = ss::ss_server;
 
 int main(int argc, char **argv)
 {
 
-	std::string usage = "Usage: SSServer <port> <root directory> <index file>\n";
+	std::string usage = "Usage: SSServer <port> <root directory> <index file> [options]\n";
 	usage += "\tport\t\tTCP port to listen on\n";
 	usage += "\troot directory\tThe virtual directory root for spreadsheets\n";
 	usage += "\tindex file\tThe file that indexes existing spreadsheets\n";
+	usage += "Options:\n";
+	usage += "\t--threads=<n>\tNumber of threads serving connections (default: one per core)\n";
+	usage += "\t--workers=<n>\tNumber of threads running spreadsheet sessions (default: one per core)\n";
+	usage += "\t--loaders=<n>\tNumber of threads loading spreadsheets for JOINs (default: 2)\n";
+	usage += "\t--format=<fmt>\tFormat spreadsheets are saved in: binary or xml (default: binary)\n";
+	usage += "\t--load=<mode>\tHow spreadsheet files are read: lazy (mapped) or eager (default: lazy)\n";
+	usage += "\t--cache-mb=<n>\tMemory for keeping closed spreadsheets loaded, in MB (default: 256)\n";
+	usage += "\t--undo-kb=<n>\tMemory for each spreadsheet's undo history, in KB (default: 1024)\n";
+	usage += "\t--undo-on-save=<mode>\tWhat SAVE does to the undo history: keep or clear (default: clear)\n";
+	usage += "\t--update-ms=<n>\tMerge each client's UPDATEs over this many ms, 0 for none (default: 0)\n";
+	usage += "\t--client-queue-kb=<n>\tData queued for a client before it counts as slow, in KB (default: 4096, at least 2048)\n";
+	usage += "\t--slow-client=<mode>\tWhat happens to slow clients: resync or disconnect (default: resync)\n";
+	usage += "\t--formulas=<mode>\tWork out formulas on the server and send their values: on or off (default: off)\n";
 
 		int port;
 		std::string root_dir;
 		std::string index_file;
+		ss::ss_config config;
 		//Check args
-		if(argc != 4)
+		if(argc < 4)
 		{
 			std::cerr << usage;
 			return 1;
@@ -60,6 +76,16 @@ int main(int argc, char **argv)
 				return -1;
 			}
 			index_file = argv[3];
+			// Anything after the index file is an optional --key=value tunable
+			for(int x = 4; x < argc; x++)
+			{
+				if(!parse_option(argv[x], config))
+				{
+					std::cerr << "Invalid option " << argv[x] << "\n\n";
+					std::cerr << usage;
+					return -1;
+				}
+			}
 		}
 
 		//Start listening for Ctrl+C
@@ -74,9 +100,10 @@ int main(int argc, char **argv)
 			pthread_sigmask(SIG_BLOCK, &new_mask, &old_mask);
 
 			// Run server in background thread.
-			ss::ss_server srv(port, root_dir, index_file);
+			ss::ss_server srv(port, root_dir, index_file, config);
 			//Start the server
 			std::cout << "Starting to listen for connections on port " << boost::lexical_cast<std::string>(port) << "...\n";
+			std::cout << "Serving on " << config.io_threads << " thread(s), with " << config.workers << " session worker(s) and " << config.loaders << " loader(s)\n";
 			std::cout << "Waiting for connections...\n";
 			boost::thread srv_thread(boost::bind(&ss::ss_server::run, &srv));
 
@@ -110,19 +137,108 @@ int main(int argc, char **argv)
 
 }
 
+// Applies a single --key=value option to config.  Returns false if the
+//  option is unknown or its value is invalid
+bool parse_option(std::string arg, ss::ss_config& config)
+{
+	std::string::size_type eq = arg.find('=');
+	if(arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+		return false;
+	std::string key = arg.substr(2, eq - 2);
+	std::string val = arg.substr(eq + 1);
+	try
+	{
+		if(key == "threads")
+		{
+			config.io_threads = boost::lexical_cast<unsigned int>(val);
+			return config.io_threads > 0;
+		}
+		else if(key == "workers")
+		{
+			config.workers = boost::lexical_cast<unsigned int>(val);
+			return config.workers > 0;
+		}
+		else if(key == "loaders")
+		{
+			config.loaders = boost::lexical_cast<unsigned int>(val);
+			return config.loaders > 0;
+		}
+		else if(key == "format")
+		{
+			config.xml_files = val == "xml";
+			return val == "xml" || val == "binary";
+		}
+		else if(key == "load")
+		{
+			config.lazy_load = val == "lazy";
+			return val == "lazy" || val == "eager";
+		}
+		else if(key == "cache-mb")
+		{
+			config.cache_bytes = boost::lexical_cast<std::size_t>(val) << 20;
+			return true;
+		}
+		else if(key == "undo-kb")
+		{
+			config.undo_bytes = boost::lexical_cast<std::size_t>(val) << 10;
+			return config.undo_bytes > 0;
+		}
+		else if(key == "undo-on-save")
+		{
+			config.keep_undo_on_save = val == "keep";
+			return val == "keep" || val == "clear";
+		}
+		else if(key == "update-ms")
+		{
+			config.update_interval_ms = boost::lexical_cast<unsigned int>(val);
+			return true;
+		}
+		else if(key == "client-queue-kb")
+		{
+			config.client_queue_bytes = boost::lexical_cast<std::size_t>(val) << 10;
+			if(config.client_queue_bytes == 0)
+				return false;
+			// A JOIN OK can not be dropped like an UPDATE, so a queue too
+			//  small to hold one would disconnect every joining client
+			if(config.client_queue_bytes < ss::min_client_queue_bytes)
+			{
+				std::cerr << "Client queue raised to " << (ss::min_client_queue_bytes >> 10)
+						<< " KB, to hold a JOIN OK" << std::endl;
+				config.client_queue_bytes = ss::min_client_queue_bytes;
+			}
+			return true;
+		}
+		else if(key == "slow-client")
+		{
+			config.disconnect_slow_clients = val == "disconnect";
+			return val == "resync" || val == "disconnect";
+		}
+		else if(key == "formulas")
+		{
+			config.formulas = val == "on";
+			return val == "on" || val == "off";
+		}
+	}
+	catch(boost::bad_lexical_cast& e)
+	{
+		return false;
+	}
+	return false;
+}
 
 bool test_spreadsheet_manager()
 {
 	using namespace ss;
 		ss_client_ptr dummy;
-		spreadsheet_manager ssman("./test/", "ss_index.xml");
+		boost::asio::io_service save_service;
+		spreadsheet_manager ssman("./test/", "ss_index.xml", save_service);
 		ss_message createReq;
 		createReq.command = ss_message::CREATE;
-		createReq.set("Name", "ANewName");
-		createReq.set("Password", "tryingThisPassword");
+		createReq.set(ss_message::NAME, "ANewName");
+		createReq.set(ss_message::PASSWORD, "tryingThisPassword");
 		ssman.handle_create_request(dummy, createReq);
 		//std::cout << result << std::endl;
-		spreadsheet* ssptr = ssman.get_spreadsheet(createReq.get_val("Name"));
+		spreadsheet* ssptr = ssman.get_spreadsheet(createReq.get(ss_message::NAME));
 		spreadsheet ss = *ssptr;
 		ss.load();
 		std::string asxml;
@@ -131,15 +247,15 @@ bool test_spreadsheet_manager()
 		std::string test;
 		std::cin >> test;
 
-		//ss.set_cell_contents("a2","with");
-		//ss.set_cell_contents("a3", "new");
-		ss.set_cell_contents("a4", "words");
+		//ss.set_cell_contents(make_cell_address(1, 2),"with");
+		//ss.set_cell_contents(make_cell_address(1, 3), "new");
+		ss.set_cell_contents(make_cell_address(1, 4), "words");
 		ss.save();
 		ss.load();
-		ss.set_cell_contents("a4", "even here");
+		ss.set_cell_contents(make_cell_address(1, 4), "even here");
 		ss.set_version("woohoo");
 		std::cout << ss.get_version() << std::endl;
-		ss.set_cell_contents("a5", "new5");
+		ss.set_cell_contents(make_cell_address(1, 5), "new5");
 
 		return true;
 
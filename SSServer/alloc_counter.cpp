@@ -0,0 +1,63 @@
+/*
+ * alloc_counter.cpp
+ *
+ *  Created on: May 5, 2013
+ *      Author: montgomc
+ */
+
+#include "alloc_counter.h"
+#include <cstdlib>
+#include <new>
+#include <boost/atomic.hpp>
+
+#ifdef SS_COUNT_ALLOCATIONS
+
+static boost::atomic<unsigned long> allocations(0);
+
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, boost::memory_order_relaxed);
+	void* p = std::malloc(size > 0 ? size : 1);
+	if(p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+	std::free(p);
+}
+
+#endif
+
+namespace ss {
+
+bool counting_allocations()
+{
+#ifdef SS_COUNT_ALLOCATIONS
+	return true;
+#else
+	return false;
+#endif
+}
+
+unsigned long allocation_count()
+{
+#ifdef SS_COUNT_ALLOCATIONS
+	return allocations.load(boost::memory_order_relaxed);
+#else
+	return 0;
+#endif
+}
+
+}
@@ -0,0 +1,25 @@
+/*
+ * alloc_counter.h
+ *
+ *  Created on: May 5, 2013
+ *      Author: montgomc
+ */
+
+#ifndef ALLOC_COUNTER_H_
+#define ALLOC_COUNTER_H_
+
+namespace ss {
+
+// Counts the heap allocations the server makes, to see what handling a
+//  request costs.  Allocations are only counted in a build with
+//  SS_COUNT_ALLOCATIONS defined, which replaces the global operator new -
+//  otherwise nothing is counted, and nothing is slowed down.
+
+// Returns whether this build counts allocations
+bool counting_allocations();
+
+// Returns the number of allocations made so far
+unsigned long allocation_count();
+
+}
+#endif /* ALLOC_COUNTER_H_ */
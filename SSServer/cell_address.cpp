@@ -0,0 +1,97 @@
+/*
+ * cell_address.cpp
+ *
+ *  Created on: Apr 30, 2013
+ *      Author: montgomc
+ */
+
+#include "cell_address.h"
+
+namespace ss {
+
+// How far the column is shifted up
+static const int column_shift = 20;
+
+cell_address make_cell_address(boost::uint32_t column, boost::uint32_t row)
+{
+	return (column << column_shift) | row;
+}
+
+bool parse_cell_address(const char* name, std::size_t length, cell_address& out)
+{
+	// The column - letters, A = 1 ... Z = 26, AA = 27 ...
+	std::size_t pos = 0;
+	boost::uint32_t column = 0;
+	while(pos < length)
+	{
+		char c = name[pos];
+		if(c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		if(c < 'A' || c > 'Z')
+			break;
+		column = column * 26 + (c - 'A' + 1);
+		if(column > max_cell_column)
+			return false;
+		pos++;
+	}
+	if(column == 0)
+		return false;
+
+	// The row - digits, with no leading zero
+	if(pos == length || name[pos] == '0')
+		return false;
+	boost::uint32_t row = 0;
+	while(pos < length)
+	{
+		char c = name[pos];
+		if(c < '0' || c > '9')
+			return false;
+		row = row * 10 + (c - '0');
+		if(row > max_cell_row)
+			return false;
+		pos++;
+	}
+
+	out = make_cell_address(column, row);
+	return true;
+}
+
+bool parse_cell_address(const std::string& name, cell_address& out)
+{
+	return parse_cell_address(name.data(), name.length(), out);
+}
+
+std::size_t format_cell_address(cell_address cell, char* out)
+{
+	// Build the name backwards, then move it to the front
+	char buf[max_cell_name];
+	char* it = buf + max_cell_name;
+	boost::uint32_t row = cell & max_cell_row;
+	do
+	{
+		*--it = '0' + row % 10;
+		row /= 10;
+	} while(row > 0);
+	boost::uint32_t column = cell >> column_shift;
+	while(column > 0)
+	{
+		column--;
+		*--it = 'A' + column % 26;
+		column /= 26;
+	}
+
+	std::size_t length = buf + max_cell_name - it;
+	for(std::size_t x = 0; x < length; x++)
+	{
+		out[x] = it[x];
+	}
+	return length;
+}
+
+std::string cell_name(cell_address cell)
+{
+	char buf[max_cell_name];
+	return std::string(buf, format_cell_address(cell, buf));
+}
+
+}
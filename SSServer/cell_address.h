@@ -0,0 +1,58 @@
+/*
+ * cell_address.h
+ *
+ *  Created on: Apr 30, 2013
+ *      Author: montgomc
+ */
+
+#ifndef CELL_ADDRESS_H_
+#define CELL_ADDRESS_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <boost/cstdint.hpp>
+
+namespace ss {
+
+// A cell name ("A1", "bc12") parsed in to a single number: the column in
+//  the top 12 bits and the row in the bottom 20, both counting from 1.
+//  Names are parsed once, when a request comes in, and the number is what
+//  the session and the spreadsheet use from there on - it is only turned
+//  back in to a name to be written out (messages, the journal, files).
+//
+// Columns run from A to FAM (4095), and rows from 1 to 1048575.  Names
+//  are case insensitive, and rows may not have leading zeros, so every
+//  cell has exactly one name.
+typedef boost::uint32_t cell_address;
+
+// Cells and their contents, in the order they are set
+typedef std::vector<std::pair<cell_address, std::string> > cell_list;
+
+// No cell has this address (columns and rows count from 1)
+static const cell_address no_cell = 0;
+
+// The longest name a cell can have ("FAM1048575")
+static const std::size_t max_cell_name = 10;
+
+// The largest column and row
+static const boost::uint32_t max_cell_column = (1 << 12) - 1;
+static const boost::uint32_t max_cell_row = (1 << 20) - 1;
+
+// Returns the address of a column and row, which must be in range
+cell_address make_cell_address(boost::uint32_t column, boost::uint32_t row);
+
+// Parses a cell name.  Returns false if it is not a valid cell name
+bool parse_cell_address(const char* name, std::size_t length, cell_address& out);
+bool parse_cell_address(const std::string& name, cell_address& out);
+
+// Writes the (upper case) name of a cell in to out, which must have room
+//  for max_cell_name characters.  Returns the length of the name
+std::size_t format_cell_address(cell_address cell, char* out);
+
+// Returns the name of a cell
+std::string cell_name(cell_address cell);
+
+}
+#endif /* CELL_ADDRESS_H_ */
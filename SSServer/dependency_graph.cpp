@@ -0,0 +1,361 @@
+/*
+ * dependency_graph.cpp
+ *
+ *  Created on: May 3, 2013
+ *      Author: montgomc
+ */
+
+#include "dependency_graph.h"
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+
+namespace ss {
+
+// Roughly what a hash map entry costs, over what it holds
+static const std::size_t entry_overhead = 48;
+
+// The formulas a worker takes from a level at a time
+static const std::size_t level_chunk = 128;
+
+// Levels narrower than this are worked out by the caller alone - sharing
+//  them costs more than it saves
+static const std::size_t parallel_level = 4 * level_chunk;
+
+// Whoever runs a level_job takes chunks of the level until none are left.
+//  A task that only starts once the level is done finds nothing to take,
+//  and never touches the graph, which may be gone by then
+struct dependency_graph::level_job
+{
+	dependency_graph* graph;
+	const std::vector<cell_address>* level;
+	std::vector<cell_value>* results;
+	std::size_t chunks;
+	boost::atomic<std::size_t> next;
+	boost::atomic<std::size_t> done;
+	boost::mutex mutex;
+	boost::condition_variable finished;
+
+	void run()
+	{
+		lookup get = { graph };
+		for(;;)
+		{
+			std::size_t chunk = next++;
+			if(chunk >= chunks)
+				return;
+			std::size_t end = std::min((chunk + 1) * level_chunk, level->size());
+			for(std::size_t x = chunk * level_chunk; x < end; x++)
+			{
+				(*results)[x] = graph->nodes_.find((*level)[x])->second.expr.evaluate(get);
+			}
+			if(++done == chunks)
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				finished.notify_all();
+			}
+		}
+	}
+};
+
+dependency_graph::dependency_graph(contents_lookup contents)
+	: contents_(contents),
+	  bytes_(0)
+{
+}
+
+void dependency_graph::set(cell_address cell, const std::string& contents)
+{
+	// Take out the old formula, and its references
+	node_map::iterator old = nodes_.find(cell);
+	if(old != nodes_.end())
+	{
+		const std::vector<cell_address>& refs = old->second.expr.references();
+		for(std::vector<cell_address>::const_iterator it = refs.begin(); it != refs.end(); ++it)
+		{
+			dependent_map::iterator deps = dependents_.find(*it);
+			deps->second.erase(std::find(deps->second.begin(), deps->second.end(), cell));
+			bytes_ -= sizeof(cell_address);
+			if(deps->second.empty())
+			{
+				dependents_.erase(deps);
+				bytes_ -= entry_overhead;
+			}
+		}
+		bytes_ -= old->second.expr.memory_size() + entry_overhead;
+		nodes_.erase(old);
+	}
+
+	if(!formula::is_formula(contents))
+		return;
+
+	node& added = nodes_[cell];
+	added.expr.parse(contents);
+	bytes_ += added.expr.memory_size() + entry_overhead;
+	const std::vector<cell_address>& refs = added.expr.references();
+	for(std::vector<cell_address>::const_iterator it = refs.begin(); it != refs.end(); ++it)
+	{
+		std::vector<cell_address>& deps = dependents_[*it];
+		if(deps.empty())
+			bytes_ += entry_overhead;
+		deps.push_back(cell);
+		bytes_ += sizeof(cell_address);
+	}
+}
+
+bool dependency_graph::creates_cycle(const cell_list& cells)
+{
+	// The references the cells would have once they are set - the last
+	//  setting of a cell wins
+	boost::unordered_map<cell_address, std::vector<cell_address> > changed;
+	for(cell_list::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		formula expr;
+		if(formula::is_formula(it->second))
+			expr.parse(it->second);
+		changed[it->first] = expr.references();
+	}
+
+	// A new cycle has to go through one of the changed formulas.  One
+	//  depth first walk from all of them finds it: a reference back to a
+	//  formula still on the path closes a cycle, which is a new one if a
+	//  changed formula is on that part of the path.  A formula is never
+	//  walked twice, so this is linear in what the changed formulas reach
+	static const std::size_t done = std::size_t(-1);
+	// For each formula reached, its place on the path - or done once
+	//  everything it refers to has been walked
+	boost::unordered_map<cell_address, std::size_t> state;
+	std::vector<walk_step> path;
+	// The number of changed formulas on the path, up to and including each
+	//  step
+	std::vector<std::size_t> changed_on_path;
+	boost::unordered_map<cell_address, std::vector<cell_address> >::iterator start;
+	for(start = changed.begin(); start != changed.end(); ++start)
+	{
+		if(!state.insert(std::make_pair(start->first, 0)).second)
+			continue;
+		walk_step first = { start->first, &start->second, 0 };
+		path.push_back(first);
+		changed_on_path.push_back(1);
+		while(!path.empty())
+		{
+			walk_step& step = path.back();
+			if(step.next == step.refs->size())
+			{
+				state[step.cell] = done;
+				path.pop_back();
+				changed_on_path.pop_back();
+				continue;
+			}
+			cell_address cell = (*step.refs)[step.next++];
+
+			std::pair<boost::unordered_map<cell_address, std::size_t>::iterator, bool> seen =
+					state.insert(std::make_pair(cell, path.size()));
+			if(!seen.second)
+			{
+				std::size_t at = seen.first->second;
+				if(at != done && changed_on_path.back() > (at > 0 ? changed_on_path[at - 1] : 0))
+					return true;
+				continue;
+			}
+
+			walk_step next = { cell, NULL, 0 };
+			bool is_changed = false;
+			boost::unordered_map<cell_address, std::vector<cell_address> >::iterator in_changed = changed.find(cell);
+			if(in_changed != changed.end())
+			{
+				next.refs = &in_changed->second;
+				is_changed = true;
+			}
+			else
+			{
+				node_map::iterator in_graph = nodes_.find(cell);
+				if(in_graph != nodes_.end())
+					next.refs = &in_graph->second.expr.references();
+			}
+			if(!next.refs)
+			{
+				seen.first->second = done;
+				continue;
+			}
+			std::size_t changed_count = changed_on_path.back() + (is_changed ? 1 : 0);
+			path.push_back(next);
+			changed_on_path.push_back(changed_count);
+		}
+	}
+	return false;
+}
+
+void dependency_graph::recalculate(const cell_list& changed, cell_list& values, ss_scheduler* workers)
+{
+	boost::unordered_set<cell_address> dirty;
+	boost::unordered_set<cell_address> set_formulas;
+	for(cell_list::const_iterator it = changed.begin(); it != changed.end(); ++it)
+	{
+		if(nodes_.find(it->first) != nodes_.end())
+		{
+			dirty.insert(it->first);
+			set_formulas.insert(it->first);
+		}
+		add_dependents(it->first, dirty);
+	}
+	evaluate(dirty, set_formulas, &values, workers);
+}
+
+void dependency_graph::recalculate_all()
+{
+	boost::unordered_set<cell_address> dirty;
+	for(node_map::iterator it = nodes_.begin(); it != nodes_.end(); ++it)
+	{
+		dirty.insert(it->first);
+	}
+	evaluate(dirty, boost::unordered_set<cell_address>(), NULL, NULL);
+}
+
+void dependency_graph::add_dependents(cell_address cell, boost::unordered_set<cell_address>& out)
+{
+	std::vector<cell_address> stack(1, cell);
+	while(!stack.empty())
+	{
+		dependent_map::iterator deps = dependents_.find(stack.back());
+		stack.pop_back();
+		if(deps == dependents_.end())
+			continue;
+		for(std::vector<cell_address>::iterator it = deps->second.begin(); it != deps->second.end(); ++it)
+		{
+			if(out.insert(*it).second)
+				stack.push_back(*it);
+		}
+	}
+}
+
+void dependency_graph::evaluate(const boost::unordered_set<cell_address>& dirty,
+		const boost::unordered_set<cell_address>& always, cell_list* values,
+		ss_scheduler* workers)
+{
+	// A formula is ready once none of the dirty formulas it refers to are
+	//  left to work out
+	boost::unordered_map<cell_address, std::size_t> waiting_on;
+	std::vector<cell_address> level;
+	for(boost::unordered_set<cell_address>::const_iterator it = dirty.begin(); it != dirty.end(); ++it)
+	{
+		const std::vector<cell_address>& refs = nodes_[*it].expr.references();
+		std::size_t count = 0;
+		for(std::vector<cell_address>::const_iterator ref = refs.begin(); ref != refs.end(); ++ref)
+		{
+			if(dirty.find(*ref) != dirty.end())
+				count++;
+		}
+		if(count == 0)
+			level.push_back(*it);
+		else
+			waiting_on[*it] = count;
+	}
+
+	std::vector<cell_value> results;
+	std::vector<cell_address> next;
+	while(!level.empty())
+	{
+		results.resize(level.size());
+		evaluate_level(level, results, workers);
+
+		// Store the level's values, and find what is ready once they are in
+		next.clear();
+		for(std::size_t x = 0; x < level.size(); x++)
+		{
+			cell_address cell = level[x];
+			node& n = nodes_.find(cell)->second;
+			if(values && (results[x] != n.value || always.find(cell) != always.end()))
+				values->push_back(std::make_pair(cell, results[x].str()));
+			n.value = results[x];
+
+			// Every formula that refers to a dirty one is dirty too
+			dependent_map::iterator deps = dependents_.find(cell);
+			if(deps == dependents_.end())
+				continue;
+			for(std::vector<cell_address>::iterator it = deps->second.begin(); it != deps->second.end(); ++it)
+			{
+				if(--waiting_on[*it] == 0)
+				{
+					waiting_on.erase(*it);
+					next.push_back(*it);
+				}
+			}
+		}
+		level.swap(next);
+	}
+
+	// Whatever is still waiting is on a cycle, or depends on one
+	boost::unordered_map<cell_address, std::size_t>::iterator it;
+	for(it = waiting_on.begin(); it != waiting_on.end(); ++it)
+	{
+		node& n = nodes_[it->first];
+		cell_value value;
+		value.error = circular_error;
+		if(values && (value != n.value || always.find(it->first) != always.end()))
+			values->push_back(std::make_pair(it->first, value.str()));
+		n.value = value;
+	}
+}
+
+void dependency_graph::evaluate_level(const std::vector<cell_address>& level,
+		std::vector<cell_value>& results, ss_scheduler* workers)
+{
+	if(workers == NULL || workers->size() < 2 || level.size() < parallel_level)
+	{
+		lookup get = { this };
+		for(std::size_t x = 0; x < level.size(); x++)
+		{
+			results[x] = nodes_.find(level[x])->second.expr.evaluate(get);
+		}
+		return;
+	}
+
+	boost::shared_ptr<level_job> job = boost::make_shared<level_job>();
+	job->graph = this;
+	job->level = &level;
+	job->results = &results;
+	job->chunks = (level.size() + level_chunk - 1) / level_chunk;
+	job->next = 0;
+	job->done = 0;
+
+	// The caller is most likely a worker itself, so ask the others
+	std::size_t helpers = std::min<std::size_t>(workers->size() - 1, job->chunks - 1);
+	for(std::size_t x = 0; x < helpers; x++)
+	{
+		workers->schedule(boost::bind(&level_job::run, job));
+	}
+	job->run();
+
+	// Wait only for the chunks other workers have already taken
+	boost::mutex::scoped_lock lock(job->mutex);
+	while(job->done < job->chunks)
+	{
+		job->finished.wait(lock);
+	}
+}
+
+cell_value dependency_graph::value_of(cell_address cell)
+{
+	node_map::iterator it = nodes_.find(cell);
+	if(it != nodes_.end())
+		return it->second.value;
+	return plain_value(contents_(cell));
+}
+
+void dependency_graph::values(cell_list& values)
+{
+	for(node_map::iterator it = nodes_.begin(); it != nodes_.end(); ++it)
+	{
+		values.push_back(std::make_pair(it->first, it->second.value.str()));
+	}
+}
+
+std::size_t dependency_graph::memory_size()
+{
+	return bytes_;
+}
+
+}
@@ -0,0 +1,134 @@
+/*
+ * dependency_graph.h
+ *
+ *  Created on: May 3, 2013
+ *      Author: montgomc
+ */
+
+#ifndef DEPENDENCY_GRAPH_H_
+#define DEPENDENCY_GRAPH_H_
+
+#include "formula.h"
+#include "cell_address.h"
+#include "ss_scheduler.h"
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/function.hpp>
+
+namespace ss {
+
+// The formulas in a spreadsheet, which cells each one refers to, and what
+//  each works out to.  Only formula cells are kept; any other cell's value
+//  is read from its contents when a formula needs it.
+//
+// When cells change, only the formulas that depend on them (directly, or
+//  through other formulas) are worked out again, each after the formulas
+//  it refers to.  A change that would make a formula depend on itself is
+//  turned away before it is made (see creates_cycle) - a cycle can only
+//  come from a file, and its formulas work out to #CIRCULAR!.
+//
+// The formulas to work out are taken a level at a time: a level is every
+//  formula whose dirty references were all in earlier levels, so nothing
+//  in a level refers to anything else in it.  Given workers, a wide level
+//  is split in to chunks that the workers and the calling thread take in
+//  turn, and the caller works until the level is done rather than waiting
+//  on a worker that may be busy with another session.
+//
+// A recalculation still blocks its session.  It runs inside the session's
+//  CHANGE or UNDO, whose reply carries the new values, so the session
+//  takes no other request, from any client, until every level is done.
+//  Only wide levels use more than one core.  A deep chain has a single
+//  formula per level, so it is worked out serially.
+class dependency_graph {
+public:
+	// Returns the contents of a cell that is not a formula
+	typedef boost::function<std::string(cell_address)> contents_lookup;
+
+	// contents is used to look up the cells formulas refer to
+	dependency_graph(contents_lookup contents);
+
+	// Sets the contents of a cell, without working anything out
+	void set(cell_address cell, const std::string& contents);
+
+	// Returns whether setting cells (in order) would make a formula
+	//  depend on itself
+	bool creates_cycle(const cell_list& cells);
+
+	// Works out the formulas in changed cells and everything that depends
+	//  on them.  The formulas whose value changed (or that were set) are
+	//  added to values, with the value as contents.  Wide levels are
+	//  shared with workers, if given
+	void recalculate(const cell_list& changed, cell_list& values, ss_scheduler* workers = NULL);
+
+	// Works out every formula
+	void recalculate_all();
+
+	// Adds every formula's value to values
+	void values(cell_list& values);
+
+	// Returns roughly how much memory the graph uses
+	std::size_t memory_size();
+
+private:
+	struct node
+	{
+		formula expr;
+		cell_value value;
+	};
+
+	typedef boost::unordered_map<cell_address, node> node_map;
+	typedef boost::unordered_map<cell_address, std::vector<cell_address> > dependent_map;
+
+	// A level being worked out across the workers (see dependency_graph.cpp)
+	struct level_job;
+
+	// A formula on the path creates_cycle is walking, and the next of its
+	//  references to follow
+	struct walk_step
+	{
+		cell_address cell;
+		const std::vector<cell_address>* refs;
+		std::size_t next;
+	};
+
+	// Works out the formulas in dirty, each after those it refers to.  The
+	//  ones whose value changed (or that are in always) go in to values
+	void evaluate(const boost::unordered_set<cell_address>& dirty,
+			const boost::unordered_set<cell_address>& always, cell_list* values,
+			ss_scheduler* workers);
+
+	// Works out each formula in level, in to the same place in results,
+	//  without changing the graph
+	void evaluate_level(const std::vector<cell_address>& level,
+			std::vector<cell_value>& results, ss_scheduler* workers);
+
+	// Returns the value of a cell, for a formula that refers to it
+	cell_value value_of(cell_address cell);
+
+	// Adds the formulas that depend on cell to out, along with everything
+	//  that depends on them
+	void add_dependents(cell_address cell, boost::unordered_set<cell_address>& out);
+
+	// Lets evaluate() call value_of
+	struct lookup
+	{
+		dependency_graph* graph;
+		cell_value operator()(cell_address cell) { return graph->value_of(cell); }
+	};
+
+	// The formula cells
+	node_map nodes_;
+
+	// For each cell, the formulas that refer to it
+	dependent_map dependents_;
+
+	// Where other cells' contents come from
+	contents_lookup contents_;
+
+	// Roughly how much memory nodes_ and dependents_ use
+	std::size_t bytes_;
+};
+
+}
+#endif /* DEPENDENCY_GRAPH_H_ */
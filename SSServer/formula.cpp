@@ -0,0 +1,252 @@
+/*
+ * formula.cpp
+ *
+ *  Created on: May 3, 2013
+ *      Author: montgomc
+ */
+
+#include "formula.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace ss {
+
+const char* const value_error = "#VALUE!";
+const char* const div_zero_error = "#DIV/0!";
+const char* const syntax_error = "#SYNTAX!";
+const char* const circular_error = "#CIRCULAR!";
+
+const std::size_t formula::max_length;
+const unsigned int formula::max_depth;
+
+static void skip_spaces(const char*& pos, const char* end)
+{
+	while(pos != end && (*pos == ' ' || *pos == '\t'))
+		pos++;
+}
+
+static bool is_letter(char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+bool cell_value::operator==(const cell_value& other) const
+{
+	if(error || other.error)
+		return error == other.error;
+	return number == other.number;
+}
+
+std::string cell_value::str() const
+{
+	if(error)
+		return error;
+	char buf[32];
+	std::snprintf(buf, sizeof(buf), "%.15g", number);
+	return buf;
+}
+
+cell_value plain_value(const std::string& contents)
+{
+	cell_value result;
+	const char* pos = contents.c_str();
+	const char* end = pos + contents.length();
+	skip_spaces(pos, end);
+	if(pos == end)
+		return result;
+
+	char* parsed;
+	result.number = std::strtod(pos, &parsed);
+	const char* rest = parsed;
+	skip_spaces(rest, end);
+	if(parsed == pos || rest != end)
+		result.error = value_error;
+	return result;
+}
+
+bool formula::is_formula(const std::string& contents)
+{
+	return !contents.empty() && contents[0] == '=';
+}
+
+bool formula::too_complex(const std::string& contents)
+{
+	if(!is_formula(contents))
+		return false;
+	if(contents.length() > max_length)
+		return true;
+	formula parsed;
+	parsed.parse(contents);
+	return parsed.depth_ > max_depth;
+}
+
+bool formula::parse(const std::string& contents)
+{
+	ops_.clear();
+	references_.clear();
+	depth_ = 0;
+	if(contents.length() > max_length)
+	{
+		valid_ = false;
+		return false;
+	}
+	const char* pos = contents.c_str() + 1;
+	const char* end = contents.c_str() + contents.length();
+	valid_ = parse_sum(pos, end);
+	skip_spaces(pos, end);
+	if(pos != end)
+		valid_ = false;
+	if(!valid_)
+	{
+		ops_.clear();
+		references_.clear();
+		return false;
+	}
+
+	std::sort(references_.begin(), references_.end());
+	references_.erase(std::unique(references_.begin(), references_.end()), references_.end());
+	return true;
+}
+
+bool formula::parse_sum(const char*& pos, const char* end)
+{
+	if(!parse_product(pos, end))
+		return false;
+	for(;;)
+	{
+		skip_spaces(pos, end);
+		if(pos == end || (*pos != '+' && *pos != '-'))
+			return true;
+		op next;
+		next.type = *pos == '+' ? op::add : op::subtract;
+		pos++;
+		if(!parse_product(pos, end))
+			return false;
+		ops_.push_back(next);
+	}
+}
+
+bool formula::parse_product(const char*& pos, const char* end)
+{
+	if(!parse_factor(pos, end))
+		return false;
+	for(;;)
+	{
+		skip_spaces(pos, end);
+		if(pos == end || (*pos != '*' && *pos != '/'))
+			return true;
+		op next;
+		next.type = *pos == '*' ? op::multiply : op::divide;
+		pos++;
+		if(!parse_factor(pos, end))
+			return false;
+		ops_.push_back(next);
+	}
+}
+
+bool formula::parse_factor(const char*& pos, const char* end)
+{
+	skip_spaces(pos, end);
+	if(pos == end)
+		return false;
+
+	op next;
+	if(*pos == '(')
+	{
+		if(++depth_ > max_depth)
+			return false;
+		pos++;
+		if(!parse_sum(pos, end))
+			return false;
+		skip_spaces(pos, end);
+		if(pos == end || *pos != ')')
+			return false;
+		pos++;
+		depth_--;
+		return true;
+	}
+	if(*pos == '-' || *pos == '+')
+	{
+		if(++depth_ > max_depth)
+			return false;
+		bool negate = *pos == '-';
+		pos++;
+		if(!parse_factor(pos, end))
+			return false;
+		if(negate)
+		{
+			next.type = op::negate;
+			ops_.push_back(next);
+		}
+		depth_--;
+		return true;
+	}
+	if(is_letter(*pos))
+	{
+		const char* start = pos;
+		while(pos != end && is_letter(*pos))
+			pos++;
+		while(pos != end && is_digit(*pos))
+			pos++;
+		next.type = op::cell;
+		if(!parse_cell_address(start, pos - start, next.address))
+			return false;
+		ops_.push_back(next);
+		references_.push_back(next.address);
+		return true;
+	}
+	if(is_digit(*pos) || *pos == '.')
+	{
+		// strtod needs a terminated string - the contents are one
+		char* parsed;
+		next.type = op::number;
+		next.value = std::strtod(pos, &parsed);
+		if(parsed == pos || parsed > end)
+			return false;
+		pos = parsed;
+		ops_.push_back(next);
+		return true;
+	}
+	return false;
+}
+
+cell_value formula::apply(int type, const cell_value& a, const cell_value& b)
+{
+	if(a.error)
+		return a;
+	if(b.error)
+		return b;
+	cell_value result;
+	switch(type)
+	{
+	case op::add:
+		result.number = a.number + b.number;
+		break;
+	case op::subtract:
+		result.number = a.number - b.number;
+		break;
+	case op::multiply:
+		result.number = a.number * b.number;
+		break;
+	default:
+		if(b.number == 0)
+			result.error = div_zero_error;
+		else
+			result.number = a.number / b.number;
+		break;
+	}
+	return result;
+}
+
+std::size_t formula::memory_size() const
+{
+	return sizeof(formula) + ops_.capacity() * sizeof(op) + references_.capacity() * sizeof(cell_address);
+}
+
+}
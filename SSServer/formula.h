@@ -0,0 +1,142 @@
+/*
+ * formula.h
+ *
+ *  Created on: May 3, 2013
+ *      Author: montgomc
+ */
+
+#ifndef FORMULA_H_
+#define FORMULA_H_
+
+#include "cell_address.h"
+#include <string>
+#include <vector>
+
+namespace ss {
+
+// What a cell works out to: a number, or an error (e.g. "#DIV/0!")
+struct cell_value
+{
+	cell_value() : number(0), error(NULL) {}
+
+	double number;
+	// Null unless the value is an error
+	const char* error;
+
+	bool operator==(const cell_value& other) const;
+	bool operator!=(const cell_value& other) const { return !(*this == other); }
+
+	// Returns the value as it is sent to clients
+	std::string str() const;
+};
+
+// The errors a cell can work out to
+extern const char* const value_error;		// a cell that is not a number
+extern const char* const div_zero_error;	// division by zero
+extern const char* const syntax_error;		// a formula that does not parse
+extern const char* const circular_error;	// a cell that depends on itself
+
+// A parsed formula - cell contents beginning with '='.  Formulas are made
+//  of numbers, cell names, + - * / (and unary + -) and parentheses, e.g.
+//  "=(A1 + b2) * 3".  A formula that does not parse works out to an error,
+//  and refers to no cells, as does one longer than max_length or nested
+//  deeper than max_depth.
+class formula {
+public:
+	formula() : depth_(0), valid_(false) {}
+
+	// The longest formula, and the deepest nesting of parentheses and
+	//  unary signs, that parse.  The parser recurses once per level
+	static const std::size_t max_length = 8192;
+	static const unsigned int max_depth = 256;
+
+	// Returns whether contents are a formula
+	static bool is_formula(const std::string& contents);
+
+	// Returns whether contents are a formula longer or more deeply nested
+	//  than a formula may be
+	static bool too_complex(const std::string& contents);
+
+	// Parses a formula.  Returns false if it does not parse
+	bool parse(const std::string& contents);
+
+	// The cells the formula refers to, each once
+	const std::vector<cell_address>& references() const { return references_; }
+
+	// Works the formula out.  lookup(cell) must return the value of a cell
+	//  the formula refers to
+	template <typename Lookup>
+	cell_value evaluate(Lookup& lookup) const;
+
+	// Returns roughly how much memory the formula uses
+	std::size_t memory_size() const;
+
+private:
+	// One step of the formula, in reverse polish order
+	struct op
+	{
+		enum { number, cell, negate, add, subtract, multiply, divide } type;
+		double value;
+		cell_address address;
+	};
+
+	// Recursive descent over the contents - each returns false on a
+	//  syntax error, or nesting past max_depth
+	bool parse_sum(const char*& pos, const char* end);
+	bool parse_product(const char*& pos, const char* end);
+	bool parse_factor(const char*& pos, const char* end);
+
+	// Applies an operator to the top of the stack
+	static cell_value apply(int type, const cell_value& a, const cell_value& b);
+
+	std::vector<op> ops_;
+	std::vector<cell_address> references_;
+	// How deep the parser is - left past max_depth if that stopped it
+	unsigned int depth_;
+	bool valid_;
+};
+
+// Parses the contents of a cell that is not a formula as a number: empty
+//  is 0, and anything that is not a number is an error
+cell_value plain_value(const std::string& contents);
+
+template <typename Lookup>
+cell_value formula::evaluate(Lookup& lookup) const
+{
+	cell_value result;
+	if(!valid_)
+	{
+		result.error = syntax_error;
+		return result;
+	}
+
+	std::vector<cell_value> stack;
+	for(std::vector<op>::const_iterator it = ops_.begin(); it != ops_.end(); ++it)
+	{
+		switch(it->type)
+		{
+		case op::number:
+			stack.push_back(cell_value());
+			stack.back().number = it->value;
+			break;
+		case op::cell:
+			stack.push_back(lookup(it->address));
+			break;
+		case op::negate:
+			if(!stack.back().error)
+				stack.back().number = -stack.back().number;
+			break;
+		default:
+		{
+			cell_value b = stack.back();
+			stack.pop_back();
+			stack.back() = apply(it->type, stack.back(), b);
+			break;
+		}
+		}
+	}
+	return stack.back();
+}
+
+}
+#endif /* FORMULA_H_ */
@@ -0,0 +1,127 @@
+/*
+ * line_scanner.cpp
+ *
+ *  Created on: May 4, 2013
+ *      Author: montgomc
+ */
+
+#include "line_scanner.h"
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SS_SCAN_X86
+#endif
+
+namespace ss {
+
+// Returns the position of the lowest set bit in a non-zero mask
+static inline unsigned int lowest_bit(boost::uint32_t mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	unsigned int bit = 0;
+	while((mask & 1) == 0)
+	{
+		mask >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+#if defined(SS_SCAN_X86) && !defined(SS_SCAN_NO_SSE2)
+__attribute__((target("sse2")))
+static const char* find_block_sse2(const char* pos, const char* end, boost::uint32_t& mask)
+{
+	const __m128i newline = _mm_set1_epi8('\n');
+	for(; end - pos >= 16; pos += 16)
+	{
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+		if(mask != 0)
+			return pos;
+	}
+	mask = 0;
+	return pos;
+}
+#endif
+
+#if defined(SS_SCAN_X86) && !defined(SS_SCAN_NO_AVX2) && !defined(SS_SCAN_NO_SSE2)
+__attribute__((target("avx2")))
+static const char* find_block_avx2(const char* pos, const char* end, boost::uint32_t& mask)
+{
+	const __m256i newline = _mm256_set1_epi8('\n');
+	for(; end - pos >= 32; pos += 32)
+	{
+		__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+		if(mask != 0)
+			return pos;
+	}
+	mask = 0;
+	return pos;
+}
+#endif
+
+// Without block comparisons, everything is left to memchr
+static const char* find_block_none(const char* pos, const char*, boost::uint32_t& mask)
+{
+	mask = 0;
+	return pos;
+}
+
+const line_scanner::method_info& line_scanner::pick()
+{
+	static const method_info none = { 0, &find_block_none };
+#ifdef SS_SCAN_X86
+	__builtin_cpu_init();
+#if !defined(SS_SCAN_NO_AVX2) && !defined(SS_SCAN_NO_SSE2)
+	static const method_info avx2 = { 32, &find_block_avx2 };
+	if(__builtin_cpu_supports("avx2"))
+		return avx2;
+#endif
+#ifndef SS_SCAN_NO_SSE2
+	static const method_info sse2 = { 16, &find_block_sse2 };
+	if(__builtin_cpu_supports("sse2"))
+		return sse2;
+#endif
+#endif
+	return none;
+}
+
+const line_scanner::method_info& line_scanner::method_ = line_scanner::pick();
+
+line_scanner::line_scanner(const char* end)
+	: block_(NULL),
+	  mask_(0),
+	  end_(end)
+{
+}
+
+const char* line_scanner::next(const char* pos)
+{
+	// The rest of the current block is already known.  pos may still be
+	//  short of the block, but the block was found from before pos, so
+	//  there is no '\n' in between
+	if(block_ != NULL && pos < block_ + method_.width)
+	{
+		std::size_t skip = pos > block_ ? pos - block_ : 0;
+		boost::uint32_t left = mask_ & (~boost::uint32_t(0) << skip);
+		if(left != 0)
+			return block_ + lowest_bit(left);
+		pos = block_ + method_.width;
+	}
+
+	block_ = method_.find(pos, end_, mask_);
+	if(mask_ != 0)
+		return block_ + lowest_bit(mask_);
+
+	// Too little is left for a block
+	pos = block_;
+	block_ = NULL;
+	return static_cast<const char*>(std::memchr(pos, '\n', end_ - pos));
+}
+
+}
@@ -0,0 +1,62 @@
+/*
+ * line_scanner.h
+ *
+ *  Created on: May 4, 2013
+ *      Author: montgomc
+ */
+
+#ifndef LINE_SCANNER_H_
+#define LINE_SCANNER_H_
+
+#include <cstddef>
+#include <boost/cstdint.hpp>
+
+namespace ss {
+
+// Finds the line terminators in a buffer of socket data.  Most lines in a
+//  request are short headers, so rather than searching again for each one,
+//  the buffer is compared a block (16 or 32 bytes) at a time, and the
+//  positions of every '\n' in the block are kept as a bit mask - the next
+//  few lines are then found without looking at the data again.
+//
+// The block comparison uses AVX2 or SSE2, whichever the CPU has (checked
+//  once, at startup).  Anywhere else, and for the tail of the buffer too
+//  short for a block, it falls back to memchr.  Building with
+//  SS_SCAN_NO_AVX2 or SS_SCAN_NO_SSE2 rules a method out, so the others can
+//  be tested on a CPU that has it (see tests/line_scanner_check.cpp).
+class line_scanner {
+public:
+	// Scans data that ends at end
+	explicit line_scanner(const char* end);
+
+	// Returns the first '\n' at or after pos, or NULL if there is none.
+	//  pos may not go back before where an earlier call looked from
+	const char* next(const char* pos);
+
+private:
+	// Finds the first block, from pos on, that holds a '\n', and sets
+	//  mask to where they are in it.  Returns the block, or the start of
+	//  the tail (with mask 0) if there is none
+	typedef const char* (*block_finder)(const char* pos, const char* end, boost::uint32_t& mask);
+
+	// The block size and finder for this CPU
+	struct method_info
+	{
+		std::size_t width;
+		block_finder find;
+	};
+	static const method_info& pick();
+	static const method_info& method_;
+
+	// The block mask_ describes, or NULL if there is none
+	const char* block_;
+
+	// The '\n's in block_, one bit per byte
+	boost::uint32_t mask_;
+
+	// The end of the data
+	const char* end_;
+};
+
+}
+#endif /* LINE_SCANNER_H_ */
@@ -0,0 +1,89 @@
+/*
+ * mpsc_queue.h
+ *
+ *  Created on: Apr 29, 2013
+ *      Author: montgomc
+ */
+
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace ss {
+
+// A lock-free queue that any number of threads may push on to, and one
+//  thread at a time pops from.  Pushing is a single atomic exchange, so
+//  producers never wait on each other or on the consumer.
+//
+// The queue is a linked list that always holds one node whose value has
+//  already been taken (tail_).  A producer swaps its node in as the new
+//  head, then links the old head to it - until it has done both, pop()
+//  can not see the new node yet (but empty() already reports it).
+template <typename T>
+class mpsc_queue : private boost::noncopyable {
+public:
+	mpsc_queue()
+	{
+		node* stub = new node();
+		head_.store(stub);
+		tail_ = stub;
+	}
+
+	~mpsc_queue()
+	{
+		T value;
+		while(pop(value))
+		{
+		}
+		delete tail_;
+	}
+
+	// Adds a value to the queue - may be called from any thread
+	void push(const T& value)
+	{
+		node* added = new node();
+		added->value = value;
+		node* prev = head_.exchange(added, boost::memory_order_acq_rel);
+		prev->next.store(added, boost::memory_order_release);
+	}
+
+	// Takes the oldest value off the queue.  Returns false if there is
+	//  nothing to take - consumer only
+	bool pop(T& value)
+	{
+		node* next = tail_->next.load(boost::memory_order_acquire);
+		if(next == NULL)
+			return false;
+		value = next->value;
+		next->value = T();
+		delete tail_;
+		tail_ = next;
+		return true;
+	}
+
+	// Returns whether nothing has been pushed that has not been popped -
+	//  consumer only
+	bool empty()
+	{
+		return head_.load(boost::memory_order_acquire) == tail_;
+	}
+
+private:
+	struct node
+	{
+		node() : next(NULL) {}
+		boost::atomic<node*> next;
+		T value;
+	};
+
+	// The most recently pushed node
+	boost::atomic<node*> head_;
+
+	// The node before the oldest value
+	node* tail_;
+};
+
+}
+#endif /* MPSC_QUEUE_H_ */
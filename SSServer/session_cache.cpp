@@ -0,0 +1,98 @@
+/*
+ * session_cache.cpp
+ *
+ *  Created on: Apr 28, 2013
+ *      Author: montgomc
+ */
+
+#include "session_cache.h"
+
+namespace ss {
+
+session_cache::session_cache(std::size_t budget)
+	: budget_(budget),
+	  used_(0),
+	  hits_(0),
+	  misses_(0),
+	  evictions_(0)
+{
+}
+
+ss_session_ptr session_cache::take(const std::string& name)
+{
+	boost::unordered_map<std::string, std::list<entry>::iterator>::iterator it = index_.find(name);
+	if(it == index_.end())
+	{
+		misses_++;
+		return ss_session_ptr();
+	}
+
+	hits_++;
+	ss_session_ptr session = it->second->session;
+	used_ -= it->second->size;
+	lru_.erase(it->second);
+	index_.erase(it);
+	return session;
+}
+
+void session_cache::put(ss_session_ptr session, std::vector<ss_session_ptr>& evicted)
+{
+	entry added;
+	added.session = session;
+	added.size = session->memory_size();
+	lru_.push_front(added);
+	index_[session->name()] = lru_.begin();
+	used_ += added.size;
+	evict(evicted);
+}
+
+void session_cache::trim(std::vector<ss_session_ptr>& evicted)
+{
+	evict(evicted);
+}
+
+void session_cache::evict(std::vector<ss_session_ptr>& evicted)
+{
+	// Work from the least recently used end, passing over sessions that
+	//  are still saving - they are freed by trim() once they finish
+	std::list<entry>::iterator it = lru_.end();
+	while(used_ > budget_ && it != lru_.begin())
+	{
+		--it;
+		if(it->session->is_saving())
+			continue;
+		used_ -= it->size;
+		index_.erase(it->session->name());
+		evicted.push_back(it->session);
+		it = lru_.erase(it);
+		evictions_++;
+	}
+}
+
+void session_cache::close_all()
+{
+	for(std::list<entry>::iterator it = lru_.begin(); it != lru_.end(); ++it)
+	{
+		it->session->close();
+	}
+	lru_.clear();
+	index_.clear();
+	used_ = 0;
+}
+
+unsigned long session_cache::hits()
+{
+	return hits_;
+}
+
+unsigned long session_cache::misses()
+{
+	return misses_;
+}
+
+unsigned long session_cache::evictions()
+{
+	return evictions_;
+}
+
+}
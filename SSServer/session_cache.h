@@ -0,0 +1,89 @@
+/*
+ * session_cache.h
+ *
+ *  Created on: Apr 28, 2013
+ *      Author: montgomc
+ */
+
+#ifndef SESSION_CACHE_H_
+#define SESSION_CACHE_H_
+
+#include "ss_session.h"
+#include <list>
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+namespace ss {
+
+// Holds sessions that no client is using any more, so a spreadsheet that
+//  is opened again soon after it was closed does not have to be loaded
+//  from disk.  The least recently used sessions are freed once the
+//  spreadsheets they hold add up to more than the memory budget.
+//
+// A session still writing its last save is not freed until the save has
+//  finished, so two saves of the same file are never written at once.  It
+//  still counts against the budget, and is pushed out by trim() once the
+//  save is done.
+//
+// The cache has no lock of its own - the server only uses it while it
+//  holds its sessions lock.
+class session_cache {
+public:
+	// Creates a cache holding up to budget bytes of spreadsheets
+	session_cache(std::size_t budget);
+
+	// Takes the named session out of the cache.  Returns null if it is
+	//  not there
+	ss_session_ptr take(const std::string& name);
+
+	// Adds a session that has just become idle, as the most recently
+	//  used, and pushes sessions out to get back under the budget.  They
+	//  are handed back in evicted, for the caller to free once it has let
+	//  go of its lock.  Call from within the session
+	void put(ss_session_ptr session, std::vector<ss_session_ptr>& evicted);
+
+	// Pushes out sessions that were passed over while they were saving,
+	//  if the cache is still over the budget.  Call once a save finishes
+	void trim(std::vector<ss_session_ptr>& evicted);
+
+	// Saves and frees every session in the cache - for shutdown, once
+	//  nothing else is running
+	void close_all();
+
+	// Counters
+	unsigned long hits();
+	unsigned long misses();
+	unsigned long evictions();
+
+private:
+	// Takes out least recently used sessions until the cache fits the
+	//  budget
+	void evict(std::vector<ss_session_ptr>& evicted);
+
+	struct entry
+	{
+		ss_session_ptr session;
+		// The session's memory_size() when it was added
+		std::size_t size;
+	};
+
+	// The sessions, most recently used first
+	std::list<entry> lru_;
+
+	// Finds a session in lru_ by name
+	boost::unordered_map<std::string, std::list<entry>::iterator> index_;
+
+	// The memory budget, and how much of it is used
+	std::size_t budget_;
+	std::size_t used_;
+
+	// Lookups that found a session, lookups that did not, and sessions
+	//  freed to stay under the budget
+	unsigned long hits_;
+	unsigned long misses_;
+	unsigned long evictions_;
+};
+
+}
+#endif /* SESSION_CACHE_H_ */
@@ -6,43 +6,654 @@
  */
 
 #include "spreadsheet.h"
+#include "spreadsheet_file.h"
 #include <string>
-#include <boost/algorithm/string.hpp>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xmlmemory.h>
 #include <libxml/xmlIO.h>
-#include <libxml/xinclude.h>
-#include <libxml/xmlschemastypes.h>
 #include <iostream>
 #include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/bind.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 namespace ss {
 
-spreadsheet::spreadsheet(std::string filename, std::string root_dir)
-	: full_filename_(root_dir + filename)
+// Once the journal is this big, the session compacts it in to a new
+//  XML snapshot
+static const std::size_t journal_compact_size = 4 << 20;
+
+// A guess at the memory a cell store entry uses, besides its strings
+static const std::size_t cell_overhead = 64;
+
+// Returns the text content of a node as a std::string (libxml2 hands back
+//  a malloc'd copy, which must be freed)
+static std::string node_content(xmlNodePtr node)
+{
+	xmlChar* content = xmlNodeGetContent(node);
+	if(content == NULL)
+		return "";
+	std::string res((const char*)content);
+	xmlFree(content);
+	return res;
+}
+
+// Appends s to out, escaping the characters that are not allowed in xml
+//  text.  Newlines are written as character references so the result
+//  stays on a single line.
+static void append_escaped(std::string& out, const char* s, std::size_t length)
+{
+	for(const char* it = s; it != s + length; ++it)
+	{
+		switch(*it)
+		{
+		case '&':
+			out += "&amp;";
+			break;
+		case '<':
+			out += "&lt;";
+			break;
+		case '>':
+			out += "&gt;";
+			break;
+		case '"':
+			out += "&quot;";
+			break;
+		case '\n':
+			out += "&#10;";
+			break;
+		case '\r':
+			out += "&#13;";
+			break;
+		default:
+			out += *it;
+			break;
+		}
+	}
+}
+
+// Returns the length append_escaped would add for s
+static std::size_t escaped_length(const char* s, std::size_t length)
+{
+	std::size_t len = length;
+	for(const char* it = s; it != s + length; ++it)
+	{
+		switch(*it)
+		{
+		case '&':
+			len += 4;
+			break;
+		case '<':
+		case '>':
+			len += 3;
+			break;
+		case '"':
+			len += 5;
+			break;
+		case '\n':
+		case '\r':
+			len += 4;
+			break;
+		}
+	}
+	return len;
+}
+
+// The pieces of the xml written by as_xml_string and spreadsheet_xml_stream
+static const std::string xml_open = "<?xml version=\"1.0\" encoding=\"UTF-8\"?> <spreadsheet";
+static const std::string xml_version_open = " version=\"";
+static const std::string xml_close = "</spreadsheet>";
+static const std::string xml_cell_open = "<cell><name>";
+static const std::string xml_name_close = "</name>";
+static const std::string xml_empty_contents = "<contents/>";
+static const std::string xml_contents_open = "<contents>";
+static const std::string xml_contents_close = "</contents>";
+static const std::string xml_cell_close = "</cell>";
+
+// Appends the opening <spreadsheet> tag (which closes itself if there are
+//  no cells)
+static void append_xml_open(std::string& out, const std::string& version, bool empty)
+{
+	out += xml_open;
+	if(!version.empty())
+	{
+		out += xml_version_open;
+		append_escaped(out, version.data(), version.length());
+		out += '"';
+	}
+	out += empty ? "/>" : ">";
+}
+
+// Returns a cell_ref for a cell in a cell_map, given its name
+static cell_ref make_ref(const char* name, std::size_t name_length, const std::string& contents)
+{
+	cell_ref ref;
+	ref.name = name;
+	ref.name_length = name_length;
+	ref.contents = contents.data();
+	ref.contents_length = contents.length();
+	return ref;
+}
+
+// Appends a <cell> element
+static void append_cell_xml(std::string& out, const cell_ref& cell)
+{
+	out += xml_cell_open;
+	append_escaped(out, cell.name, cell.name_length);
+	out += xml_name_close;
+	if(cell.contents_length == 0)
+	{
+		out += xml_empty_contents;
+	}
+	else
+	{
+		out += xml_contents_open;
+		append_escaped(out, cell.contents, cell.contents_length);
+		out += xml_contents_close;
+	}
+	out += xml_cell_close;
+}
+
+// Returns the length append_cell_xml would add
+static std::size_t cell_xml_length(const cell_ref& cell)
+{
+	std::size_t len = xml_cell_open.length() + escaped_length(cell.name, cell.name_length) + xml_name_close.length() + xml_cell_close.length();
+	if(cell.contents_length == 0)
+		len += xml_empty_contents.length();
+	else
+		len += xml_contents_open.length() + escaped_length(cell.contents, cell.contents_length) + xml_contents_close.length();
+	return len;
+}
+
+// Appends a number to out, little endian
+static void put_u32(std::string& out, boost::uint32_t val)
+{
+	char bytes[4];
+	bytes[0] = val & 0xff;
+	bytes[1] = (val >> 8) & 0xff;
+	bytes[2] = (val >> 16) & 0xff;
+	bytes[3] = (val >> 24) & 0xff;
+	out.append(bytes, 4);
+}
+
+// Appends a string to out, as its length and then its bytes
+static void put_string(std::string& out, const std::string& s)
+{
+	put_u32(out, s.length());
+	out += s;
+}
+
+// Reads a whole file in to data with one read.  Returns false if the file
+//  could not be opened
+static bool read_file(const std::string& filename, std::string& data)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd == -1)
+		return false;
+
+	data.clear();
+	struct stat st;
+	if(fstat(fd, &st) == 0)
+	{
+		data.resize(st.st_size);
+		std::size_t got = 0;
+		while(got < data.size())
+		{
+			ssize_t res = ::read(fd, &data[got], data.size() - got);
+			if(res <= 0)
+				break;
+			got += res;
+		}
+		data.resize(got);
+	}
+	::close(fd);
+	return true;
+}
+
+// Writes data to a new file.  Returns false if it could not all be written
+static bool write_file(const std::string& filename, const std::string& data)
+{
+	int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1)
+		return false;
+
+	const char* buf = data.data();
+	std::size_t left = data.length();
+	while(left > 0)
+	{
+		ssize_t res = ::write(fd, buf, left);
+		if(res == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		buf += res;
+		left -= res;
+	}
+	return ::close(fd) == 0 && left == 0;
+}
+
+// The largest number a binary file can hold
+static const std::size_t max_u32 = 0xFFFFFFFF;
+
+// Builds the binary file for a snapshot.  Returns false (and builds
+//  nothing) if a count, length or offset would not fit in 32 bits
+static bool encode_binary(const spreadsheet_snapshot& snap, std::string& out)
+{
+	std::vector<cell_ref> cells;
+	cells.reserve((snap.file ? snap.file->size() : 0) + snap.cells->size() + (snap.changes ? snap.changes->size() : 0));
+	std::size_t table_length = 0;
+	std::size_t cells_xml_length = 0;
+	cell_cursor cursor(snap.file, snap.cells, snap.changes, true);
+	cell_ref cell;
+	while(cursor.next(cell))
+	{
+		cells.push_back(cell);
+		table_length += 8 + cell.name_length + cell.contents_length;
+		cells_xml_length += cell_xml_length(cell);
+	}
+
+	// Every offset and cell length is less than the table's length
+	if(cells.size() > max_u32 || cells_xml_length > max_u32 || table_length > max_u32 ||
+			snap.name.length() > max_u32 || snap.password.length() > max_u32 || snap.version.length() > max_u32)
+	{
+		std::cerr << "Spreadsheet " << snap.name << " is too big for the binary format" << std::endl;
+		return false;
+	}
+
+	out.clear();
+	out.reserve(32 + snap.name.length() + snap.password.length() + snap.version.length() + 4 * cells.size() + table_length);
+	out.append(spreadsheet_file::magic, sizeof(spreadsheet_file::magic));
+	put_u32(out, spreadsheet_file::format_version);
+	put_u32(out, cells.size());
+	put_u32(out, cells_xml_length);
+	put_string(out, snap.name);
+	put_string(out, snap.password);
+	put_string(out, snap.version);
+
+	// Offsets, so a cell can be found without reading the ones before it
+	boost::uint32_t offset = 0;
+	for(std::size_t x = 0; x < cells.size(); x++)
+	{
+		put_u32(out, offset);
+		offset += 8 + cells[x].name_length + cells[x].contents_length;
+	}
+	for(std::size_t x = 0; x < cells.size(); x++)
+	{
+		put_u32(out, cells[x].name_length);
+		out.append(cells[x].name, cells[x].name_length);
+		put_u32(out, cells[x].contents_length);
+		out.append(cells[x].contents, cells[x].contents_length);
+	}
+	return true;
+}
+
+// Writes the xml file for a snapshot.  Returns false if it could not be
+//  written
+static bool write_xml(const spreadsheet_snapshot& snap, const std::string& filename)
+{
+	// Rebuild the document from the cell store
+	xmlDocPtr doc = xmlNewDoc((const xmlChar*)"1.0");
+	xmlNodePtr root = xmlNewNode(NULL, (const xmlChar*)"server_ss");
+	xmlDocSetRootElement(doc, root);
+	xmlNewTextChild(root, NULL, (const xmlChar*)"ssName", (const xmlChar*)(snap.name.c_str()));
+	xmlNewTextChild(root, NULL, (const xmlChar*)"password", (const xmlChar*)(snap.password.c_str()));
+	xmlNodePtr ss_node = xmlNewChild(root, NULL, (const xmlChar*)"spreadsheet", NULL);
+	if(!snap.version.empty())
+		xmlSetProp(ss_node, (const xmlChar*)"version", (const xmlChar*)(snap.version.c_str()));
+
+	cell_cursor cursor(snap.file, snap.cells, snap.changes, false);
+	cell_ref ref;
+	while(cursor.next(ref))
+	{
+		xmlNodePtr cell = xmlNewChild(ss_node, NULL, (const xmlChar*)"cell", NULL);
+		std::string name(ref.name, ref.name_length);
+		std::string contents(ref.contents, ref.contents_length);
+		xmlNewTextChild(cell, NULL, (const xmlChar*)"name", (const xmlChar*)(name.c_str()));
+		xmlNewTextChild(cell, NULL, (const xmlChar*)"contents", (const xmlChar*)(contents.c_str()));
+	}
+
+	const char* enc = "UTF-8";
+	int res = xmlSaveFormatFileEnc(filename.c_str(), doc, enc, 1);
+	xmlFreeDoc(doc);
+	return res != -1;
+}
+
+bool cell_cursor::name_less(const changed_cell& a, const changed_cell& b)
+{
+	return spreadsheet_file::compare(a.name, a.name_length, b.name, b.name_length) < 0;
+}
+
+cell_cursor::cell_cursor(spreadsheet_file_ptr file, boost::shared_ptr<const cell_map> cells,
+		boost::shared_ptr<const cell_map> changes, bool sorted)
+	: file_(file),
+	  cells_(cells),
+	  changes_(changes),
+	  unsorted_(!sorted && (!file || file->size() == 0)),
+	  next_cell_(cells->begin()),
+	  cells_end_(cells->end()),
+	  in_changes_(false),
+	  next_file_(0),
+	  next_changed_(0)
+{
+	// Nothing to merge (no file, or an empty one) - the maps are walked as
+	//  they are, so a JOIN stream holds no more than a cell
+	if(unsorted_)
+		return;
+
+	// Write out every changed cell's name up front - the names (and so the
+	//  refs handed out) then stay put for as long as the cursor does
+	std::size_t count = cells->size() + (changes ? changes->size() : 0);
+	names_.resize(count * max_cell_name);
+	changed_.reserve(count);
+	char* name = names_.empty() ? NULL : &names_[0];
+	add_changed(*cells, changes.get(), name);
+	if(changes)
+	{
+		add_changed(*changes, NULL, name);
+	}
+	// Merging with the file needs the changed cells in its order too
+	std::sort(changed_.begin(), changed_.end(), name_less);
+}
+
+void cell_cursor::add_changed(const cell_map& cells, const cell_map* skip, char*& name)
+{
+	for(cell_map::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		if(skip && skip->count(it->first))
+			continue;
+		changed_cell cell;
+		cell.name = name;
+		cell.name_length = format_cell_address(it->first, name);
+		cell.contents = &it->second;
+		changed_.push_back(cell);
+		name += max_cell_name;
+	}
+}
+
+bool cell_cursor::next_unsorted(cell_ref& out)
+{
+	for(;;)
+	{
+		if(next_cell_ == cells_end_)
+		{
+			if(in_changes_ || !changes_)
+				return false;
+			in_changes_ = true;
+			next_cell_ = changes_->begin();
+			cells_end_ = changes_->end();
+			continue;
+		}
+		const cell_map::value_type& cell = *next_cell_++;
+		// A cell in the overlay is handed out from there instead
+		if(!in_changes_ && changes_ && changes_->count(cell.first))
+			continue;
+		out = make_ref(name_, format_cell_address(cell.first, name_), cell.second);
+		return true;
+	}
+}
+
+bool cell_cursor::next(cell_ref& out)
+{
+	if(unsorted_)
+		return next_unsorted(out);
+
+	bool have_file = file_ && next_file_ < file_->size();
+	bool have_changed = next_changed_ < changed_.size();
+	if(!have_changed)
+	{
+		if(!have_file)
+			return false;
+		file_->cell(next_file_++, out);
+		return true;
+	}
+
+	const changed_cell& changed = changed_[next_changed_];
+	if(have_file)
+	{
+		// Take whichever comes first - a changed cell replaces the one in
+		//  the file
+		file_->cell(next_file_, out);
+		int cmp = spreadsheet_file::compare(out.name, out.name_length, changed.name, changed.name_length);
+		if(cmp < 0)
+		{
+			next_file_++;
+			return true;
+		}
+		if(cmp == 0)
+			next_file_++;
+	}
+	out = make_ref(changed.name, changed.name_length, *changed.contents);
+	next_changed_++;
+	return true;
+}
+
+spreadsheet_xml_stream::spreadsheet_xml_stream(spreadsheet_file_ptr file, boost::shared_ptr<const cell_map> cells,
+		boost::shared_ptr<const cell_map> changes, const std::string& version)
+	: cursor_(file, cells, changes, false),
+	  empty_(cells->empty() && (!changes || changes->empty()) && (!file || file->size() == 0)),
+	  version_(version),
+	  started_(false),
+	  finished_(false),
+	  pending_pos_(0)
+{
+}
+
+bool spreadsheet_xml_stream::next_chunk(std::string& chunk, std::size_t max)
+{
+	chunk.clear();
+	while(chunk.length() < max)
+	{
+		if(pending_pos_ == pending_.length() && !render_next())
+			break;
+		std::size_t take = pending_.length() - pending_pos_;
+		if(take > max - chunk.length())
+			take = max - chunk.length();
+		chunk.append(pending_, pending_pos_, take);
+		pending_pos_ += take;
+	}
+	return !chunk.empty();
+}
+
+bool spreadsheet_xml_stream::render_next()
+{
+	pending_.clear();
+	pending_pos_ = 0;
+	if(!started_)
+	{
+		append_xml_open(pending_, version_, empty_);
+		started_ = true;
+		// An empty spreadsheet is a single self-closing tag
+		finished_ = empty_;
+	}
+	else if(cursor_.next(cell_))
+	{
+		append_cell_xml(pending_, cell_);
+	}
+	else if(!finished_)
+	{
+		pending_ = xml_close;
+		finished_ = true;
+	}
+	return !pending_.empty();
+}
+
+spreadsheet::spreadsheet(std::string filename, std::string root_dir, const ss_config& config)
+	: full_filename_(root_dir + filename),
+	  journal_filename_(root_dir + filename + ".journal"),
+	  old_journal_filename_(root_dir + filename + ".journal.old"),
+	  journal_fd_(-1),
+	  journal_size_(0),
+	  cells_(new cell_map()),
+	  new_cells_(0),
+	  cells_bytes_(0),
+	  cells_xml_length_(0),
+	  xml_(config.xml_files),
+	  lazy_(config.lazy_load),
+	  formulas_(config.formulas)
 {
 }
 
 spreadsheet::~spreadsheet()
 {
-	xmlFreeDoc(ss_);
+	if(journal_fd_ != -1)
+		::close(journal_fd_);
 }
 
 // Throws saving errors - to be caught by ss_session, to know to send
 //  SAVE FAIL
 void spreadsheet::save()
 {
-	// We are letting errors pass up the stack, to ss_session
-	const char* file = full_filename_.c_str();
-	const char* enc = "UTF-8";
-	int res = xmlSaveFormatFileEnc(file, ss_, enc, 1);
+	write_snapshot(*snapshot());
+}
+
+spreadsheet_snapshot_ptr spreadsheet::snapshot()
+{
+	spreadsheet_snapshot_ptr snap(new spreadsheet_snapshot());
+	snap->full_filename = full_filename_;
+	snap->old_journal_filename = old_journal_filename_;
+	snap->name = name_;
+	snap->password = password_;
+	snap->version = version_;
+	snap->file = file_;
+	snap->cells = cells_;
+	snap->changes = changes_;
+	snap->xml = xml_;
+
+	// Changes from here on belong to the next snapshot
+	rotate_journal();
+	return snap;
+}
 
-	if(res == -1)
+void spreadsheet::write_snapshot(const spreadsheet_snapshot& snap)
+{
+	// We are letting errors pass up the stack, to ss_session.
+	// Write to a temporary file and rename it in to place, so a crash
+	//  part way through leaves the old snapshot (and its journal) intact
+	std::string tmp_file = snap.full_filename + ".tmp";
+	bool written;
+	if(snap.xml)
+	{
+		written = write_xml(snap, tmp_file);
+	}
+	else
+	{
+		// A spreadsheet the format can't hold is not saved - its journal is
+		//  kept, so no change is lost
+		std::string data;
+		written = encode_binary(snap, data) && write_file(tmp_file, data);
+	}
+
+	if(!written || std::rename(tmp_file.c_str(), snap.full_filename.c_str()) != 0)
 	{
 		// TODO figure out how to pass a message
 		throw new std::exception();
 	}
+
+	// The snapshot holds everything in the old journal now
+	if(!snap.old_journal_filename.empty() && unlink(snap.old_journal_filename.c_str()) == -1 && errno != ENOENT)
+	{
+		std::cerr << "Could not remove journal " << snap.old_journal_filename << ": " << std::strerror(errno) << std::endl;
+	}
+}
+
+void spreadsheet::rotate_journal()
+{
+	if(journal_fd_ != -1)
+	{
+		::close(journal_fd_);
+		journal_fd_ = -1;
+	}
+	journal_size_ = 0;
+
+	// Normally there is no old journal, and the current one is just
+	//  renamed.  If an earlier snapshot failed to write, the old journal
+	//  is still there - its changes are not on disk yet, so the current
+	//  journal is added to the end of it instead.
+	if(access(old_journal_filename_.c_str(), F_OK) == -1)
+	{
+		if(std::rename(journal_filename_.c_str(), old_journal_filename_.c_str()) == -1 && errno != ENOENT)
+		{
+			std::cerr << "Could not move journal " << journal_filename_ << ": " << std::strerror(errno) << std::endl;
+		}
+		return;
+	}
+
+	int in = ::open(journal_filename_.c_str(), O_RDONLY);
+	if(in == -1)
+		return;
+	int out = ::open(old_journal_filename_.c_str(), O_WRONLY | O_APPEND);
+	bool ok = out != -1;
+	char buf[65536];
+	ssize_t got;
+	while(ok && (got = ::read(in, buf, sizeof(buf))) > 0)
+	{
+		ok = ::write(out, buf, got) == got;
+	}
+	::close(in);
+	if(out != -1)
+		::close(out);
+	if(ok)
+	{
+		unlink(journal_filename_.c_str());
+	}
+	else
+	{
+		std::cerr << "Could not move journal " << journal_filename_ << ": " << std::strerror(errno) << std::endl;
+	}
+}
+
+bool spreadsheet::needs_compaction()
+{
+	return journal_size_ >= journal_compact_size;
+}
+
+bool spreadsheet::modified()
+{
+	// An old journal is left behind if its snapshot could not be written
+	return journal_size_ > 0 || access(old_journal_filename_.c_str(), F_OK) == 0;
+}
+
+cell_map& spreadsheet::writable_cells()
+{
+	if(cells_.unique())
+	{
+		// Nothing shares the cell store any more - fold the overlay back in
+		if(changes_)
+		{
+			bool own = changes_.unique();
+			for(cell_map::iterator it = changes_->begin(); it != changes_->end(); ++it)
+			{
+				std::string& contents = (*cells_)[it->first];
+				if(own)
+					contents.swap(it->second);
+				else
+					contents = it->second;
+			}
+			changes_.reset();
+		}
+		return *cells_;
+	}
+
+	// A snapshot or stream still has the cell store - leave it be
+	if(!changes_)
+	{
+		changes_.reset(new cell_map());
+	}
+	else if(!changes_.unique())
+	{
+		changes_.reset(new cell_map(*changes_));
+	}
+	return *changes_;
 }
 
 // Throws loading errors - to be caught by ss_session, to know to send
@@ -51,100 +662,380 @@ void spreadsheet::load()
 {
 	// We are letting exceptions pass up the stack, to ss_session
 
-	// Load the xml from disk (c library xml2 requires c strings)
-	ss_ = xmlReadFile(full_filename_.c_str(), NULL, 0);
+	file_.reset();
+	cells_.reset(new cell_map());
+	changes_.reset();
+	new_cells_ = 0;
+	cells_bytes_ = 0;
+	cells_xml_length_ = 0;
+	if(spreadsheet_file::is_binary(full_filename_))
+	{
+		// Map the file.  Lazily, the cells are left in the mapping, and
+		//  the cell store only holds the ones that change
+		spreadsheet_file_ptr file(new spreadsheet_file(full_filename_));
+		name_ = file->name();
+		password_ = file->password();
+		version_ = file->version();
+		cells_xml_length_ = file->cells_xml_length();
+		if(lazy_)
+		{
+			file_ = file;
+		}
+		else
+		{
+			cells_->reserve(file->size());
+			cell_ref cell;
+			cell_address address;
+			for(std::size_t x = 0; x < file->size(); x++)
+			{
+				file->cell(x, cell);
+				if(!read_cell_name(cell.name, cell.name_length, address))
+				{
+					cells_xml_length_ -= cell_xml_length(cell);
+					continue;
+				}
+				cells_->insert(std::make_pair(address, std::string(cell.contents, cell.contents_length)));
+				cells_bytes_ += cell.contents_length + cell_overhead;
+			}
+			new_cells_ = cells_->size();
+		}
+	}
+	else
+	{
+		// An xml file has to be parsed in full
+		std::string data;
+		if(!read_file(full_filename_, data) || !parse_xml(data))
+			throw new std::exception();
+	}
+
+	// Bring the cells up to date with any changes made since the snapshot.
+	//  An old journal means the last snapshot was never written - its
+	//  changes come first.
+	long old_size = replay_journal(old_journal_filename_);
+	long size = replay_journal(journal_filename_);
+	journal_size_ = size > 0 ? size : 0;
 
-	if(ss_ == NULL)
-		throw new std::exception();
+	if(old_size != -1)
+	{
+		// Fold both journals in to a fresh snapshot straight away
+		save();
+	}
+
+	if(formulas_)
+	{
+		build_graph();
+	}
+}
+
+void spreadsheet::build_graph()
+{
+	graph_.reset(new dependency_graph(boost::bind(&spreadsheet::get_cell_contents, this, _1)));
+	cell_cursor cursor(file_, cells_, changes_, false);
+	cell_ref cell;
+	cell_address address;
+	while(cursor.next(cell))
+	{
+		if(cell.contents_length > 0 && cell.contents[0] == '=' &&
+				parse_cell_address(cell.name, cell.name_length, address))
+		{
+			graph_->set(address, std::string(cell.contents, cell.contents_length));
+		}
+	}
+	graph_->recalculate_all();
+}
 
-	// Fill the xPath context
-	xpathCtx_ = xmlXPathNewContext(ss_);
+bool spreadsheet::parse_xml(const std::string& data)
+{
+	xmlDocPtr doc = xmlReadMemory(data.data(), data.length(), full_filename_.c_str(), NULL, 0);
+	if(doc == NULL)
+		return false;
 
-	// Grab the password node
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+	if(root == NULL)
+	{
+		xmlFreeDoc(doc);
+		return false;
+	}
 
-	xmlXPathObjectPtr xp_pass = xmlXPathEvalExpression((const xmlChar*)"/server_ss/password", xpathCtx_);
-	xmlNodePtr n_pass = xp_pass->nodesetval->nodeTab[0];
+	// Walk the document once, filling the cell store
+	for(xmlNodePtr node = root->children; node != NULL; node = node->next)
+	{
+		if(node->type != XML_ELEMENT_NODE)
+			continue;
+		if(xmlStrEqual(node->name, (const xmlChar*)"ssName"))
+		{
+			name_ = node_content(node);
+		}
+		else if(xmlStrEqual(node->name, (const xmlChar*)"password"))
+		{
+			password_ = node_content(node);
+		}
+		else if(xmlStrEqual(node->name, (const xmlChar*)"spreadsheet"))
+		{
+			xmlChar* ver = xmlGetProp(node, (const xmlChar*)"version");
+			if(ver != NULL)
+			{
+				version_ = (const char*)ver;
+				xmlFree(ver);
+			}
 
-	// Grab the password
-    password_ = (char*)(xmlNodeGetContent(n_pass));
+			for(xmlNodePtr cell = node->children; cell != NULL; cell = cell->next)
+			{
+				if(cell->type != XML_ELEMENT_NODE || !xmlStrEqual(cell->name, (const xmlChar*)"cell"))
+					continue;
+				std::string name;
+				std::string contents;
+				for(xmlNodePtr field = cell->children; field != NULL; field = field->next)
+				{
+					if(field->type != XML_ELEMENT_NODE)
+						continue;
+					if(xmlStrEqual(field->name, (const xmlChar*)"name"))
+						name = node_content(field);
+					else if(xmlStrEqual(field->name, (const xmlChar*)"contents"))
+						contents = node_content(field);
+				}
+				cell_address address;
+				if(read_cell_name(name.data(), name.length(), address))
+					put_cell(address, contents);
+			}
+		}
+	}
 
+	xmlFreeDoc(doc);
+	return true;
 }
 
+// Reads a journal record length, up to end.  Returns false if there is no
+//  number there, or it is too large to be a length
+static bool read_journal_length(const char*& pos, const char* end, unsigned long& value)
+{
+	const char* start = pos;
+	value = 0;
+	while(pos != end && *pos >= '0' && *pos <= '9')
+	{
+		if(value > (ULONG_MAX - 9) / 10)
+			return false;
+		value = value * 10 + (*pos - '0');
+		pos++;
+	}
+	return pos != start;
+}
 
-void spreadsheet::set_cell_contents(std::string cell, std::string contents)
+long spreadsheet::replay_journal(const std::string& filename)
 {
-	// Set up a query and search for the cell.
-	std::string curCell = boost::to_upper_copy(cell);
-	std::string query =  "/server_ss/spreadsheet/cell[name='" + curCell + "']/contents";
-	xmlXPathObjectPtr xp_cells = xmlXPathEvalExpression((const xmlChar*)(query.c_str()), xpathCtx_);
+	// Read the whole journal in one go
+	std::string data;
+	if(!read_file(filename, data))
+	{
+		// No journal - nothing has changed since the snapshot
+		return -1;
+	}
 
+	// Apply each complete record in order.  A record is "<name length>
+	//  <contents length>\n<name><contents>\n"
+	const char* begin = data.data();
+	const char* end = begin + data.size();
+	std::size_t pos = 0;
+	while(pos < data.size())
+	{
+		const char* header = begin + pos;
+		const char* nl = static_cast<const char*>(std::memchr(header, '\n', end - header));
+		if(nl == NULL)
+			break;
+		unsigned long cell_len;
+		unsigned long contents_len;
+		if(!read_journal_length(header, nl, cell_len) || header == nl || *header++ != ' ' ||
+				!read_journal_length(header, nl, contents_len) || header != nl)
+			break;
+		std::size_t body = nl + 1 - begin;
+		if(cell_len > data.size() - body || contents_len >= data.size() - body - cell_len)
+			break;
+		std::size_t next = body + cell_len + contents_len + 1;
+		if(data[next - 1] != '\n')
+			break;
+		cell_address address;
+		if(read_cell_name(data.data() + body, cell_len, address))
+			put_cell(address, data.substr(body + cell_len, contents_len));
+		pos = next;
+	}
 
-	//Make sure we got something
-	if(xp_cells != NULL && (xp_cells->nodesetval))
+	// Anything past the last complete record was torn by a crash
+	if(pos < data.length())
 	{
-		xmlNodePtr cellContents = xp_cells->nodesetval->nodeTab[0];
-		xmlNodeSetContent(cellContents, (const xmlChar*)(contents.c_str()));
+		std::cerr << "Dropping a partial record at the end of " << filename << std::endl;
+		if(truncate(filename.c_str(), pos) == -1)
+		{
+			std::cerr << "Could not truncate journal " << filename << ": " << std::strerror(errno) << std::endl;
+		}
 	}
-	else
+	return pos;
+}
+
+void spreadsheet::append_journal(cell_address cell, const std::string& contents)
+{
+	if(journal_fd_ == -1)
 	{
-		// If here, means the cell was not yet defined
-		// Get the spreadsheet node, and create a new Cell with the requested params
-		xmlXPathObjectPtr xp_ss = xmlXPathEvalExpression((const xmlChar*)"/server_ss/spreadsheet", xpathCtx_);
-		if(xp_ss->nodesetval->nodeNr != 0)
+		journal_fd_ = ::open(journal_filename_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(journal_fd_ == -1)
 		{
-			// Get the spreadsheet node
-			xmlNodePtr ss_root = xp_ss->nodesetval->nodeTab[0];
-			// Create the new cell
-			xmlNodePtr newCell = xmlNewChild(ss_root, NULL, (const xmlChar*)"cell", NULL);
-			// And fill it with name and contents
-			xmlNewChild(newCell, NULL, (const xmlChar*)"name", (const xmlChar*)(curCell.c_str()));
-			xmlNewChild(newCell, NULL, (const xmlChar*)"contents", (const xmlChar*)(contents.c_str()));
+			std::cerr << "Could not open journal " << journal_filename_ << ": " << std::strerror(errno) << std::endl;
+			return;
 		}
-		else
+	}
+
+	// Build the record, and write it with a single append
+	char name[max_cell_name];
+	std::size_t name_length = format_cell_address(cell, name);
+	char header[48];
+	int header_len = std::snprintf(header, sizeof(header), "%lu %lu\n",
+			(unsigned long)name_length, (unsigned long)contents.length());
+	std::string record;
+	record.reserve(header_len + name_length + contents.length() + 1);
+	record.append(header, header_len);
+	record.append(name, name_length);
+	record += contents;
+	record += '\n';
+
+	const char* buf = record.data();
+	std::size_t left = record.length();
+	while(left > 0)
+	{
+		ssize_t res = ::write(journal_fd_, buf, left);
+		if(res == -1)
 		{
-			std::cerr << "No spreadsheet node in spreadsheet " + full_filename_ + " XML tree" << std::endl;
-			throw new std::exception();
+			if(errno == EINTR)
+				continue;
+			std::cerr << "Could not append to journal " << journal_filename_ << ": " << std::strerror(errno) << std::endl;
+			return;
 		}
+		buf += res;
+		left -= res;
 	}
+	journal_size_ += record.length();
 }
 
-std::string spreadsheet::get_cell_contents(std::string cell)
-{
-	// Set up a query and search for the cell.
-	std::string curCell = boost::to_upper_copy(cell);
-	std::string query =  "/server_ss/spreadsheet/cell[name='" + curCell + "']/contents";
-	xmlXPathObjectPtr xp_cells = xmlXPathEvalExpression((const xmlChar*)(query.c_str()), xpathCtx_);
 
+void spreadsheet::set_cell_contents(cell_address cell, const std::string& contents)
+{
+	put_cell(cell, contents);
+	append_journal(cell, contents);
+	if(graph_)
+	{
+		graph_->set(cell, contents);
+	}
+}
 
-	//Make sure we got something
-	if(xp_cells != NULL && (xp_cells->nodesetval))
+void spreadsheet::put_cell(cell_address cell, const std::string& contents)
+{
+	char name[max_cell_name];
+	std::size_t name_length = format_cell_address(cell, name);
+	cell_map& store = writable_cells();
+	const std::string* current = find_cell(cell);
+	if(current == NULL)
 	{
-		xmlNodePtr cellContents = xp_cells->nodesetval->nodeTab[0];
-		return (char*)(xmlNodeGetContent(cellContents));
+		// The first change to a cell - it replaces the cell in the file, if
+		//  there is one
+		cell_ref old;
+		if(file_ && file_->find(name, name_length, old))
+			cells_xml_length_ -= cell_xml_length(old);
+		else
+			new_cells_++;
+		cells_bytes_ += cell_overhead;
 	}
 	else
 	{
-		// The cell is not defined - return empty string
-		return "";
+		cells_xml_length_ -= cell_xml_length(make_ref(name, name_length, *current));
+		cells_bytes_ -= current->length();
 	}
+	cells_bytes_ += contents.length();
+	store[cell] = contents;
+	cells_xml_length_ += cell_xml_length(make_ref(name, name_length, contents));
 }
 
-void spreadsheet::set_version(std::string new_ver)
+bool spreadsheet::read_cell_name(const char* name, std::size_t length, cell_address& out)
 {
-	std::string query =  "/server_ss/spreadsheet";
-	xmlXPathObjectPtr xp_ss = xmlXPathEvalExpression((const xmlChar*)(query.c_str()), xpathCtx_);
+	if(parse_cell_address(name, length, out))
+		return true;
+	std::cerr << "Dropping cell with invalid name \"" << std::string(name, length) << "\" from " << full_filename_ << std::endl;
+	return false;
+}
 
-	xmlNodePtr ss_node = xp_ss->nodesetval->nodeTab[0];
-	xmlSetProp(ss_node, (const xmlChar*)"version", (const xmlChar*)(new_ver.c_str()));
+const std::string* spreadsheet::find_cell(cell_address cell)
+{
+	if(changes_)
+	{
+		cell_map::const_iterator it = changes_->find(cell);
+		if(it != changes_->end())
+			return &it->second;
+	}
+	cell_map::const_iterator it = cells_->find(cell);
+	return it != cells_->end() ? &it->second : NULL;
 }
 
-std::string spreadsheet::get_version()
+std::string spreadsheet::get_cell_contents(cell_address cell)
+{
+	const std::string* contents = find_cell(cell);
+	if(contents != NULL)
+	{
+		return *contents;
+	}
+	char name[max_cell_name];
+	std::size_t name_length = format_cell_address(cell, name);
+	cell_ref ref;
+	if(file_ && file_->find(name, name_length, ref))
+	{
+		return std::string(ref.contents, ref.contents_length);
+	}
+	// The cell is not defined - return empty string
+	return "";
+}
+
+bool spreadsheet::has_formulas()
+{
+	return graph_ != NULL;
+}
+
+bool spreadsheet::creates_cycle(const cell_list& cells)
+{
+	return graph_ && graph_->creates_cycle(cells);
+}
+
+bool spreadsheet::too_complex(const cell_list& cells)
+{
+	if(!graph_)
+		return false;
+	for(cell_list::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		if(formula::too_complex(it->second))
+			return true;
+	}
+	return false;
+}
+
+void spreadsheet::recalculate(const cell_list& cells, cell_list& values, ss_scheduler* workers)
+{
+	if(graph_)
+	{
+		graph_->recalculate(cells, values, workers);
+	}
+}
+
+void spreadsheet::formula_values(cell_list& values)
+{
+	if(graph_)
+	{
+		graph_->values(values);
+	}
+}
+
+void spreadsheet::set_version(std::string new_ver)
 {
-	std::string query =  "/server_ss/spreadsheet";
-	xmlXPathObjectPtr xp_ss = xmlXPathEvalExpression((const xmlChar*)(query.c_str()), xpathCtx_);
+	version_ = new_ver;
+}
 
-	xmlNodePtr ss_node = xp_ss->nodesetval->nodeTab[0];
-	return (const char*)(xmlGetProp(ss_node, (const xmlChar*)"version"));
+std::string spreadsheet::get_version()
+{
+	return version_;
 }
 
 std::string spreadsheet::get_password()
@@ -152,25 +1043,51 @@ std::string spreadsheet::get_password()
 	return password_;
 }
 
+std::size_t spreadsheet::size()
+{
+	return (file_ ? file_->size() : 0) + new_cells_;
+}
+
+std::size_t spreadsheet::memory_size()
+{
+	return cells_bytes_ + (file_ ? file_->length() : 0) + (graph_ ? graph_->memory_size() : 0);
+}
+
 void spreadsheet::as_xml_string(std::string& xml_out)
 {
-	//Grab the spreadsheet node
-	std::string query =  "/server_ss/spreadsheet";
-	xmlXPathObjectPtr xp_ss = xmlXPathEvalExpression((const xmlChar*)(query.c_str()), xpathCtx_);
+	// Write the <spreadsheet> node straight from the cell store, on a
+	//  single line
+	xml_out.clear();
+	xml_out.reserve(xml_length());
+	append_xml_open(xml_out, version_, size() == 0);
+	if(size() == 0)
+	{
+		return;
+	}
+	cell_cursor cursor(file_, cells_, changes_, false);
+	cell_ref cell;
+	while(cursor.next(cell))
+	{
+		append_cell_xml(xml_out, cell);
+	}
+	xml_out += xml_close;
+}
 
-	xmlNodePtr ss_node = xp_ss->nodesetval->nodeTab[0];
-	xmlChar *s;
-	int size;
-	xmlNodePtr ss_node_copy = xmlCopyNode(ss_node, 1);
-	//Create a new doc, with the spreadsheet node at the root
-	xmlDocPtr ss_doc = xmlNewDoc((const xmlChar*)"1.0");
-	xmlDocSetRootElement(ss_doc, ss_node_copy);
-	//Dump the spreadsheet node into the xmlChar*
-	xmlDocDumpFormatMemoryEnc(ss_doc, &s, &size, (const char*)"UTF-8", 0);
-	//And get rid of whitespace so it fits on a single line
-	xml_out = (char *)(xmlSchemaCollapseString(s));
-	xmlFree(s);
+std::size_t spreadsheet::xml_length()
+{
+	std::size_t len = xml_open.length() + 1;
+	if(!version_.empty())
+		len += xml_version_open.length() + escaped_length(version_.data(), version_.length()) + 1;
+	if(size() == 0)
+		return len + 1;
+	return len + cells_xml_length_ + xml_close.length();
 }
 
+ss_stream_ptr spreadsheet::xml_stream()
+{
+	// The stream shares the cells (and the file); changes made while it
+	//  runs go to the overlay
+	return ss_stream_ptr(new spreadsheet_xml_stream(file_, cells_, changes_, version_));
 }
 
+}
@@ -9,10 +9,15 @@
 #define SPREADSHEET_H_
 
 #include <string>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include "ss_stream.h"
+#include "ss_config.h"
+#include "spreadsheet_file.h"
+#include "cell_address.h"
+#include "dependency_graph.h"
 
 namespace ss {
 
@@ -34,21 +39,224 @@ namespace ss {
 // In other words, a slight modification has been made to the format,
 //   so that password is included at a higher level.  The as_xml_string
 //   method should only return the <spreadsheet> node.
+//
+// The XML is only touched by load() and save().  While loaded, cells live
+//   in a hash map keyed by cell address (see cell_address.h), so a get or
+//   set is a single lookup rather than a walk of the document.  Names
+//   that are not valid cell addresses are dropped (with a warning) when
+//   a file or journal is read.
+//
+// Every set_cell_contents is also appended to a journal next to the
+//   spreadsheet file (1.ss.journal).  A record is
+//      <cell length> <contents length>\n<cell><contents>\n
+//   load() replays the journal on top of the last saved XML, so edits
+//   survive a crash without rewriting the whole file for each one.
+//
+// That is the xml format.  Spreadsheets are now saved in a binary format
+//   instead, which is read with a single read and no parsing:
+//      "SSBF"                 magic
+//      format version         (1)
+//      cell count
+//      cells xml length       (the <cell> elements' share of xml_length)
+//      name, password, version
+//      offset table           (one offset per cell, from the cell table)
+//      cell table             (name, contents) pairs, sorted by name
+//   Numbers are 32 bit little endian, and each string is its length
+//   followed by its bytes.  load() reads either format, so xml files are
+//   migrated the next time they are saved.  With config.xml_files set,
+//   xml is written instead (and binary files are converted back).  A
+//   spreadsheet whose cell table or xml would pass 4 GB can't be written
+//   in this format; its save fails, and the journal is kept.
+//
+// A binary file does not have to be read in full either.  With
+//   config.lazy_load set, load() maps the file (see spreadsheet_file.h)
+//   and the cell store only holds the cells changed since; a cell that
+//   is not in the store is looked up in the mapping.  The JOIN xml and
+//   the next save merge the two.
+//
+// Saving is split in two so the slow part can run off the session's
+//   thread.  snapshot() captures the spreadsheet as it is now and moves
+//   the journal aside (to 1.ss.journal.old); write_snapshot() writes the
+//   XML and then deletes the old journal.  Until that finishes, load()
+//   replays both journals.  The session also saves once the journal
+//   grows past a size limit (compaction).
+//
+// A snapshot (or a JOIN stream) shares the cell store rather than copying
+//   it.  While it does, changes go to a second, smaller store on top of
+//   it - the overlay - and only the overlay is ever copied.  The overlay
+//   is folded back in to the cell store once nothing else shares it.
+//
+// With config.formulas set, the spreadsheet also keeps a dependency graph
+//   of its formulas (see dependency_graph.h), built when it is loaded and
+//   kept up to date as cells are set.  The session asks it for the values
+//   that a change affects.
+
+// Cell contents, keyed by cell address
+typedef boost::unordered_map<cell_address, std::string> cell_map;
+
+// A point-in-time copy of a spreadsheet.  It shares the cells with the
+//  spreadsheet (which leaves them be from then on), so taking one is
+//  cheap, and it can be written out from any thread.
+struct spreadsheet_snapshot
+{
+	// The spreadsheet file to write
+	std::string full_filename;
+	// The journal holding the changes the snapshot covers
+	std::string old_journal_filename;
+	std::string name;
+	std::string password;
+	std::string version;
+	// The cells in the spreadsheet file (if it is mapped), and the cells
+	//  that replace them
+	spreadsheet_file_ptr file;
+	boost::shared_ptr<const cell_map> cells;
+	// The overlay of cells that replace those in cells - may be null
+	boost::shared_ptr<const cell_map> changes;
+	// Write the xml format rather than the binary one
+	bool xml;
+};
+
+typedef boost::shared_ptr<spreadsheet_snapshot> spreadsheet_snapshot_ptr;
+
+// Walks the cells of a spreadsheet: the cells in its file that have not
+//  been changed, and the changed cells, with those in the overlay (if
+//  there is one) in place of the ones they replace.  They come out in
+//  name order if sorted is true (or a file with cells in it is mapped),
+//  and in no particular order otherwise.
+// In name order, the changed cells' names are written out and sorted up
+//  front, and the cell_refs handed out stay valid as long as the cursor.
+//  Otherwise the cell maps are walked as they are, with one name written
+//  out at a time, and a cell_ref is only valid until the next call.
+class cell_cursor : private boost::noncopyable {
+public:
+	cell_cursor(spreadsheet_file_ptr file, boost::shared_ptr<const cell_map> cells,
+			boost::shared_ptr<const cell_map> changes, bool sorted);
+
+	// Gets the next cell.  Returns false once there are no more
+	bool next(cell_ref& out);
+
+private:
+	// A changed cell, with its name written out
+	struct changed_cell
+	{
+		const char* name;
+		std::size_t name_length;
+		const std::string* contents;
+	};
+
+	// Orders changed cells by name, to merge with the cells in the file
+	static bool name_less(const changed_cell& a, const changed_cell& b);
+
+	// Adds cells to changed_, leaving out any that are in skip
+	void add_changed(const cell_map& cells, const cell_map* skip, char*& name);
+
+	// Gets the next cell from the cell maps, when they are walked as they
+	//  are.  Returns false once there are no more
+	bool next_unsorted(cell_ref& out);
+
+	// The cells being walked
+	spreadsheet_file_ptr file_;
+	boost::shared_ptr<const cell_map> cells_;
+	boost::shared_ptr<const cell_map> changes_;
+
+	// Whether the cell maps are walked as they are, rather than through
+	//  changed_
+	bool unsorted_;
+
+	// The next cell in the map being walked, and its end
+	cell_map::const_iterator next_cell_;
+	cell_map::const_iterator cells_end_;
+
+	// Whether the overlay is being walked (after cells_)
+	bool in_changes_;
+
+	// The name of the last cell handed out, when the maps are walked
+	char name_[max_cell_name];
+
+	// The changed cells' names, max_cell_name apart
+	std::vector<char> names_;
+
+	// The changed cells, in the order they are walked
+	std::vector<changed_cell> changed_;
+
+	// The next cell in the file, and in changed_
+	std::size_t next_file_;
+	std::size_t next_changed_;
+};
+
+// Streams the same xml as spreadsheet::as_xml_string, a piece at a time,
+//  from a point-in-time copy of the cells.  Only one cell is rendered at
+//  once, so memory use does not grow with the size of the spreadsheet -
+//  only, for a mapped file, with the number of cells changed since it was
+//  loaded (see cell_cursor).
+class spreadsheet_xml_stream : public ss_stream {
+public:
+	spreadsheet_xml_stream(spreadsheet_file_ptr file, boost::shared_ptr<const cell_map> cells,
+			boost::shared_ptr<const cell_map> changes, const std::string& version);
+
+	bool next_chunk(std::string& chunk, std::size_t max);
+
+private:
+	// Renders the next part of the xml in to pending_.  Returns false
+	//  once there is nothing left
+	bool render_next();
+
+	// The cells being streamed
+	cell_cursor cursor_;
+
+	// The cell being rendered
+	cell_ref cell_;
+
+	// Whether there are no cells
+	bool empty_;
+
+	// The version attribute on the spreadsheet node
+	std::string version_;
+
+	// Whether the opening tag has been rendered
+	bool started_;
+
+	// Whether the closing tag has been rendered
+	bool finished_;
+
+	// Rendered xml not yet handed out
+	std::string pending_;
+
+	// How much of pending_ has been handed out
+	std::size_t pending_pos_;
+};
 
 class spreadsheet {
 public:
-	// Creates a spreadsheet object
-	spreadsheet(std::string filename, std::string root_dir);
+	// Creates a spreadsheet object - config picks the file format, and
+	//  whether the file is read lazily
+	spreadsheet(std::string filename, std::string root_dir, const ss_config& config = ss_config());
 
 	// Destroy the spreadsheet
 	~spreadsheet();
 
-	// Loads a spreadsheet from disk
+	// Loads a spreadsheet from disk, replaying any journaled changes
 	void load();
 
-	// Saves a spreadsheet to disk
+	// Saves a spreadsheet to disk, and empties the journal
 	void save();
 
+	// Captures the spreadsheet for writing, and starts a new journal for
+	//  the changes made after this point
+	spreadsheet_snapshot_ptr snapshot();
+
+	// Writes a snapshot to disk, and deletes the journal it replaces.
+	//  Touches no spreadsheet state, so it may run on any thread.
+	static void write_snapshot(const spreadsheet_snapshot& snap);
+
+	// Returns whether the journal is big enough to be folded in to a
+	//  new snapshot
+	bool needs_compaction();
+
+	// Returns whether there are changes that are not in the spreadsheet
+	//  file yet
+	bool modified();
+
 	// Returns the password listed in the spreadsheet file - returns null if ss not "load()"ed
 	std::string get_password();
 
@@ -56,11 +264,37 @@ public:
 	//   (no comments, metadata, etc)
 	void as_xml_string(std::string& xml_out);
 
+	// Returns the length of the as_xml_string xml, without building it.
+	//  The length is kept up to date as cells change.
+	std::size_t xml_length();
+
+	// Returns a stream of the as_xml_string xml, as it is now
+	ss_stream_ptr xml_stream();
+
 	// Sets the contents of a cell - ss_session is in charge of version
-	void set_cell_contents(std::string cell, std::string contents);
+	void set_cell_contents(cell_address cell, const std::string& contents);
 
 	// Gets the contents of a cell - returns empty string if cell not defined
-	std::string get_cell_contents(std::string cell);
+	std::string get_cell_contents(cell_address cell);
+
+	// Returns whether formulas are worked out on the server
+	bool has_formulas();
+
+	// Returns whether setting cells would make a formula depend on itself
+	//  (always false without formulas)
+	bool creates_cycle(const cell_list& cells);
+
+	// Returns whether any of cells is a formula too long or too deeply
+	//  nested to work out (always false without formulas)
+	bool too_complex(const cell_list& cells);
+
+	// Works out the formulas affected by setting cells, adding those
+	//  whose value changed to values.  Wide recalculations are shared
+	//  with workers, if given
+	void recalculate(const cell_list& cells, cell_list& values, ss_scheduler* workers = NULL);
+
+	// Adds the value of every formula to values
+	void formula_values(cell_list& values);
 
 	// Sets the version attribute on the spreadsheet node
 	void set_version(std::string new_ver);
@@ -68,18 +302,104 @@ public:
 	// Gets the version attribute on the spreadsheet node
 	std::string get_version();
 
+	// Returns the number of defined cells
+	std::size_t size();
+
+	// Returns roughly how much memory the spreadsheet uses: the cell
+	//  store, the mapped file and the formulas
+	std::size_t memory_size();
+
 private:
+	// Fills the spreadsheet from the contents of an xml file.  Returns
+	//  false if the file is not valid xml
+	bool parse_xml(const std::string& data);
+
+	// Sets a cell in the store, keeping the xml length up to date
+	void put_cell(cell_address cell, const std::string& contents);
+
+	// Returns the contents of a cell in the overlay or the cell store, or
+	//  null if it is in neither
+	const std::string* find_cell(cell_address cell);
+
+	// Parses a cell name read from a file or journal.  Returns false (and
+	//  warns) if it is not a valid cell address
+	bool read_cell_name(const char* name, std::size_t length, cell_address& out);
+
+	// Applies the changes in a journal to the cells, and drops a torn
+	//  record left at the end by a crash.  Returns the journal's size, or
+	//  -1 if there is no such journal
+	long replay_journal(const std::string& filename);
+
+	// Moves the current journal aside, to be deleted once a snapshot
+	//  holding its changes is written
+	void rotate_journal();
+
+	// Returns the store the next change goes in to: the cell store, or
+	//  the overlay while a snapshot still shares the cell store.  The
+	//  overlay is copied first if a snapshot shares that too
+	cell_map& writable_cells();
+
+	// Builds the dependency graph from the loaded cells, and works out
+	//  every formula
+	void build_graph();
+
+	// Appends a cell change to the journal
+	void append_journal(cell_address cell, const std::string& contents);
+
 	// The full file path of the
 	std::string full_filename_;
 
+	// The full file path of the journal
+	std::string journal_filename_;
+
+	// The full file path of the journal being replaced by a snapshot
+	std::string old_journal_filename_;
+
+	// The journal, opened for appending (-1 until the first change)
+	int journal_fd_;
+
+	// The number of bytes in the journal
+	std::size_t journal_size_;
+
+	// The spreadsheet name, as stored in the file
+	std::string name_;
+
 	// The password
 	std::string password_;
 
-	// Spreadsheet contents are stored in XML format, in memory
-	xmlDocPtr ss_;
+	// The version attribute on the spreadsheet node
+	std::string version_;
+
+	// The mapped spreadsheet file - null unless it is read lazily
+	spreadsheet_file_ptr file_;
+
+	// The cell store - every cell, or with a mapped file, just the
+	//  changed cells
+	boost::shared_ptr<cell_map> cells_;
+
+	// The cells changed while cells_ was shared - null when there are none
+	boost::shared_ptr<cell_map> changes_;
+
+	// The number of cells in the store that are not in the file
+	std::size_t new_cells_;
+
+	// Roughly how much memory the cell store uses
+	std::size_t cells_bytes_;
+
+	// The length of the <cell> elements in the xml
+	std::size_t cells_xml_length_;
+
+	// Whether to save in the xml format
+	bool xml_;
+
+	// Whether to map binary files rather than read them in full
+	bool lazy_;
+
+	// Whether to work formulas out
+	bool formulas_;
 
-	//xPath context for searching
-	xmlXPathContextPtr xpathCtx_;
+	// The formulas - null without config.formulas
+	boost::shared_ptr<dependency_graph> graph_;
 };
 }
 #endif /* SPREADSHEET_H_ */
@@ -0,0 +1,197 @@
+/*
+ * spreadsheet_file.cpp
+ *
+ *  Created on: Apr 27, 2013
+ *      Author: montgomc
+ */
+
+#include "spreadsheet_file.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <exception>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace ss {
+
+const char spreadsheet_file::magic[4] = {'S', 'S', 'B', 'F'};
+const boost::uint32_t spreadsheet_file::format_version = 1;
+
+spreadsheet_file::spreadsheet_file(const std::string& filename)
+	: data_(NULL),
+	  length_(0),
+	  cells_xml_length_(0),
+	  count_(0),
+	  offsets_(0),
+	  table_(0)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd == -1)
+		throw new std::exception();
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)(sizeof(magic) + 24))
+	{
+		::close(fd);
+		throw new std::exception();
+	}
+	length_ = st.st_size;
+	void* map = mmap(NULL, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if(map == MAP_FAILED)
+	{
+		std::cerr << "Could not map " << filename << ": " << std::strerror(errno) << std::endl;
+		throw new std::exception();
+	}
+	data_ = (const char*)map;
+
+	// Read the header.  Everything after it is read when it is used
+	bool valid = std::memcmp(data_, magic, sizeof(magic)) == 0 && u32_at(sizeof(magic)) == format_version;
+	std::size_t pos = sizeof(magic) + 4;
+	if(valid)
+	{
+		count_ = u32_at(pos);
+		cells_xml_length_ = u32_at(pos + 4);
+		pos += 8;
+		std::string* fields[] = {&name_, &password_, &version_};
+		for(int x = 0; valid && x < 3; x++)
+		{
+			valid = length_ - pos >= 4 && length_ - pos - 4 >= u32_at(pos);
+			if(valid)
+			{
+				fields[x]->assign(data_ + pos + 4, u32_at(pos));
+				pos += 4 + fields[x]->length();
+			}
+		}
+	}
+
+	// Check the offsets line up, so a cell is never read from outside the
+	//  mapping
+	offsets_ = pos;
+	valid = valid && (length_ - offsets_) / 4 >= count_;
+	if(valid)
+	{
+		table_ = offsets_ + 4 * count_;
+		std::size_t last = 0;
+		for(std::size_t x = 0; valid && x < count_; x++)
+		{
+			std::size_t offset = u32_at(offsets_ + 4 * x);
+			valid = (x == 0 ? offset == 0 : offset >= last + 8) && offset <= length_ - table_;
+			last = offset;
+		}
+		valid = valid && (count_ == 0 || length_ - table_ - last >= 8);
+	}
+
+	if(!valid)
+	{
+		std::cerr << filename << " is not a spreadsheet file, or is damaged" << std::endl;
+		munmap(map, length_);
+		throw new std::exception();
+	}
+}
+
+spreadsheet_file::~spreadsheet_file()
+{
+	munmap((void*)data_, length_);
+}
+
+bool spreadsheet_file::is_binary(const std::string& filename)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd == -1)
+		return false;
+	char start[sizeof(magic)];
+	bool res = ::read(fd, start, sizeof(start)) == (ssize_t)sizeof(start)
+			&& std::memcmp(start, magic, sizeof(magic)) == 0;
+	::close(fd);
+	return res;
+}
+
+const std::string& spreadsheet_file::name() const
+{
+	return name_;
+}
+
+const std::string& spreadsheet_file::password() const
+{
+	return password_;
+}
+
+const std::string& spreadsheet_file::version() const
+{
+	return version_;
+}
+
+std::size_t spreadsheet_file::cells_xml_length() const
+{
+	return cells_xml_length_;
+}
+
+std::size_t spreadsheet_file::size() const
+{
+	return count_;
+}
+
+std::size_t spreadsheet_file::length() const
+{
+	return length_;
+}
+
+void spreadsheet_file::cell(std::size_t index, cell_ref& out) const
+{
+	// The offsets were checked when the file was opened; the lengths
+	//  inside a cell are held to its slot, in case the cell is damaged
+	std::size_t start = table_ + u32_at(offsets_ + 4 * index);
+	std::size_t end = index + 1 < count_ ? table_ + u32_at(offsets_ + 4 * (index + 1)) : length_;
+	std::size_t room = end - start - 8;
+
+	out.name = data_ + start + 4;
+	out.name_length = u32_at(start);
+	if(out.name_length > room)
+		out.name_length = room;
+	room -= out.name_length;
+
+	out.contents = out.name + out.name_length + 4;
+	out.contents_length = u32_at(start + 4 + out.name_length);
+	if(out.contents_length > room)
+		out.contents_length = room;
+}
+
+bool spreadsheet_file::find(const char* name, std::size_t name_length, cell_ref& out) const
+{
+	// The cells are sorted by name - binary search them
+	std::size_t low = 0;
+	std::size_t high = count_;
+	while(low < high)
+	{
+		std::size_t mid = low + (high - low) / 2;
+		cell(mid, out);
+		int cmp = compare(out.name, out.name_length, name, name_length);
+		if(cmp == 0)
+			return true;
+		if(cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return false;
+}
+
+int spreadsheet_file::compare(const char* a, std::size_t a_length, const char* b, std::size_t b_length)
+{
+	int cmp = std::memcmp(a, b, a_length < b_length ? a_length : b_length);
+	if(cmp != 0 || a_length == b_length)
+		return cmp;
+	return a_length < b_length ? -1 : 1;
+}
+
+boost::uint32_t spreadsheet_file::u32_at(std::size_t pos) const
+{
+	const unsigned char* bytes = (const unsigned char*)data_ + pos;
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((boost::uint32_t)bytes[3] << 24);
+}
+
+}
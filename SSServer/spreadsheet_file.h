@@ -0,0 +1,103 @@
+/*
+ * spreadsheet_file.h
+ *
+ *  Created on: Apr 27, 2013
+ *      Author: montgomc
+ */
+
+#ifndef SPREADSHEET_FILE_H_
+#define SPREADSHEET_FILE_H_
+
+#include <string>
+#include <cstddef>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace ss {
+
+// A binary spreadsheet file (see spreadsheet.h for the format), mapped in
+//  to memory read only.  Opening one only reads the header and checks the
+//  offset table - the cells are read straight out of the mapping when
+//  they are asked for, so the operating system pages in only the parts
+//  of the file that are used.
+//
+// Spreadsheet files are only ever replaced by renaming a new file over
+//  them, never rewritten in place, so a mapping stays valid (and keeps
+//  the old contents) after the spreadsheet is saved.
+
+// A cell in the file.  The pointers are in to the mapping, and are not
+//  terminated.
+struct cell_ref
+{
+	const char* name;
+	std::size_t name_length;
+	const char* contents;
+	std::size_t contents_length;
+};
+
+class spreadsheet_file : private boost::noncopyable {
+public:
+	// Maps a binary spreadsheet file.  Throws if it can not be mapped, or
+	//  is damaged
+	spreadsheet_file(const std::string& filename);
+
+	// Unmaps the file
+	~spreadsheet_file();
+
+	// Returns whether the file at filename is in the binary format
+	static bool is_binary(const std::string& filename);
+
+	// The first bytes of a binary file, and the format version written
+	//  after them
+	static const char magic[4];
+	static const boost::uint32_t format_version;
+
+	// The values in the header
+	const std::string& name() const;
+	const std::string& password() const;
+	const std::string& version() const;
+
+	// Returns the length of the <cell> elements in the spreadsheet's xml
+	std::size_t cells_xml_length() const;
+
+	// Returns the number of cells
+	std::size_t size() const;
+
+	// Returns the length of the mapping
+	std::size_t length() const;
+
+	// Gets the index'th cell, in name order
+	void cell(std::size_t index, cell_ref& out) const;
+
+	// Finds a cell by name.  Returns false if the file does not have it
+	bool find(const char* name, std::size_t name_length, cell_ref& out) const;
+
+	// Compares two cell names in the order the file is sorted in
+	//  (bytewise, like std::string).  Returns <0, 0 or >0
+	static int compare(const char* a, std::size_t a_length, const char* b, std::size_t b_length);
+
+private:
+	// Reads a number from the mapping
+	boost::uint32_t u32_at(std::size_t pos) const;
+
+	// The mapping
+	const char* data_;
+	std::size_t length_;
+
+	// The header values
+	std::string name_;
+	std::string password_;
+	std::string version_;
+	std::size_t cells_xml_length_;
+	std::size_t count_;
+
+	// Where the offset table and the cell table start
+	std::size_t offsets_;
+	std::size_t table_;
+};
+
+typedef boost::shared_ptr<const spreadsheet_file> spreadsheet_file_ptr;
+
+}
+#endif /* SPREADSHEET_FILE_H_ */
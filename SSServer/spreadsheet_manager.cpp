@@ -6,91 +6,315 @@
  */
 
 #include "spreadsheet_manager.h"
+#include <fstream>
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace ss {
 
-spreadsheet_manager::spreadsheet_manager(std::string root_dir, std::string indexFile)
+// Once the log has this many records, the next CREATE writes them in to
+//  the xml index
+static const unsigned int log_compact_records = 1024;
+
+spreadsheet_manager::spreadsheet_manager(std::string root_dir, std::string indexFile,
+		boost::asio::io_service& save_service, const ss_config& config)
 	: index_fullfile_(root_dir + indexFile),
+	  log_fullfile_(root_dir + indexFile + ".log"),
+	  old_log_fullfile_(root_dir + indexFile + ".log.old"),
+	  compacting_(false),
+	  old_log_kept_(false),
+	  save_service_(save_service),
+	  log_fd_(-1),
+	  log_records_(0),
+	  config_(config),
 	  root_dir_(root_dir),
-	  next_file_id_(0)
+	  next_file_id_(1)
 {
 	// Load the index file
 	// Load the xml from disk (c library xml2 requires c strings)
+	xmlDocPtr index_xml = NULL;
 	try
 	{
 		std::cout << "Root directory is: " << root_dir_ << std::endl;
 		std::cout << "Index file is: " << indexFile << std::endl;
 		std::cout << "Loading the spreadsheet index file...\n";
-		index_xml_ = xmlReadFile(index_fullfile_.c_str(), NULL, 0);  //If no fileives "I/O Warning: failed to load external entity"
+		index_xml = xmlReadFile(index_fullfile_.c_str(), NULL, 0);  //If no fileives "I/O Warning: failed to load external entity"
 	}
 	catch(...)
 	{
 		//Do nothing (just to suppress stdout output)
 	}
 
-	// We didn't get anything - let's create one
-	if(index_xml_ == NULL)
-	{
-		// Create new document root
-		index_xml_ = xmlNewDoc((const xmlChar*)"1.0");
-		// Create a new node (will be the root node, called "index")
-		index_ = xmlNewNode(NULL, (const xmlChar*)"index");
-		// Set the new node as the root element of the doc
-		xmlDocSetRootElement(index_xml_, index_);
-		// Add a nextID attribute - this is the next spreadsheet serial number
-		xmlNewProp(index_, (const xmlChar*)"nextID", (const xmlChar*)"1");
-		// We now have an initialized index
-		int res;
-		res = xmlSaveFormatFileEnc((const char*)(index_fullfile_.c_str()), index_xml_, (const char*)"UTF-8", 1);
-		if(res == -1)
+	if(index_xml != NULL)
+	{
+		// Grab the index node
+		xmlNodePtr index = xmlDocGetRootElement(index_xml);
+
+		// Grab the current version
+		xmlChar* nextId = xmlGetProp(index, (const xmlChar*)"nextID");
+		if(nextId != NULL)
+		{
+			next_file_id_ = boost::lexical_cast<int>((const char*)nextId);
+			xmlFree(nextId);
+		}
+
+		// Build the name lookup from the ss nodes
+		for(xmlNodePtr node = index->children; node != NULL; node = node->next)
+		{
+			if(node->type != XML_ELEMENT_NODE || !xmlStrEqual(node->name, (const xmlChar*)"ss"))
+				continue;
+			xmlChar* name = xmlNodeGetContent(node);
+			xmlChar* filename = xmlGetProp(node, (const xmlChar*)"filename");
+			if(name != NULL && filename != NULL)
+			{
+				names_[(const char*)name] = (const char*)filename;
+			}
+			xmlFree(name);
+			xmlFree(filename);
+		}
+		xmlFreeDoc(index_xml);
+	}
+
+	// Add the spreadsheets created since the index was last written - an
+	//  old log means the last compaction did not finish
+	load_log(old_log_fullfile_);
+	load_log(log_fullfile_);
+
+	// We didn't get anything (or the log had more) - write a fresh index
+	if(index_xml == NULL || log_records_ > 0)
+	{
+		if(!compact())
 		{
 			throw SSFileIOException("SSServer Error: Root directory could not be found\n");//TODO how to throw up
 		}
-		else
+		else if(index_xml == NULL)
 		{
 			std::cerr << "Info:\tSpecified spreadsheet index file not found - creating the requested file\n";
 		}
-
 	}
 
 	std::cout << "Index file successfully loaded...\n";
+	std::cout << names_.size() << " spreadsheet(s) in the index\n";
+}
+
+spreadsheet_manager::~spreadsheet_manager()
+{
+	// Leave a complete xml index behind - the save thread has finished by
+	//  now, so an old log is only left if its write failed
+	if(log_records_ > 0 || old_log_kept_)
+	{
+		compact();
+	}
+	if(log_fd_ != -1)
+	{
+		::close(log_fd_);
+	}
+}
+
+void spreadsheet_manager::load_log(const std::string& filename)
+{
+	std::ifstream log(filename.c_str(), std::ios::in | std::ios::binary);
+	if(!log)
+	{
+		return;
+	}
+
+	// Each record is a line: <file name> <spreadsheet name>
+	std::string line;
+	std::streamoff good = 0;
+	while(std::getline(log, line))
+	{
+		// The last line has no \n if a crash cut it short - drop it
+		if(log.eof())
+			break;
+		std::string::size_type space = line.find(' ');
+		if(space == std::string::npos)
+			break;
+		std::string filename = line.substr(0, space);
+		names_[line.substr(space + 1)] = filename;
+		int id = std::atoi(filename.c_str());
+		if(id >= next_file_id_)
+		{
+			next_file_id_ = id + 1;
+		}
+		log_records_++;
+		good += line.length() + 1;
+	}
+	log.close();
 
-	// Fill the xPath context
-	xpathCtx_ = xmlXPathNewContext(index_xml_);
+	if(truncate(filename.c_str(), good) == -1)
+	{
+		std::cerr << "Could not truncate " << filename << ": " << std::strerror(errno) << std::endl;
+	}
+}
 
-	// Grab the index node
-	xmlXPathObjectPtr xp_index = xmlXPathEvalExpression((const xmlChar*)"/index", xpathCtx_);
-	index_ = xp_index->nodesetval->nodeTab[0];
+bool spreadsheet_manager::append_log(const std::string& filename, const std::string& ss_name)
+{
+	if(log_fd_ == -1)
+	{
+		log_fd_ = ::open(log_fullfile_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(log_fd_ == -1)
+		{
+			std::cerr << "Could not open " << log_fullfile_ << ": " << std::strerror(errno) << std::endl;
+			return false;
+		}
+	}
 
-	// Grab the current version
-    std::string strNextId = (char*)(xmlGetProp(index_, (const xmlChar*)"nextID"));
-    next_file_id_ = boost::lexical_cast<int>(strNextId);
+	// One record, one write
+	std::string record = filename + ' ' + ss_name + '\n';
+	if(::write(log_fd_, record.data(), record.length()) != (ssize_t)record.length())
+	{
+		std::cerr << "Could not append to " << log_fullfile_ << ": " << std::strerror(errno) << std::endl;
+		return false;
+	}
+	log_records_++;
+	return true;
+}
+
+bool spreadsheet_manager::compact()
+{
+	// Write the snapshot next to the index, then move it in to place
+	std::string tmp_file = index_fullfile_ + ".tmp";
+	if(!export_xml(names_, next_file_id_, tmp_file) || std::rename(tmp_file.c_str(), index_fullfile_.c_str()) != 0)
+	{
+		return false;
+	}
+
+	// The snapshot has every record now - empty the logs
+	if(unlink(old_log_fullfile_.c_str()) == -1 && errno != ENOENT)
+	{
+		std::cerr << "Could not delete " << old_log_fullfile_ << ": " << std::strerror(errno) << std::endl;
+	}
+	int res;
+	if(log_fd_ != -1)
+		res = ftruncate(log_fd_, 0);
+	else
+		res = truncate(log_fullfile_.c_str(), 0);
+	if(res == -1 && errno != ENOENT)
+	{
+		std::cerr << "Could not empty " << log_fullfile_ << ": " << std::strerror(errno) << std::endl;
+	}
+	log_records_ = 0;
+	return true;
+}
+
+void spreadsheet_manager::start_compact()
+{
+	// Only one old log at a time - the log keeps growing until the index
+	//  being written is done
+	if(compacting_)
+	{
+		return;
+	}
+
+	// CREATEs from here on go in a new log.  Moving the log over an old one
+	//  kept from a failed write would lose the old one's records, so in
+	//  that case it stays, and is emptied by the next compaction after this
+	if(!old_log_kept_)
+	{
+		if(log_fd_ != -1)
+		{
+			::close(log_fd_);
+			log_fd_ = -1;
+		}
+		if(std::rename(log_fullfile_.c_str(), old_log_fullfile_.c_str()) != 0)
+		{
+			std::cerr << "Could not move " << log_fullfile_ << " aside: " << std::strerror(errno) << std::endl;
+			return;
+		}
+	}
+	log_records_ = 0;
+	compacting_ = true;
+
+	boost::shared_ptr<const name_map> names(new name_map(names_));
+	save_service_.post(boost::bind(&spreadsheet_manager::finish_compact, this, names, next_file_id_));
+}
+
+void spreadsheet_manager::finish_compact(boost::shared_ptr<const name_map> names, int next_file_id)
+{
+	std::string tmp_file = index_fullfile_ + ".tmp";
+	if(!export_xml(*names, next_file_id, tmp_file) || std::rename(tmp_file.c_str(), index_fullfile_.c_str()) != 0)
+	{
+		// The old log stays, and is read at startup.  The next CREATE to
+		//  fill the log tries again, and the index is written in full
+		//  again at shutdown
+		std::cerr << "Could not write " << index_fullfile_ << std::endl;
+		boost::mutex::scoped_lock lock(mutex_);
+		compacting_ = false;
+		old_log_kept_ = true;
+		return;
+	}
+	if(unlink(old_log_fullfile_.c_str()) == -1)
+	{
+		std::cerr << "Could not delete " << old_log_fullfile_ << ": " << std::strerror(errno) << std::endl;
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	compacting_ = false;
+	old_log_kept_ = false;
+}
+
+bool spreadsheet_manager::export_xml(const name_map& names, int next_file_id, const std::string& filename)
+{
+	// Write the entries out in file order
+	std::vector<std::pair<int, const std::pair<const std::string, std::string>*> > entries;
+	entries.reserve(names.size());
+	for(name_map::const_iterator it = names.begin(); it != names.end(); ++it)
+	{
+		entries.push_back(std::make_pair(std::atoi(it->second.c_str()), &*it));
+	}
+	std::sort(entries.begin(), entries.end());
+
+	// Create new document root
+	xmlDocPtr index_xml = xmlNewDoc((const xmlChar*)"1.0");
+	// Create a new node (will be the root node, called "index")
+	xmlNodePtr index = xmlNewNode(NULL, (const xmlChar*)"index");
+	// Set the new node as the root element of the doc
+	xmlDocSetRootElement(index_xml, index);
+	// Add a nextID attribute - this is the next spreadsheet serial number
+	std::string tmpId = boost::lexical_cast<std::string>(next_file_id);
+	xmlNewProp(index, (const xmlChar*)"nextID", (const xmlChar*)(tmpId.c_str()));
+	for(unsigned int x = 0; x < entries.size(); x++)
+	{
+		xmlNodePtr ss = xmlNewTextChild(index, NULL, (const xmlChar*)"ss", (const xmlChar*)(entries[x].second->first.c_str()));
+		xmlNewProp(ss, (const xmlChar*)"filename", (const xmlChar*)(entries[x].second->second.c_str()));
+	}
+
+	int res = xmlSaveFormatFileEnc(filename.c_str(), index_xml, (const char*)"UTF-8", 1);
+	xmlFreeDoc(index_xml);
+	return res != -1;
 }
 
 // Only valid create messages should be sent to this method
-void spreadsheet_manager::handle_create_request(ss_client_ptr requester, ss_message create_request)
+void spreadsheet_manager::handle_create_request(ss_client_ptr requester, const ss_message& create_request)
 {
 	if(create_request.command != ss_message::CREATE)
 	{
 		throw new std::exception();  // TODO put message in exception
 	}
-	std::string ss_name = create_request.get_val("Name");
-	std::string password = create_request.get_val("Password");
+	const std::string& ss_name = create_request.get(ss_message::NAME);
+	const std::string& password = create_request.get(ss_message::PASSWORD);
 
+	boost::mutex::scoped_lock lock(mutex_);
 	std::string* res = new_spreadsheet(ss_name, password);
 	ss_message response;
-	response.set("Name",ss_name);
+	response.set(ss_message::NAME, ss_name);
 	// NULL means sucess - non-null is reason why failed
 	if(res == NULL)
 	{
 		response.command = ss_message::CREATE_OK;
-		response.set("Password",password);
+		response.set(ss_message::PASSWORD, password);
 		requester->tell(response);
 	}
 	else
 	{
 		response.command = ss_message::CREATE_FAIL;
-		response.set("message", *res);
+		response.set(ss_message::MESSAGE, *res);
 		requester->tell(response);
 		delete res;
 	}
@@ -99,6 +323,7 @@ void spreadsheet_manager::handle_create_request(ss_client_ptr requester, ss_mess
 spreadsheet* spreadsheet_manager::get_spreadsheet(std::string ss_name)
 {
 	// Find the spreadsheet
+	boost::mutex::scoped_lock lock(mutex_);
 	std::string* ss_file_ptr = find_spreadsheet(ss_name);
 	if(ss_file_ptr == NULL)
 	{
@@ -111,7 +336,7 @@ spreadsheet* spreadsheet_manager::get_spreadsheet(std::string ss_name)
 	{
 		std::string ss_file = *ss_file_ptr;
 		delete ss_file_ptr;
-		ss = new spreadsheet(ss_file, root_dir_);
+		ss = new spreadsheet(ss_file, root_dir_, config_);
 	}
 	catch(std::exception& e)
 	{
@@ -124,15 +349,12 @@ spreadsheet* spreadsheet_manager::get_spreadsheet(std::string ss_name)
 std::string* spreadsheet_manager::find_spreadsheet(std::string ss_name)
 {
 	// Check if the spreadsheet already exists
-	std::string query =  "/index//*[contains(text(), '" + ss_name + "')]";
-	xmlXPathObjectPtr xp_ss = xmlXPathEvalExpression((const xmlChar*)(query.c_str()), xpathCtx_);
-
+	boost::unordered_map<std::string, std::string>::iterator it = names_.find(ss_name);
 
 	//Make sure we got something
-	if(xp_ss != NULL && (xp_ss->nodesetval->nodeNr != 0))
+	if(it != names_.end())
 	{
-		xmlNodePtr ss = xp_ss->nodesetval->nodeTab[0];
-		return new std::string((const char*)(xmlGetProp(ss, (const xmlChar*)"filename")));
+		return new std::string(it->second);
 	}
 	else
 	{
@@ -153,35 +375,35 @@ std::string* spreadsheet_manager::new_spreadsheet(std::string ss_name, std::stri
 		return new std::string("The spreadsheet already exists");
 	}
 	delete res;
-	// Create new document root
-	xmlDocPtr server_ss_xml = xmlNewDoc((const xmlChar*)"1.0");
-	// Create a new node (will be the root node, called "server_ss")
-	xmlNodePtr server_ss_root = xmlNewNode(NULL, (const xmlChar*)"server_ss");
-	// Set the new node as the root element of the doc
-	xmlDocSetRootElement(server_ss_xml, server_ss_root);
-	// Add a ss_name child node to root node, with the ss_name
-	xmlNewChild(server_ss_root, NULL, (const xmlChar*)"ssName", (const xmlChar*)(ss_name.c_str()));
-	// Add a password child node to root node, with content=password
-	xmlNewChild(server_ss_root, NULL, (const xmlChar*)"password", (const xmlChar*)(password.c_str()));
-	// Add the Spreadsheet node (this subnode contains the ss xml format specified in cs3500)
-	xmlNewChild(server_ss_root, NULL, (const xmlChar*)"spreadsheet", NULL);
-	// Set the ss version to 0 (separate from ss_session version...)
-	//xmlNewProp(ss_root, (const xmlChar*)"version", (const xmlChar*)"0");
-
-
-	// We now have an empty spreadsheet.
+	// Write an empty spreadsheet, in the format the spreadsheets are saved in
 	std::string filename = boost::lexical_cast<std::string>(next_file_id_) + ".ss";
-	int saveRes = xmlSaveFormatFileEnc((const char*)((root_dir_ + filename).c_str()), server_ss_xml, (const char*)"UTF-8", 1);
-	if(saveRes != -1)
+	spreadsheet_snapshot empty;
+	empty.full_filename = root_dir_ + filename;
+	empty.name = ss_name;
+	empty.password = password;
+	empty.cells.reset(new cell_map());
+	empty.xml = config_.xml_files;
+	bool saved = true;
+	try
+	{
+		spreadsheet::write_snapshot(empty);
+	}
+	catch(...)
 	{
-		// The save was a success.  Write the info about the new spreadsheet to the index, and
-		//  increment the next counters
-		xmlNodePtr new_ss = xmlNewChild(index_, NULL, (const xmlChar*)"ss", (const xmlChar*)(ss_name.c_str()));
-		xmlNewProp(new_ss, (const xmlChar*)"filename", (const xmlChar*)(filename.c_str()));
+		saved = false;
+	}
+	if(saved && append_log(filename, ss_name))
+	{
+		// The save was a success, and the new spreadsheet is in the index
+		//  log.  Add it to the lookup, and increment the next counters
+		names_[ss_name] = filename;
 		next_file_id_++;
-		std::string tmpId = boost::lexical_cast<std::string>(next_file_id_);
-		xmlSetProp(index_, (const xmlChar*)"nextID", (const xmlChar*)(tmpId.c_str()));
-		xmlSaveFormatFileEnc((const char*)((index_fullfile_).c_str()), index_xml_, (const char*)"UTF-8", 1);
+
+		// Fold a long log back in to the xml index
+		if(log_records_ >= log_compact_records)
+		{
+			start_compact();
+		}
 		return NULL;
 	}
 	else
@@ -15,9 +15,14 @@
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/asio.hpp>
+#include <boost/unordered_map.hpp>
 #include "ss_message.h"
 #include "ss_client.h"
 #include "spreadsheet.h"
+#include "ss_config.h"
 
 namespace ss {
 
@@ -33,18 +38,42 @@ namespace ss {
 //  (1.ss, 2.ss).  These spreadsheets will store their names, in case
 //  the index is damaged or lost
 
+// The index is read once at startup in to a hash map from spreadsheet
+//  name to file name, so finding a spreadsheet is an exact-match lookup
+//  rather than a search of the index document.
+//
+// A CREATE does not rewrite the index file.  It appends one line,
+//      <file name> <spreadsheet name>
+//  to a log next to it (ss_index.xml.log).  At startup the log is read on
+//  top of the xml index, and every so often (and at startup and shutdown)
+//  the log is folded back in to a new xml index, which stays readable by
+//  anything that used the old format.
+//
+// While the server runs, that is done on the save thread.  Under the lock
+//  the log is moved aside (to ss_index.xml.log.old) and the lookup copied;
+//  the save thread writes the copy out and then deletes the old log.
+//  Startup reads an old log left by a crash before the new one.
+
 // The manager is responsible for
 //    -responding to client create message
 //    -responding to ss_session get spreadsheet requests
 //    -indexing spreadsheets
+//
+// The public methods may be called from any io thread - they take the
+//  manager's lock themselves.
 
 class spreadsheet_manager {
 public:
-	// Creates a spreadsheet manager
-	spreadsheet_manager(std::string root_dir, std::string indexFile);
+	// Creates a spreadsheet manager - the spreadsheets it opens are set up
+	//  from config, and the index is rewritten on save_service
+	spreadsheet_manager(std::string root_dir, std::string indexFile,
+			boost::asio::io_service& save_service, const ss_config& config = ss_config());
+
+	// Writes any logged spreadsheets in to the xml index
+	~spreadsheet_manager();
 
 	// Called by dispatch to process a CREATE message
-	void handle_create_request(ss_client_ptr requester, ss_message create_request);
+	void handle_create_request(ss_client_ptr requester, const ss_message& create_request);
 
 	// Returns the requested spreadsheet - ss_session responsible for destroying spreadsheet
 	//  Returns null if spreadsheet was not found
@@ -56,17 +85,66 @@ private:
 	// Returns the filename of the spreadsheet - null if not found
 	std::string* find_spreadsheet(std::string ss_name);
 
+	// The spreadsheet file names, keyed by spreadsheet name
+	typedef boost::unordered_map<std::string, std::string> name_map;
+
+	// Adds the records in a log to the lookup, and drops a partial record
+	//  left at the end by a crash
+	void load_log(const std::string& filename);
+
+	// Appends a new spreadsheet to the log - returns false if it could not
+	//  be written
+	bool append_log(const std::string& filename, const std::string& ss_name);
+
+	// Writes the lookup out as the xml index, and empties the logs - for
+	//  startup and shutdown.  Returns false if the index could not be
+	//  written
+	bool compact();
+
+	// Moves the log aside, and has the save thread write the index from a
+	//  copy of the lookup.  If an old log was kept from a failed write, the
+	//  log stays where it is - the index has its records too.  LOCK BEFORE
+	//  CALLING
+	void start_compact();
+
+	// Runs on the save thread - writes names out as the xml index, then
+	//  deletes the old log.  If the write fails, the old log is kept and
+	//  the next CREATE to fill the log tries again
+	void finish_compact(boost::shared_ptr<const name_map> names, int next_file_id);
+
+	// Writes names out in the xml index format - returns false if it
+	//  could not be written
+	static bool export_xml(const name_map& names, int next_file_id, const std::string& filename);
+
 	// The index full file name
 	std::string index_fullfile_;
 
-	// The index XML document
-	xmlDocPtr index_xml_;
+	// The log full file name
+	std::string log_fullfile_;
+
+	// The log being folded in to the index, while that is written
+	std::string old_log_fullfile_;
+
+	// Whether the save thread is writing the index
+	bool compacting_;
+
+	// Whether the old log is still there because the index write failed
+	bool old_log_kept_;
 
-	// The root index node
-	xmlNodePtr index_;
+	// Runs the index writes
+	boost::asio::io_service& save_service_;
 
-	// The xpath search context
-	xmlXPathContextPtr xpathCtx_;
+	// The log, opened for appending (-1 until the first CREATE)
+	int log_fd_;
+
+	// The number of records in the log
+	unsigned int log_records_;
+
+	// The server tunables, passed on to each spreadsheet
+	ss_config config_;
+
+	// The spreadsheet file names, keyed by spreadsheet name
+	name_map names_;
 
 	// The root directory
 	std::string root_dir_;
@@ -74,6 +152,9 @@ private:
 	// The next spreadsheet file serial number
 	int next_file_id_;
 
+	// Guards the index
+	boost::mutex mutex_;
+
 };
 
 class SSFileIOException : public std::exception
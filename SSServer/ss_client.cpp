@@ -12,12 +12,23 @@
 
 namespace ss {
 
-ss_client::ss_client(boost::asio::io_service& io_service, ss_server& server)
-	: socket_(io_service),
+// Streams are written to the socket this much at a time
+static const std::size_t stream_chunk_size = 64 * 1024;
+
+ss_client::ss_client(boost::asio::io_service& io_service, ss_server& server,
+		const ss_config& config, client_stats& stats)
+	: strand_(io_service),
+	  writing_(false),
+	  queued_bytes_(0),
+	  in_flight_bytes_(0),
+	  high_water_(config.client_queue_bytes),
+	  low_water_(config.client_queue_bytes / 4),
+	  disconnect_slow_(config.disconnect_slow_clients),
+	  stats_(stats),
+	  socket_(io_service),
+	  next_parsed_(0),
 	  server_(server)
 {
-	waiting_for_ = command;
-	blob_size_ = 0;
 }
 
 boost::asio::ip::tcp::socket& ss_client::socket()
@@ -29,381 +40,296 @@ void ss_client::start()
 {
 	//Start waiting for data
 	socket_.async_read_some(boost::asio::buffer(buffer_),
-			boost::bind(&ss_client::handle_read, shared_from_this(),
+			strand_.wrap(boost::bind(&ss_client::handle_read, shared_from_this(),
 					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred));
+					boost::asio::placeholders::bytes_transferred)));
 }
 
 void ss_client::stop()
 {
-	socket_.close();
+	strand_.post(boost::bind(&ss_client::close, shared_from_this()));
+}
+
+void ss_client::close()
+{
+	boost::system::error_code ignored;
+	socket_.close(ignored);
+}
+
+void ss_client::tell(const ss_message& msg)
+{
+	tell(msg.encode());
 }
 
-void ss_client::tell(ss_message msg)
+void ss_client::tell(ss_buffer_ptr data)
 {
-	// Add the command
-	to_send_ = msg.get_command_str() + "\n";
-	// For each item in params, if it starts with an uppercase letter, it
-	//  must have a header (e.g., "Name:").  The param keys are the same
-	//  as the required header.  We'll simply append a ":" to these as
-	//  they are inserted in to the response string
-
-	for(unsigned int x = 0; x < msg.params.size(); x++)
+	// Queue the data for the socket.  Sessions call tell from their own
+	//  threads, so hand it to the strand.
+	outgoing out;
+	out.buffer = data;
+	strand_.dispatch(boost::bind(&ss_client::queue_write, shared_from_this(), out));
+}
+
+void ss_client::tell_update(ss_buffer_ptr data, boost::shared_ptr<ss_session> session)
+{
+	outgoing out;
+	out.buffer = data;
+	out.update_from = session;
+	strand_.dispatch(boost::bind(&ss_client::queue_write, shared_from_this(), out));
+}
+
+void ss_client::end_resync(boost::shared_ptr<ss_session> session)
+{
+	strand_.dispatch(boost::bind(&ss_client::handle_end_resync, shared_from_this(), session));
+}
+
+void ss_client::handle_end_resync(boost::shared_ptr<ss_session> session)
+{
+	// Everything the session queues from here on is after the snapshot
+	if(lagging_.erase(session) > 0)
 	{
-		int a = (int)'A';
-		int z = (int)'Z';
-		int cur = (int)msg.params[x].first[0];
-		if(a <= cur && cur <= z)
-		{
-			// This param requires a header.  Append a colon, then the data
-			//  and finally a \n
-			to_send_ += msg.params[x].first + ':' + msg.params[x].second + '\n';
-		}
-		else
+		stats_.resyncs++;
+	}
+}
+
+void ss_client::tell(ss_stream_ptr data)
+{
+	outgoing out;
+	out.stream = data;
+	strand_.dispatch(boost::bind(&ss_client::queue_write, shared_from_this(), out));
+}
+
+void ss_client::queue_write(outgoing data)
+{
+	// Nothing more goes to a client that has been disconnected
+	if(!socket_.is_open())
+	{
+		return;
+	}
+
+	// The session is going to send the spreadsheet afresh - this UPDATE
+	//  will be part of it
+	if(data.update_from && lagging_.find(data.update_from) != lagging_.end())
+	{
+		stats_.dropped++;
+		return;
+	}
+
+	outbox_.push_back(data);
+	if(data.buffer)
+	{
+		queued_bytes_ += data.buffer->size();
+	}
+	if(queued_bytes_ > high_water_)
+	{
+		shed_load();
+		if(!socket_.is_open())
 		{
-			// If this param key does not start with an uppercase letter, it is
-			//  a blob.  Append it, plus a \n, to the string without header
-			to_send_ += msg.params[x].second + '\n';
+			return;
 		}
 	}
-	// Now that the output is ready, send it to the socket.  (send in chunks of 8192)
-	//std::vector<boost::asio::const_buffer> to_send_buffs;
-	//unsigned int pos = 0;
-	//while(pos <= to_send_.length())
-	//{
-	//to_send_buffs.push_back(boost::asio::buffer(to_send_.substr(pos, 8192)));
-//		pos += 8192;
-	//}
-	boost::asio::async_write(socket_, boost::asio::buffer(to_send_), boost::bind(&ss_client::handle_write,
-			shared_from_this(), boost::asio::placeholders::error));
-	//socket_.send(to_send);
+
+	// If a write is already going, handle_write will pick this up
+	if(!writing_)
+	{
+		start_write();
+	}
 }
 
-void ss_client::handle_read(const boost::system::error_code& e,
-		std::size_t bytes_transferred)
+void ss_client::shed_load()
 {
-	if(!e)
+	if(!disconnect_slow_)
 	{
-		// Grab a pointer to our buffer that we can manipulate
-		char* bufPtr = buffer_.begin();
-		// Loop through the data we received in the buffer, and add it to unused_
-		while(bufPtr != buffer_.begin() + bytes_transferred)
+		// Drop the queued UPDATEs, remembering which sessions they are from
+		std::deque<outgoing> kept;
+		for(std::deque<outgoing>::iterator it = outbox_.begin(); it != outbox_.end(); ++it)
 		{
-			char curChar = *bufPtr;
-			if(curChar == '\r' && *(bufPtr + 1) == '\n')
+			if(it->update_from)
 			{
-				//Skip it - coming from telnet
-				bufPtr++;
-			}
-			// If we're not waiting for a blob, we're only interested in unused_
-			//   if the current char is \n
-			else if(waiting_for_ != blob && curChar == '\n')
-			{
-				// If the current line is a command, we want to reset the state,
-				//  and start processing the new command
-				//
-				// Try the current line as a header - if it is, this method
-				//  will set the appropriate cur_msg_type_ and waiting_for_ states
-				//  and clear unused_ to wait for the next token.
-				bool is_command = try_as_command();
-				if(is_command)
-				{
-					// Nothing to do here - cur_msg_type_ and waiting_for_ have
-					//  already been appropriately set.  Continue to process next
-					//  character in buffer...
-					bufPtr++;
-
-				}
-				// If we're waiting for a command, and the current line is not a command,
-				//  drop unused_
-				else if(waiting_for_ == command)
-				{
-					next_message_.command = ss_message::ERROR;
-					tell(next_message_);
-					ss_message newNext;
-					std::swap(newNext, next_message_);
-					unused_ = "";
-					bufPtr++;
-				}
-				// If here, we're waiting for a message token - lets see what we find
-				else
-				{
-					std::string wait_delim = get_waiting_for_delim();
-					// See if the beginning of unused_ matches the delimiter
-					//  Check first to make sure unused_ is not shorter than delim
-					if(unused_.length() < wait_delim.length())
-					{
-						// Current line is to short - sending ERROR and
-						//reset waiting_for_ state to waiting for command
-						next_message_.command = ss_message::ERROR;
-						tell(next_message_);
-						ss_message newNext;
-						std::swap(newNext, next_message_);
-						waiting_for_ = command;
-
-					}
-					else
-					{
-						// We have sufficient length to test
-						// See if the current line is what we're waiting for
-						if(unused_.compare(0, wait_delim.length(), wait_delim) == 0)
-						{
-							// Here, the line begins with the delim.
-							// Grab the content from the end of the delim to the \n
-							std::string value = unused_.substr(wait_delim.length(), unused_.length() - 1);
-							// Add the delim and value to the next_message_ as a param
-							//  (trim the ":" from the delim before using as the key in params)
-							next_message_.set(wait_delim.substr(0,wait_delim.length() - 1), value);
-							// Finally, set the waiting_for_ state to look for the next required token.
-							update_waiting_for();
-							// And empty unused_
-							unused_ = "";
-							bufPtr++;
-						}
-						else
-						{
-							// If we didn't find the token we are expecting, send ERROR,
-							//abandon the message, and begin to wait for a command, again
-							next_message_.command = ss_message::ERROR;
-							tell(next_message_);
-							ss_message newNext;
-							std::swap(newNext, next_message_);
-							waiting_for_ = command;
-							unused_ = "";
-							bufPtr++;
-							ss_message new_next;
-							std::swap(next_message_, new_next);
-						}
-					}
-				}
-			}
-			else if(curChar == '\n' || (waiting_for_ == blob && blob_size_ == unused_.length()))
-			{
-				// If here, we have a new line, but we are waiting for a blob
-				//  check to see if the unused_ is the same length as blob_size_
-				// If it is the same size, then put the blob (the only blob we receive on the server is
-				//  a cell "content") in the next_message_
-				if(unused_.length() == blob_size_)
-				{
-					next_message_.set("content", unused_);
-					unused_ = "";
-					update_waiting_for();
-					bufPtr++;
-				}
-				else
-				{
-					// If not, wait for more...
-					//(but keep the \n)
-					unused_.push_back(*bufPtr++);
-				}
+				lagging_.insert(std::make_pair(it->update_from, false));
+				queued_bytes_ -= it->buffer->size();
+				stats_.dropped++;
 			}
 			else
 			{
-				// If here, the current character is not a \n.  Add the current char to unused, and continue
-				unused_.push_back(*bufPtr++);
+				kept.push_back(*it);
 			}
-		} /* End while more buffer data */
+		}
+		outbox_.swap(kept);
+		if(queued_bytes_ <= high_water_)
+		{
+			return;
+		}
 	}
-	else
+
+	// Still too much - give up on the client
+	std::cerr << "Disconnecting a client that is not reading its socket\n";
+	stats_.disconnects++;
+	outbox_.clear();
+	close();
+}
+
+void ss_client::request_resyncs()
+{
+	std::map<boost::shared_ptr<ss_session>, bool>::iterator it;
+	for(it = lagging_.begin(); it != lagging_.end(); ++it)
 	{
-		//Here, we got an error on the socket
-		server_.remove_client(shared_from_this());
+		if(!it->second)
+		{
+			it->second = true;
+			it->first->post(boost::bind(&ss_session::resync_client, it->first, shared_from_this()));
+		}
 	}
-	// Listen for more
-	start();
 }
 
-void ss_client::handle_write(const boost::system::error_code& e)
+void ss_client::start_write()
 {
-	if(!e)
+	// Move everything pending in to in_flight_, and send it all as one
+	//  buffer sequence.  A stream stays at the front of outbox_ until it
+	//  runs dry, so anything queued behind it waits its turn.
+	std::vector<boost::asio::const_buffer> buffers;
+	while(!outbox_.empty())
 	{
-		//Make sure we don't have any pending data to send
-
+		outgoing& next = outbox_.front();
+		if(next.stream)
+		{
+			if(next.stream->next_chunk(stream_chunk_, stream_chunk_size))
+			{
+				buffers.push_back(boost::asio::buffer(stream_chunk_));
+				queued_bytes_ += stream_chunk_.length();
+				in_flight_bytes_ += stream_chunk_.length();
+				break;
+			}
+			outbox_.pop_front();
+			continue;
+		}
+		in_flight_.push_back(next.buffer);
+		buffers.push_back(boost::asio::buffer(*next.buffer));
+		in_flight_bytes_ += next.buffer->size();
+		outbox_.pop_front();
 	}
-	else
+	if(buffers.empty())
 	{
-		server_.remove_client(shared_from_this());
+		return;
 	}
+	writing_ = true;
+	boost::asio::async_write(socket_, buffers, strand_.wrap(boost::bind(&ss_client::handle_write,
+			shared_from_this(), boost::asio::placeholders::error)));
 }
 
-bool ss_client::try_as_command()
+void ss_client::handle_read(const boost::system::error_code& e,
+		std::size_t bytes_transferred)
 {
-	// All headers wait first for Name: token
-	if(unused_ == "CREATE" || unused_ == "CREATE\r")
+	if(e)
 	{
-		// Indicate we're now trying to parse a CREATE message,
-		// we're waiting for a Name:, and clear unused_
-		cur_msg_type_ = CREATE;
-		waiting_for_ = name;
-		// Reset the next_message_  and set the command appropriately
-		ss_message new_next;
-		std::swap(next_message_, new_next);
-		next_message_.command = ss_message::CREATE;
-		unused_ = "";
-		return true;
+		//Here, we got an error on the socket - stop listening, or the
+		//  failed read completes again straight away
+		server_.remove_client(shared_from_this());
+		return;
 	}
-	else if(unused_ == "JOIN" || unused_ == "JOIN\r")
+	// Parse what we received, then hand on each message it completed
+	parser_.parse(buffer_.data(), bytes_transferred, parsed_);
+	next_parsed_ = 0;
+	dispatch_parsed();
+}
+
+void ss_client::dispatch_parsed()
+{
+	while(next_parsed_ < parsed_.size())
 	{
-		cur_msg_type_ = JOIN;
-		waiting_for_ = name;
-		ss_message new_next;
-		std::swap(next_message_, new_next);
-		next_message_.command = ss_message::JOIN;
-		unused_ = "";
-		return true;
+		ss_message& next = parsed_[next_parsed_++];
+		if(next.command == ss_message::ERROR)
+		{
+			tell(next);
+		}
+		else if(!server_.dispatch_request(shared_from_this(), next))
+		{
+			// The server is still working on it (e.g. loading a spreadsheet
+			//  to JOIN) - the rest wait, so they are handled in order
+			return;
+		}
 	}
-	else if(unused_ == "UNDO" || unused_ == "UNDO\r")
+	parsed_.clear();
+	// Listen for more
+	start();
+}
+
+void ss_client::resume(boost::function<void()> finish)
+{
+	strand_.post(boost::bind(&ss_client::handle_resume, shared_from_this(), finish));
+}
+
+void ss_client::handle_resume(boost::function<void()> finish)
+{
+	if(finish)
 	{
-		cur_msg_type_ = UNDO;
-		waiting_for_ = name;
-		ss_message new_next;
-		std::swap(next_message_, new_next);
-		next_message_.command = ss_message::UNDO;
-		unused_ = "";
-		return true;
+		finish();
 	}
-	else if(unused_ == "SAVE" || unused_ == "SAVE\r")
+	dispatch_parsed();
+}
+
+void ss_client::handle_write(const boost::system::error_code& e)
+{
+	writing_ = false;
+	in_flight_.clear();
+	queued_bytes_ -= in_flight_bytes_;
+	in_flight_bytes_ = 0;
+	if(!e)
 	{
-		cur_msg_type_ = SAVE;
-		waiting_for_ = name;
-		ss_message new_next;
-		std::swap(next_message_, new_next);
-		next_message_.command = ss_message::SAVE;
-		unused_ = "";
-		return true;
+		//A slow client that has caught up gets the spreadsheets whose
+		//  UPDATEs it missed
+		if(!lagging_.empty() && queued_bytes_ <= low_water_)
+		{
+			request_resyncs();
+		}
+		//Send whatever was queued while that write was going
+		if(!outbox_.empty())
+		{
+			start_write();
+		}
 	}
-	else if(unused_ == "CHANGE" || unused_ == "CHANGE\r")
+	else
 	{
-		cur_msg_type_ = CHANGE;
-		waiting_for_ = name;
-		ss_message new_next;
-		std::swap(next_message_, new_next);
-		next_message_.command = ss_message::CHANGE;
-		unused_ = "";
-		return true;
+		outbox_.clear();
+		queued_bytes_ = 0;
+		server_.remove_client(shared_from_this());
 	}
-	else if(unused_ == "LEAVE" || unused_ == "LEAVE\r")
+}
+
+void ss_client::joined(const std::string& name, boost::shared_ptr<ss_session> session)
+{
+	sessions_[name] = session;
+}
+
+void ss_client::left(const std::string& name)
+{
+	std::map<std::string, boost::shared_ptr<ss_session> >::iterator it = sessions_.find(name);
+	if(it != sessions_.end())
 	{
-		cur_msg_type_ = LEAVE;
-		waiting_for_ = name;
-		ss_message new_next;
-		std::swap(next_message_, new_next);
-		next_message_.command = ss_message::LEAVE;
-		unused_ = "";
-		return true;
+		lagging_.erase(it->second);
+		sessions_.erase(it);
 	}
-	return false;
 }
 
-std::string ss_client::get_waiting_for_delim()
+boost::shared_ptr<ss_session> ss_client::joined_session(const std::string& name)
 {
-	switch(waiting_for_)
+	std::map<std::string, boost::shared_ptr<ss_session> >::iterator it = sessions_.find(name);
+	if(it == sessions_.end())
 	{
-	case command:
-		return "";
-	case name:
-		return "Name:";
-	case password:
-		return "Password:";
-	case version:
-		return "Version:";
-	case cell:
-		return "Cell:";
-	case length:
-		return "Length:";
-	case blob:
-		//Not really important, wont be used
-		return "blob";
+		return boost::shared_ptr<ss_session>();
 	}
-	return "";
+	return it->second;
 }
 
-void ss_client::update_waiting_for()
+void ss_client::take_sessions(std::vector<boost::shared_ptr<ss_session> >& out)
 {
-	// Only called if current token was successful.
-
-	ss_message new_next;
-	switch(cur_msg_type_)
+	std::map<std::string, boost::shared_ptr<ss_session> >::iterator it;
+	for(it = sessions_.begin(); it != sessions_.end(); ++it)
 	{
-	// CREATE and JOIN have the same format
-	case CREATE:
-	case JOIN:
-		switch(waiting_for_)
-		{
-		case name:
-			waiting_for_ = password;
-			break;
-		case password:
-			// This is the end of this message format.
-			// Send the message to dispatch, empty it, then reset waiting_for_
-			server_.dispatch_request(shared_from_this(), next_message_);
-			std::swap(next_message_, new_next);
-			waiting_for_ = command;
-			break;
-		default:
-			//We should never get here, but not resetting here will never let
-			//  the state out of the broken state
-			waiting_for_ = command;
-			break;
-		}
-		break;
-	// LEAVE and SAVE have the same format
-	case SAVE:
-	case LEAVE:
-		// The only thing we need is name, which we already got - reset
-		server_.dispatch_request(shared_from_this(), next_message_);
-		std::swap(next_message_, new_next);
-		waiting_for_ = command;
-		break;
-	case UNDO:
-		switch(waiting_for_)
-		{
-		case name:
-			waiting_for_ = version;
-			break;
-		case version:
-			server_.dispatch_request(shared_from_this(), next_message_);
-			std::swap(next_message_, new_next);
-			waiting_for_ = command;
-			break;
-		default:
-			//We should never get here, but not resetting here will never let
-			//  the state out of the broken state
-			waiting_for_ = command;
-			break;
-		}
-		break;
-	case CHANGE:
-		switch(waiting_for_)
-		{
-		case name:
-			waiting_for_ = version;
-			break;
-		case version:
-			waiting_for_ = cell;
-			break;
-		case cell:
-			waiting_for_ = length;
-			break;
-		case length:
-			// We need to put the length of the CHANGE Content: token in
-			//  blob_size_, then wait for content
-			blob_size_ = boost::lexical_cast<int>(next_message_.get_val("Length"));
-			waiting_for_ = blob;
-			break;
-		case blob:
-			server_.dispatch_request(shared_from_this(), next_message_);
-			std::swap(next_message_, new_next);
-			waiting_for_ = command;
-			break;
-		default:
-			//We should never get here, but not resetting here will never let
-			//  the state out of the broken state
-			waiting_for_ = command;
-			break;
-		}
-		break;
+		out.push_back(it->second);
 	}
+	sessions_.clear();
+	lagging_.clear();
 }
 
 }
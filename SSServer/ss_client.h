@@ -9,29 +9,65 @@
 #define SS_CLIENT_H_
 
 #include <vector>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/asio.hpp>
+#include <boost/array.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/atomic.hpp>
 #include "ss_message.h"
+#include "ss_parser.h"
+#include "ss_stream.h"
+#include "ss_config.h"
 
 
 namespace ss {
 
 
 class ss_server;
+class ss_session;
+
+// Counts of how slow clients were dealt with, across every client
+struct client_stats
+{
+	client_stats() : dropped(0), resyncs(0), disconnects(0) {}
+
+	// UPDATEs dropped from slow clients' queues
+	boost::atomic<unsigned long> dropped;
+	// Spreadsheets sent afresh to clients that caught up
+	boost::atomic<unsigned long> resyncs;
+	// Slow clients disconnected
+	boost::atomic<unsigned long> disconnects;
+};
 
 //A tcp connection represents a tcp connection.  It contains a socket
 //Inherit enable_shared_from_this, so this object can be treated as
 //  a shared pointer.  When no code has a reference to the shared pointer,
 //  this tcp_connection is automatically deleted
+//All socket handlers run on the client's strand; tell() may be called
+//  from any thread.
+//
+//A client that does not read its socket is not allowed to queue data
+//  without limit.  Once more than config.client_queue_bytes is queued,
+//  its queued UPDATEs are dropped, and so are any more for the same
+//  sessions.  When its queue is down to a quarter of the limit, each of
+//  those sessions sends it a JOIN OK with the spreadsheet as it is now,
+//  and its UPDATEs flow again.  If the queue is still over the limit
+//  without the UPDATEs, or config.disconnect_slow_clients is set, the
+//  client is disconnected instead.  The limit is never below
+//  min_client_queue_bytes, so a JOIN OK on its own does not count as slow.
 class ss_client : public boost::enable_shared_from_this<ss_client>, private boost::noncopyable
 {
 public:
-	//A new tcp_connection
-	ss_client(boost::asio::io_service& io_service, ss_server& server);
+	//A new tcp_connection - config sets how much may be queued for it,
+	//  and stats counts what is done when it is too slow
+	ss_client(boost::asio::io_service& io_service, ss_server& server,
+			const ss_config& config, client_stats& stats);
 
 	//Returns a reference to the socket attached to this tcp_connection
 	boost::asio::ip::tcp::socket& socket();
@@ -43,7 +79,38 @@ public:
 	void stop();
 
 	// Sends a message to the client
-	void tell(ss_message msg);
+	void tell(const ss_message& msg);
+
+	// Sends an already encoded message to the client.  The buffer is
+	//  shared, not copied, so a broadcast only has to be encoded once.
+	void tell(ss_buffer_ptr data);
+
+	// Sends an UPDATE from session.  It may be dropped if the client is
+	//  too slow - the session then sends the spreadsheet afresh instead
+	void tell_update(ss_buffer_ptr data, boost::shared_ptr<ss_session> session);
+
+	// Called by a session about to send the spreadsheet afresh - its
+	//  UPDATEs are no longer dropped after this
+	void end_resync(boost::shared_ptr<ss_session> session);
+
+	// Sends data produced by a stream.  Only one piece of the stream is
+	//  held at a time; the next is pulled once the last has been written.
+	void tell(ss_stream_ptr data);
+
+	// The sessions the client has joined, so its requests go straight to
+	//  them rather than through the server's session map.  These are only
+	//  used while dispatching the client's requests, on its strand.
+	void joined(const std::string& name, boost::shared_ptr<ss_session> session);
+	void left(const std::string& name);
+	// Returns the named session if the client has joined it, or null
+	boost::shared_ptr<ss_session> joined_session(const std::string& name);
+	// Forgets every session the client has joined, and hands them back
+	void take_sessions(std::vector<boost::shared_ptr<ss_session> >& out);
+
+	// Called by the server once it is done with a request it held on to
+	//  (see ss_server::dispatch_request) - runs finish on the strand, if
+	//  given, then goes on with the requests after it
+	void resume(boost::function<void()> finish);
 
 private:
 	//Callback from async read
@@ -53,55 +120,95 @@ private:
 	//Callback from async write
 	void handle_write(const boost::system::error_code& e);
 
+	//Hands the parsed messages to the server, then reads more - stops if
+	//  the server holds on to one - runs on strand_
+	void dispatch_parsed();
+
+	//Runs on strand_ - see resume
+	void handle_resume(boost::function<void()> finish);
+
+	//Something waiting to be sent - either a buffer or a stream
+	struct outgoing
+	{
+		ss_buffer_ptr buffer;
+		ss_stream_ptr stream;
+		//The session an UPDATE is from - null for anything else
+		boost::shared_ptr<ss_session> update_from;
+	};
+
+	//Queues data for the socket - runs on strand_
+	void queue_write(outgoing data);
+
+	//Writes everything in outbox_ with a single async_write, up to and
+	//  including the next piece of the first stream - runs on strand_
+	void start_write();
+
+	//Closes the socket - runs on strand_
+	void close();
+
+	//Drops the queued UPDATEs once too much is queued, or disconnects the
+	//  client - runs on strand_
+	void shed_load();
+
+	//Asks the sessions whose UPDATEs were dropped to send the spreadsheet
+	//  afresh, once the queue has gone down - runs on strand_
+	void request_resyncs();
+
+	//Runs on strand_ - see end_resync
+	void handle_end_resync(boost::shared_ptr<ss_session> session);
+
+	//Serializes the socket handlers across the io threads
+	boost::asio::io_service::strand strand_;
+
 	//A buffer for incoming data
 	boost::array<char, 8192> buffer_;
 
-	//A string to be sent
-	std::string to_send_;
+	//Messages waiting to be sent, oldest first
+	std::deque<outgoing> outbox_;
+
+	//Messages handed to the current async_write.  They must stay alive
+	//  (and unchanged) until handle_write is called.
+	std::vector<ss_buffer_ptr> in_flight_;
+
+	//The piece of a stream handed to the current async_write
+	std::string stream_chunk_;
+
+	//Whether an async_write is outstanding
+	bool writing_;
+
+	//The bytes queued in outbox_ and in_flight_
+	std::size_t queued_bytes_;
+
+	//The bytes in_flight_ and stream_chunk_ hold
+	std::size_t in_flight_bytes_;
+
+	//The sessions whose UPDATEs are being dropped, and whether each has
+	//  been asked to send the spreadsheet afresh
+	std::map<boost::shared_ptr<ss_session>, bool> lagging_;
+
+	//How much may be queued before the client is too slow
+	std::size_t high_water_;
+	//How far the queue must go down before a resync
+	std::size_t low_water_;
+	//Whether a slow client is disconnected
+	bool disconnect_slow_;
+
+	//The server's slow client counts
+	client_stats& stats_;
 
 	//The asio tcp socket
 	boost::asio::ip::tcp::socket socket_;
 
-	// Contains unused information received from socket (not yet part of message)
-	std::string unused_;
-
-	// The type of message the parser is currently trying to process
-	enum msg_type {
-		JOIN,
-		CREATE,
-		CHANGE,
-		SAVE,
-		LEAVE,
-		UNDO
-	} cur_msg_type_;
-
-	// Indicates the type of token we're waiting for
-	enum waiting_for {
-		command,
-		name,
-		password,
-		version,
-		cell,
-		length,
-		blob
-	} waiting_for_;
-
-	// When waiting_for_ is blob, this tells how much to wait for
-	unsigned int blob_size_;
-
-	// Determines whether unused_ is a command token
-	bool try_as_command();
-
-	// Returns the Token delimiter needed for the current waiting_for_
-	//  state
-	std::string get_waiting_for_delim();
-
-	// Sets the proper waiting_for_ state to begin searching for the
-	//  next message
-	void update_waiting_for();
-
-	// A message to build as we parse
-	ss_message next_message_;
+	// Turns the incoming data in to messages
+	ss_parser parser_;
+
+	// Messages completed by the last read, waiting for dispatch
+	std::vector<ss_message> parsed_;
+	// The next of parsed_ to dispatch
+	std::size_t next_parsed_;
+
+	// The sessions the client has joined, by spreadsheet name
+	std::map<std::string, boost::shared_ptr<ss_session> > sessions_;
 
 	// A reference to the server
 	ss_server& server_;
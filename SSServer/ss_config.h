@@ -0,0 +1,98 @@
+/*
+ * ss_config.h
+ *
+ *  Created on: Apr 22, 2013
+ *      Author: montgomc
+ */
+
+#ifndef SS_CONFIG_H_
+#define SS_CONFIG_H_
+
+#include <cstddef>
+#include <boost/thread.hpp>
+
+namespace ss {
+
+// Spreadsheets whose xml is longer than this are streamed to joining
+//  clients, rather than built in to a single message
+static const std::size_t max_join_buffer = 1 << 20;
+
+// The least that may be queued for a client: room for a whole JOIN OK
+//  built in to a single message, and the replies queued around it
+static const std::size_t min_client_queue_bytes = 2 * max_join_buffer;
+
+// Server tunables.  The defaults are set here; main overrides them with
+//  the optional --key=value arguments on the command line.
+struct ss_config
+{
+	ss_config()
+		: io_threads(boost::thread::hardware_concurrency()),
+		  workers(boost::thread::hardware_concurrency()),
+		  loaders(2),
+		  xml_files(false),
+		  lazy_load(true),
+		  cache_bytes(256 << 20),
+		  undo_bytes(1 << 20),
+		  keep_undo_on_save(false),
+		  update_interval_ms(0),
+		  client_queue_bytes(4 << 20),
+		  disconnect_slow_clients(false),
+		  formulas(false)
+	{
+		if(io_threads == 0)
+			io_threads = 1;
+		if(workers == 0)
+			workers = 1;
+	}
+
+	// Number of threads running the io_service
+	unsigned int io_threads;
+
+	// Number of threads running session work
+	unsigned int workers;
+
+	// Number of threads loading spreadsheets for JOINs, so a JOIN does not
+	//  wait behind a save, or behind a JOIN of another spreadsheet
+	unsigned int loaders;
+
+	// Save spreadsheets in the old xml format rather than the binary one
+	bool xml_files;
+
+	// Map binary spreadsheet files and read cells as they are used, rather
+	//  than reading every cell when the spreadsheet is opened
+	bool lazy_load;
+
+	// How much memory the spreadsheets of closed sessions may hold on to,
+	//  so they open again without a reload
+	std::size_t cache_bytes;
+
+	// How much memory each session's undo history may use - the oldest
+	//  changes are forgotten past this
+	std::size_t undo_bytes;
+
+	// Keep the undo history when a spreadsheet is saved, rather than
+	//  starting a new one
+	bool keep_undo_on_save;
+
+	// How long a session gathers UPDATEs before sending them, in ms.  In
+	//  that time each client's UPDATEs are merged in to one, keeping only
+	//  the last write to each cell.  0 sends every UPDATE straight away
+	unsigned int update_interval_ms;
+
+	// How much may be queued for a client before it is treated as slow.
+	//  A slow client's queued UPDATEs are dropped, and once its queue is
+	//  down to a quarter of this it is sent the spreadsheet afresh.  Never
+	//  less than min_client_queue_bytes
+	std::size_t client_queue_bytes;
+
+	// Disconnect slow clients, rather than dropping their UPDATEs
+	bool disconnect_slow_clients;
+
+	// Work formulas out on the server, and send clients the values along
+	//  with the contents.  A CHANGE that would make a formula depend on
+	//  itself is turned away
+	bool formulas;
+};
+
+}
+#endif /* SS_CONFIG_H_ */
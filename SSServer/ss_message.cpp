@@ -6,62 +6,52 @@
  */
 
 #include "ss_message.h"
+#include <algorithm>
+#include <boost/make_shared.hpp>
 
 namespace ss {
 
 ss_message::ss_message()
+	: command(ERROR),
+	  version(no_version),
+	  length(no_length),
+	  set_(0)
 {
-
 }
 
-ss_message::ss_message(ss_message& orig)
+void ss_message::swap(ss_message& other)
 {
-	this->params = orig.params;
-	this->command = orig.command;
+	std::swap(command, other.command);
+	for(int x = 0; x < field_count; x++)
+	{
+		fields_[x].swap(other.fields_[x]);
+	}
+	std::swap(set_, other.set_);
+	std::swap(version, other.version);
+	std::swap(length, other.length);
+	document.swap(other.document);
+	cells.swap(other.cells);
+	values.swap(other.values);
 }
 
-void ss_message::set(std::string key, std::string val)
+void ss_message::set(field key, const std::string& val)
 {
-	int idx = find(key);
-	if(idx == -1)
-	{
-		//It doesn't exist.  Append it
-		params.push_back(std::make_pair<std::string,std::string>(key,val));
-	}
-	else
-	{
-		//It does exist - update val
-		params[idx].second = val;
-	}
+	value(key) = val;
 }
 
-int ss_message::find(std::string key)
+std::string& ss_message::value(field key)
 {
-	for(unsigned int x = 0; x < params.size(); x++)
-	{
-		if(params[x].first == key)
-		{
-			return x;
-		}
-	}
-	return -1;
+	set_ |= 1 << key;
+	return fields_[key];
 }
 
-std::string ss_message::get_val(std::string key)
+const std::string& ss_message::get(field key) const
 {
-	int idx = find(key);
-	if(idx == -1)
-	{
-		return "";
-	}
-	else
-	{
-		return params[idx].second;
-	}
+	return fields_[key];
 }
 
 
-std::string ss_message::get_command_str()
+std::string ss_message::get_command_str() const
 {
 	switch(command)
 	{
@@ -111,6 +101,108 @@ std::string ss_message::get_command_str()
 	throw new std::exception();
 }
 
+// Appends a number to out
+static void append_number(std::size_t number, std::string& out)
+{
+	char digits[24];
+	char* it = digits + sizeof(digits);
+	do
+	{
+		*--it = '0' + number % 10;
+		number /= 10;
+	} while(number > 0);
+	out.append(it, digits + sizeof(digits) - it);
+}
+
+void ss_message::encode(std::string& out) const
+{
+	// Make room for it all up front - the headers are short, and the
+	//  rest is mostly contents
+	std::size_t size = 128 + fields_[NAME].length() + fields_[PASSWORD].length()
+			+ fields_[MESSAGE].length() + document.length();
+	for(cell_list::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		size += it->second.length() + 32;
+	}
+	for(cell_list::const_iterator it = values.begin(); it != values.end(); ++it)
+	{
+		size += it->second.length() + 32;
+	}
+	out.clear();
+	out.reserve(size);
+	out += get_command_str();
+	out += '\n';
+	if(set_ & (1 << NAME))
+	{
+		out += "Name:";
+		out += fields_[NAME];
+		out += '\n';
+	}
+	if(set_ & (1 << PASSWORD))
+	{
+		out += "Password:";
+		out += fields_[PASSWORD];
+		out += '\n';
+	}
+	if(version != no_version)
+	{
+		out += "Version:";
+		append_number(version, out);
+		out += '\n';
+	}
+	if(length != no_length)
+	{
+		out += "Length:";
+		append_number(length, out);
+		out += '\n';
+		if(!document.empty() || length == 0)
+		{
+			out += document;
+			out += '\n';
+		}
+	}
+	// A single cell is sent the way it always has been
+	if(cells.size() > 1)
+	{
+		out += "Count:";
+		append_number(cells.size(), out);
+		out += '\n';
+	}
+	encode_cells(cells, out);
+	if(!values.empty())
+	{
+		out += "Values:";
+		append_number(values.size(), out);
+		out += '\n';
+		encode_cells(values, out);
+	}
+	if(set_ & (1 << MESSAGE))
+	{
+		out += fields_[MESSAGE];
+		out += '\n';
+	}
+}
+
+void ss_message::encode_cells(const cell_list& cells, std::string& out)
+{
+	char name[max_cell_name];
+	for(cell_list::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		out += "Cell:";
+		out.append(name, format_cell_address(it->first, name));
+		out += "\nLength:";
+		append_number(it->second.length(), out);
+		out += '\n';
+		out += it->second;
+		out += '\n';
+	}
 }
 
+ss_buffer_ptr ss_message::encode() const
+{
+	boost::shared_ptr<std::string> out = boost::make_shared<std::string>();
+	encode(*out);
+	return out;
+}
 
+}
@@ -10,19 +10,36 @@
 
 #include <vector>
 #include <string>
+#include <cstddef>
+#include <boost/shared_ptr.hpp>
+#include "cell_address.h"
 
 // As socket data is parsed, an ss_message is filled.
 // Once a message is complete, it gets sent to the
 //   server's processRequest method
 namespace ss {
 
-// An ordered list of parameters and values from the message
-typedef std::pair<std::string,std::string> kvp;
-
+// An encoded message, ready for the socket.  It is never changed once
+//  built, so one buffer can be queued on any number of clients.
+typedef boost::shared_ptr<const std::string> ss_buffer_ptr;
+
+// A message on its way from a client to a session.  A request is swapped
+//  in to one of these (a single allocation) and handed on by pointer - its
+//  fields are never copied
+class ss_message;
+typedef boost::shared_ptr<ss_message> ss_message_ptr;
+
+// A protocol message.  Every field has a place of its own, so nothing is
+//  looked up by name, and numbers are kept as numbers until the message is
+//  written out.  encode() writes whichever fields are set, in the order
+//  the protocol has them: Name, Password, Version, the document, the
+//  cells, the values, then the message text.
 class ss_message {
 public:
 	ss_message();
-	ss_message(ss_message& orig);
+
+	// Exchanges contents with another message, without copying
+	void swap(ss_message& other);
 
 	// The first line in a protocol message
 	enum _command
@@ -50,24 +67,62 @@ public:
 		ERROR
 	} command;
 
-	// Holds the params
-	std::vector<kvp> params;
+	// The text fields.  NAME and PASSWORD are headers (Name:, Password:);
+	//  MESSAGE is the reason a request failed, a line of its own
+	enum field
+	{
+		NAME,
+		PASSWORD,
+		MESSAGE,
+		field_count
+	};
 
-	void set(std::string key, std::string val);
+	// Sets a text field
+	void set(field key, const std::string& val);
 
-	std::string get_val(std::string key);
+	// Returns a text field to be filled in place, and marks it set
+	std::string& value(field key);
 
-	std::string get_command_str();
+	// Returns a text field, or empty string if it is not set
+	const std::string& get(field key) const;
 
-private:
-	int find(std::string key);
+	// Version:, or no_version
+	int version;
+	static const int no_version = -1;
 
-};
+	// Length: of the document that follows it - the spreadsheet in a
+	//  JOIN OK - or no_length.  A document too big to build is streamed
+	//  after the message instead, and document is left empty
+	std::size_t length;
+	static const std::size_t no_length = static_cast<std::size_t>(-1);
+	std::string document;
+
+	// The cells the message sets (CHANGE, UNDO OK, UPDATE), each written
+	//  as Cell:, Length: and the contents - after Count: if there is more
+	//  than one.  A cell whose name was not valid has address no_cell
+	cell_list cells;
+
+	// The formula values that changed, written as Values: and then Cell:,
+	//  Length: and the value of each - nothing if there are none
+	cell_list values;
 
-//std::string ss_message::get_command_str(ss_message::_command command)
+	std::string get_command_str() const;
 
+	// Writes the message out in protocol format
+	void encode(std::string& out) const;
+
+	// Encodes the message once in to a shareable buffer
+	ss_buffer_ptr encode() const;
+
+	// Writes Cell:, Length: and the contents (or value) of each cell
+	static void encode_cells(const cell_list& cells, std::string& out);
+
+private:
+	// The text fields, and which of them are set
+	std::string fields_[field_count];
+	unsigned int set_;
+};
 
 }
 
 #endif /* SS_MESSAGE_H_ */
-
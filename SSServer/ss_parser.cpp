@@ -0,0 +1,378 @@
+/*
+ * ss_parser.cpp
+ *
+ *  Created on: Apr 24, 2013
+ *      Author: montgomc
+ */
+
+#include "ss_parser.h"
+#include "line_scanner.h"
+#include <cstring>
+
+namespace ss {
+
+// Blobs larger than this still parse, but space for them is not
+//  reserved up front (so a bogus Length: can't make us allocate it)
+static const std::size_t max_blob_reserve = 1 << 20;
+
+// The most cells one batched CHANGE may set
+static const std::size_t max_batch_cells = 1 << 16;
+
+ss_parser::ss_parser()
+	: cur_msg_type_(JOIN),
+	  waiting_for_(command),
+	  blob_size_(0),
+	  cells_left_(0),
+	  cell_(no_cell)
+{
+}
+
+void ss_parser::parse(const char* data, std::size_t len, std::vector<ss_message>& out)
+{
+	const char* pos = data;
+	const char* end = data + len;
+	line_scanner lines(end);
+	while(pos != end)
+	{
+		if(waiting_for_ == blob)
+		{
+			// Take as much of the blob as this read holds in one copy
+			std::size_t want = blob_size_ - unused_.length();
+			std::size_t have = end - pos;
+			std::size_t take = want < have ? want : have;
+			unused_.append(pos, take);
+			pos += take;
+			if(unused_.length() == blob_size_)
+			{
+				// The only blob we receive on the server is a cell's contents
+				next_message_.cells.push_back(std::make_pair(cell_, std::string()));
+				next_message_.cells.back().second.swap(unused_);
+				unused_.clear();
+				update_waiting_for(out);
+			}
+			continue;
+		}
+
+		if(waiting_for_ == blob_end)
+		{
+			// Skip the line terminator that follows a blob
+			if(*pos == '\r')
+			{
+				pos++;
+				continue;
+			}
+			if(*pos == '\n')
+			{
+				pos++;
+			}
+			// A batched CHANGE goes on to its next cell
+			waiting_for_ = cells_left_ > 0 ? cell : command;
+			continue;
+		}
+
+		const char* nl = lines.next(pos);
+		if(nl == NULL)
+		{
+			// No complete line yet - keep the partial line for the next read
+			unused_.append(pos, end - pos);
+			break;
+		}
+
+		// Parse the line in place, unless it started in an earlier read
+		const char* line = pos;
+		std::size_t line_len = nl - pos;
+		if(!unused_.empty())
+		{
+			unused_.append(pos, line_len);
+			line = unused_.data();
+			line_len = unused_.length();
+		}
+		pos = nl + 1;
+
+		// Skip the \r - coming from telnet
+		if(line_len > 0 && line[line_len - 1] == '\r')
+		{
+			line_len--;
+		}
+		parse_line(line, line_len, out);
+		unused_.clear();
+	}
+}
+
+void ss_parser::parse_line(const char* line, std::size_t len, std::vector<ss_message>& out)
+{
+	// If the current line is a command, we want to reset the state,
+	//  and start processing the new command
+	if(try_as_command(line, len))
+	{
+		return;
+	}
+
+	// If we're waiting for a command, and the current line is not a command,
+	//  drop it
+	if(waiting_for_ == command)
+	{
+		fail_message(out);
+		return;
+	}
+
+	// A batched CHANGE has a Count: of cells in place of its first Cell:
+	if(try_as_count(line, len, out))
+	{
+		return;
+	}
+
+	// If here, we're waiting for a message token - see if the line begins
+	//  with the delimiter we are expecting
+	const char* delim = get_waiting_for_delim();
+	std::size_t delim_len = std::strlen(delim);
+	if(len < delim_len || std::memcmp(line, delim, delim_len) != 0)
+	{
+		// If we didn't find the token we are expecting, send ERROR,
+		//abandon the message, and begin to wait for a command, again
+		fail_message(out);
+		return;
+	}
+
+	// Store the value in its field
+	const char* val = line + delim_len;
+	std::size_t val_len = len - delim_len;
+	std::size_t number;
+	switch(waiting_for_)
+	{
+	case name:
+		next_message_.value(ss_message::NAME).assign(val, val_len);
+		break;
+	case password:
+		next_message_.value(ss_message::PASSWORD).assign(val, val_len);
+		break;
+	case version:
+		if(!parse_length(val, val_len, number))
+		{
+			fail_message(out);
+			return;
+		}
+		next_message_.version = number;
+		break;
+	case cell:
+		// A bad name is left for the session to turn down
+		if(!parse_cell_address(val, val_len, cell_))
+		{
+			cell_ = no_cell;
+		}
+		break;
+	case length:
+		if(!parse_length(val, val_len, blob_size_))
+		{
+			fail_message(out);
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+	// Finally, set the waiting_for_ state to look for the next required token.
+	update_waiting_for(out);
+}
+
+bool ss_parser::try_as_command(const char* line, std::size_t len)
+{
+	struct command_token
+	{
+		const char* text;
+		msg_type type;
+		ss_message::_command command;
+	};
+	static const command_token commands[] =
+	{
+		{ "CREATE", CREATE, ss_message::CREATE },
+		{ "JOIN", JOIN, ss_message::JOIN },
+		{ "UNDO", UNDO, ss_message::UNDO },
+		{ "SAVE", SAVE, ss_message::SAVE },
+		{ "CHANGE", CHANGE, ss_message::CHANGE },
+		{ "LEAVE", LEAVE, ss_message::LEAVE }
+	};
+
+	// Commands are short and all begin with an uppercase letter
+	if(len < 4 || len > 6 || line[0] < 'C' || line[0] > 'U')
+	{
+		return false;
+	}
+	for(unsigned int x = 0; x < sizeof(commands) / sizeof(commands[0]); x++)
+	{
+		if(std::strlen(commands[x].text) == len && std::memcmp(commands[x].text, line, len) == 0)
+		{
+			// All commands wait first for Name: token.  Reset the
+			//  next_message_ and set the command appropriately
+			cur_msg_type_ = commands[x].type;
+			waiting_for_ = name;
+			cells_left_ = 0;
+			ss_message new_next;
+			next_message_.swap(new_next);
+			next_message_.command = commands[x].command;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ss_parser::try_as_count(const char* line, std::size_t len, std::vector<ss_message>& out)
+{
+	static const char delim[] = "Count:";
+	static const std::size_t delim_len = sizeof(delim) - 1;
+	if(cur_msg_type_ != CHANGE || waiting_for_ != cell || cells_left_ > 0
+			|| len < delim_len || std::memcmp(line, delim, delim_len) != 0)
+	{
+		return false;
+	}
+
+	std::size_t cells;
+	if(!parse_length(line + delim_len, len - delim_len, cells) || cells == 0 || cells > max_batch_cells)
+	{
+		fail_message(out);
+		return true;
+	}
+	next_message_.cells.reserve(cells);
+	cells_left_ = cells;
+	return true;
+}
+
+const char* ss_parser::get_waiting_for_delim()
+{
+	switch(waiting_for_)
+	{
+	case name:
+		return "Name:";
+	case password:
+		return "Password:";
+	case version:
+		return "Version:";
+	case cell:
+		return "Cell:";
+	case length:
+		return "Length:";
+	default:
+		//Not really important, wont be used
+		return "";
+	}
+}
+
+void ss_parser::update_waiting_for(std::vector<ss_message>& out)
+{
+	// Only called if current token was successful.
+	switch(cur_msg_type_)
+	{
+	// CREATE and JOIN have the same format
+	case CREATE:
+	case JOIN:
+		switch(waiting_for_)
+		{
+		case name:
+			waiting_for_ = password;
+			break;
+		case password:
+			// This is the end of this message format.
+			finish_message(out);
+			break;
+		default:
+			//We should never get here, but not resetting here will never let
+			//  the state out of the broken state
+			waiting_for_ = command;
+			break;
+		}
+		break;
+	// LEAVE and SAVE have the same format
+	case SAVE:
+	case LEAVE:
+		// The only thing we need is name, which we already got - reset
+		finish_message(out);
+		break;
+	case UNDO:
+		switch(waiting_for_)
+		{
+		case name:
+			waiting_for_ = version;
+			break;
+		case version:
+			finish_message(out);
+			break;
+		default:
+			//We should never get here, but not resetting here will never let
+			//  the state out of the broken state
+			waiting_for_ = command;
+			break;
+		}
+		break;
+	case CHANGE:
+		switch(waiting_for_)
+		{
+		case name:
+			waiting_for_ = version;
+			break;
+		case version:
+			waiting_for_ = cell;
+			break;
+		case cell:
+			waiting_for_ = length;
+			break;
+		case length:
+			// The length of the contents is in blob_size_ - wait for them
+			unused_.reserve(blob_size_ < max_blob_reserve ? blob_size_ : max_blob_reserve);
+			waiting_for_ = blob;
+			break;
+		case blob:
+			// A batched CHANGE is done after its last cell
+			if(cells_left_ > 1)
+			{
+				cells_left_--;
+			}
+			else
+			{
+				finish_message(out);
+			}
+			// The blob is followed by a line terminator
+			waiting_for_ = blob_end;
+			break;
+		default:
+			//We should never get here, but not resetting here will never let
+			//  the state out of the broken state
+			waiting_for_ = command;
+			break;
+		}
+		break;
+	}
+}
+
+void ss_parser::finish_message(std::vector<ss_message>& out)
+{
+	out.push_back(ss_message());
+	out.back().swap(next_message_);
+	waiting_for_ = command;
+	cells_left_ = 0;
+}
+
+void ss_parser::fail_message(std::vector<ss_message>& out)
+{
+	next_message_.command = ss_message::ERROR;
+	finish_message(out);
+}
+
+bool ss_parser::parse_length(const char* str, std::size_t str_len, std::size_t& len)
+{
+	if(str_len == 0 || str_len > 9)
+	{
+		return false;
+	}
+	len = 0;
+	for(std::size_t x = 0; x < str_len; x++)
+	{
+		if(str[x] < '0' || str[x] > '9')
+		{
+			return false;
+		}
+		len = len * 10 + (str[x] - '0');
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,113 @@
+/*
+ * ss_parser.h
+ *
+ *  Created on: Apr 24, 2013
+ *      Author: montgomc
+ */
+
+#ifndef SS_PARSER_H_
+#define SS_PARSER_H_
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include "ss_message.h"
+
+namespace ss {
+
+// Incremental parser for messages sent by a client.  Each ss_client owns
+//  one, and feeds it whatever the socket delivers.  Complete messages come
+//  out in the order they were sent, however the stream was split across
+//  reads.
+//
+// Lines are found with a line_scanner over the receive buffer, and a line
+//  that is wholly inside the buffer is parsed in place.  Only a line (or blob)
+//  split across reads is copied in to unused_.
+//
+// Each header goes straight in to its field of the message, and each
+//  cell's contents are swapped in to the message's cells - nothing is
+//  copied once it is out of the receive buffer.
+//
+// A CHANGE may set several cells at once: in place of its Cell: line it
+//  has Count:<n>, followed by n Cell:, Length: and content groups.
+class ss_parser {
+public:
+	ss_parser();
+
+	// Parses len bytes of socket data, appending each completed message
+	//  to out.  Messages whose command is ERROR are replies to be sent
+	//  back to the client - everything else is a request for dispatch.
+	void parse(const char* data, std::size_t len, std::vector<ss_message>& out);
+
+private:
+	// Handles one line (without its line terminator)
+	void parse_line(const char* line, std::size_t len, std::vector<ss_message>& out);
+
+	// Determines whether a line is a command token.  If it is, resets the
+	//  parser to begin the new message
+	bool try_as_command(const char* line, std::size_t len);
+
+	// Determines whether a line is the Count: of a batched CHANGE.  If it
+	//  is, the cells are expected next
+	bool try_as_count(const char* line, std::size_t len, std::vector<ss_message>& out);
+
+	// Returns the Token delimiter needed for the current waiting_for_
+	//  state
+	const char* get_waiting_for_delim();
+
+	// Sets the proper waiting_for_ state to begin searching for the
+	//  next message, passing on next_message_ once it is complete
+	void update_waiting_for(std::vector<ss_message>& out);
+
+	// Passes next_message_ on to out, and starts a fresh one
+	void finish_message(std::vector<ss_message>& out);
+
+	// Abandons the current message, passing on an ERROR for it, and
+	//  waits for a new command
+	void fail_message(std::vector<ss_message>& out);
+
+	// Parses a decimal Length: (or Version: or Count:) value.  Returns
+	//  false if it is not a number
+	static bool parse_length(const char* str, std::size_t str_len, std::size_t& len);
+
+	// Contains unused information received from socket (not yet part of message)
+	std::string unused_;
+
+	// The type of message the parser is currently trying to process
+	enum msg_type {
+		JOIN,
+		CREATE,
+		CHANGE,
+		SAVE,
+		LEAVE,
+		UNDO
+	} cur_msg_type_;
+
+	// Indicates the type of token we're waiting for
+	enum waiting_for {
+		command,
+		name,
+		password,
+		version,
+		cell,
+		length,
+		blob,
+		blob_end
+	} waiting_for_;
+
+	// When waiting_for_ is blob, this tells how much to wait for
+	std::size_t blob_size_;
+
+	// The cells still to come in a batched CHANGE, counting the one
+	//  being parsed (0 for a CHANGE of one cell)
+	std::size_t cells_left_;
+
+	// The cell whose contents are being parsed
+	cell_address cell_;
+
+	// A message to build as we parse
+	ss_message next_message_;
+};
+
+}
+#endif /* SS_PARSER_H_ */
@@ -0,0 +1,152 @@
+/*
+ * ss_scheduler.cpp
+ *
+ *  Created on: Apr 29, 2013
+ *      Author: montgomc
+ */
+
+#include "ss_scheduler.h"
+#include <boost/bind.hpp>
+
+namespace ss {
+
+ss_scheduler::ss_scheduler(unsigned int workers)
+	: current_(&ss_scheduler::no_cleanup),
+	  next_(0),
+	  pending_(0),
+	  sleepers_(0),
+	  stopping_(false),
+	  running_(false)
+{
+	for(unsigned int x = 0; x < workers; x++)
+	{
+		workers_.push_back(boost::shared_ptr<worker>(new worker()));
+	}
+}
+
+ss_scheduler::~ss_scheduler()
+{
+	stop();
+}
+
+void ss_scheduler::start()
+{
+	stopping_ = false;
+	running_ = true;
+	for(unsigned int x = 0; x < workers_.size(); x++)
+	{
+		threads_.create_thread(boost::bind(&ss_scheduler::run, this, workers_[x].get()));
+	}
+}
+
+void ss_scheduler::stop()
+{
+	if(!running_)
+		return;
+	{
+		boost::mutex::scoped_lock lock(idle_mutex_);
+		stopping_ = true;
+		idle_.notify_all();
+	}
+	threads_.join_all();
+	running_ = false;
+}
+
+unsigned int ss_scheduler::size() const
+{
+	return workers_.size();
+}
+
+void ss_scheduler::schedule(task work)
+{
+	// Keep work scheduled by a worker on that worker - it is most likely
+	//  to have what the task uses in its cache
+	worker* target = current_.get();
+	if(target == NULL)
+	{
+		target = workers_[next_++ % workers_.size()].get();
+	}
+
+	// Count the task before it can be taken, so a stealer's decrement never
+	//  takes pending_ below zero.  A worker that sees the count before the
+	//  task just looks again instead of sleeping
+	pending_++;
+	{
+		boost::mutex::scoped_lock lock(target->mutex);
+		target->tasks.push_back(work);
+	}
+
+	// Wake a worker if they are all asleep.  pending_ is raised before
+	//  sleepers_ is read, and a worker raises sleepers_ before it reads
+	//  pending_, so one of the two always sees the other
+	if(sleepers_ > 0)
+	{
+		boost::mutex::scoped_lock lock(idle_mutex_);
+		idle_.notify_one();
+	}
+}
+
+void ss_scheduler::run(worker* self)
+{
+	current_.reset(self);
+	task work;
+	while(true)
+	{
+		if(take(self, work))
+		{
+			work();
+			work.clear();
+			continue;
+		}
+
+		boost::mutex::scoped_lock lock(idle_mutex_);
+		sleepers_++;
+		while(pending_ == 0 && !stopping_)
+		{
+			idle_.wait(lock);
+		}
+		sleepers_--;
+		if(pending_ == 0 && stopping_)
+			break;
+	}
+	current_.reset();
+}
+
+bool ss_scheduler::take(worker* self, task& work)
+{
+	{
+		boost::mutex::scoped_lock lock(self->mutex);
+		if(!self->tasks.empty())
+		{
+			work.swap(self->tasks.front());
+			self->tasks.pop_front();
+			pending_--;
+			return true;
+		}
+	}
+
+	// Nothing of our own - steal, starting with the next worker along
+	std::size_t count = workers_.size();
+	std::size_t start = 0;
+	while(workers_[start].get() != self)
+		start++;
+	for(std::size_t x = 1; x < count; x++)
+	{
+		worker* victim = workers_[(start + x) % count].get();
+		boost::mutex::scoped_lock lock(victim->mutex);
+		if(!victim->tasks.empty())
+		{
+			work.swap(victim->tasks.back());
+			victim->tasks.pop_back();
+			pending_--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ss_scheduler::no_cleanup(worker*)
+{
+}
+
+}
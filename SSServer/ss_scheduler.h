@@ -0,0 +1,102 @@
+/*
+ * ss_scheduler.h
+ *
+ *  Created on: Apr 29, 2013
+ *      Author: montgomc
+ */
+
+#ifndef SS_SCHEDULER_H_
+#define SS_SCHEDULER_H_
+
+#include <deque>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace ss {
+
+// Runs tasks on a pool of worker threads.  Each worker has its own queue;
+//  a task scheduled from a worker goes on that worker's queue, and one
+//  scheduled from any other thread is dealt out to the queues in turn.  A
+//  worker runs its own queue oldest first, and once it is empty, steals
+//  the newest task from another worker's queue.  Workers with nothing to
+//  do sleep until a task is scheduled.
+//
+// Sessions use this to run the work in their mailboxes, so a busy session
+//  only ever takes up one worker, and an idle one takes up none.
+class ss_scheduler : private boost::noncopyable {
+public:
+	typedef boost::function<void()> task;
+
+	// Creates a scheduler with the given number of workers
+	ss_scheduler(unsigned int workers);
+
+	// Stops the workers, if they are still running
+	~ss_scheduler();
+
+	// Starts the workers
+	void start();
+
+	// Runs everything already scheduled, then stops the workers and waits
+	//  for them to finish
+	void stop();
+
+	// Queues a task to run on a worker - may be called from any thread
+	void schedule(task work);
+
+	// Returns the number of workers
+	unsigned int size() const;
+
+private:
+	struct worker
+	{
+		boost::mutex mutex;
+		std::deque<task> tasks;
+	};
+
+	// The loop each worker thread runs
+	void run(worker* self);
+
+	// Takes the next task for a worker - its own oldest, or another
+	//  worker's newest.  Returns false if every queue is empty
+	bool take(worker* self, task& work);
+
+	// thread_specific_ptr deletes what it holds - the workers belong to
+	//  workers_, so it must not
+	static void no_cleanup(worker*);
+
+	// The workers' queues
+	std::vector<boost::shared_ptr<worker> > workers_;
+
+	// The worker the current thread is, if it is one
+	boost::thread_specific_ptr<worker> current_;
+
+	// The worker threads
+	boost::thread_group threads_;
+
+	// The next queue a task from outside the pool goes on
+	boost::atomic<unsigned int> next_;
+
+	// The number of tasks waiting in the queues - raised before a task is
+	//  queued, so it is never less than the number actually there
+	boost::atomic<unsigned int> pending_;
+
+	// The number of workers asleep
+	boost::atomic<unsigned int> sleepers_;
+
+	// Sleeping workers wait on idle_
+	boost::mutex idle_mutex_;
+	boost::condition_variable idle_;
+
+	// Whether the workers should stop once the queues are empty
+	bool stopping_;
+
+	// Whether the workers have been started, and not yet stopped
+	bool running_;
+};
+
+}
+#endif /* SS_SCHEDULER_H_ */
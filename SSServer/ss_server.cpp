@@ -6,16 +6,22 @@
  */
 
 #include "ss_server.h"
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <signal.h>
 
 
 namespace ss {
 
 //Constructor - requires a port and a virtual directory root
-ss_server::ss_server(int port, std::string& root_dir, std::string& index_file)
-	: io_service_(),
+ss_server::ss_server(int port, std::string& root_dir, std::string& index_file, const ss_config& config)
+	: config_(config),
+	  io_service_(),
+	  scheduler_(config.workers),
+	  requests_(0),
 	  acceptor_(io_service_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
-	  ss_manager_(root_dir, index_file)
+	  cache_(config.cache_bytes),
+	  ss_manager_(root_dir, index_file, save_service_, config)
 {
 
 	start_accept_client();
@@ -24,152 +30,373 @@ ss_server::ss_server(int port, std::string& root_dir, std::string& index_file)
 void ss_server::stop()
 {
 	std::cout << "Terminate Received.  Closing the server...\n";
-	std::cout << "Closing all spreadsheet sessions...\n";
-	std::map<std::string,ss_session*>::iterator sessIt;
-	for(sessIt = sessions_.begin(); sessIt != sessions_.end(); sessIt++)
-	{
-		(*sessIt).second->close();
-	}
+	// Do the closing on an io thread, so the acceptor and client sockets
+	//  are not touched while a handler is using them
+	io_service_.post(boost::bind(&ss_server::handle_stop, this));
+}
+
+void ss_server::handle_stop()
+{
+	acceptor_.close();
 	std::cout << "Closing all client connections...\n";
+	boost::mutex::scoped_lock lock(clients_mutex_);
 	std::set<ss_client_ptr>::iterator cliIt;
 	for(cliIt = clients_.begin(); cliIt != clients_.end(); cliIt++)
 	{
 		(*cliIt)->stop();
 	}
 	std::cout << "All client connections closed.\n";
-	std::cout << "Shutting down the server...\n";
-
-	io_service_.stop();
 }
 
 //Starts the server
 void ss_server::run()
 {
-	io_service_.run();
+	// Saves are written on their own thread, so a big one does not hold
+	//  up the io threads
+	boost::scoped_ptr<boost::asio::io_service::work> save_work(new boost::asio::io_service::work(save_service_));
+	boost::thread save_thread(boost::bind(&boost::asio::io_service::run, &save_service_));
+
+	// Spreadsheets are loaded for JOINs on threads of their own, so a load
+	//  never waits for a save, and several can run at once
+	boost::scoped_ptr<boost::asio::io_service::work> load_work(new boost::asio::io_service::work(load_service_));
+	boost::thread_group loaders;
+	for(unsigned int x = 0; x < config_.loaders; x++)
+	{
+		loaders.create_thread(boost::bind(&boost::asio::io_service::run, &load_service_));
+	}
+
+	// Sessions do their work on the scheduler's workers
+	scheduler_.start();
+
+	// Every thread in the pool runs the same io_service.  They read and
+	//  write the sockets, and hand requests to the sessions.
+	for(unsigned int x = 0; x < config_.io_threads; x++)
+	{
+		workers_.create_thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+	}
+	workers_.join_all();
+
+	// Let any loads finish, and any saves still being written, then let
+	//  the sessions finish with them
+	load_work.reset();
+	loaders.join_all();
+	save_work.reset();
+	save_thread.join();
+	scheduler_.stop();
+
+	// Once everything has run dry, nothing else touches the sessions
+	std::cout << "Closing all spreadsheet sessions...\n";
+	std::map<std::string,ss_session_ptr>::iterator sessIt;
+	for(sessIt = sessions_.begin(); sessIt != sessions_.end(); sessIt++)
+	{
+		(*sessIt).second->close();
+	}
+	sessions_.clear();
+	cache_.close_all();
+
+	unsigned long lookups = cache_.hits() + cache_.misses();
+	std::cout << "Spreadsheet cache: " << cache_.hits() << " hit(s), " << cache_.misses() << " miss(es)";
+	if(lookups > 0)
+		std::cout << " (" << cache_.hits() * 100 / lookups << "% hit rate)";
+	std::cout << ", " << cache_.evictions() << " eviction(s)\n";
+	std::cout << "Slow clients: " << client_stats_.dropped << " UPDATE(s) dropped, " << client_stats_.resyncs
+			<< " resync(s), " << client_stats_.disconnects << " disconnect(s)\n";
+	if(config_.update_interval_ms > 0)
+	{
+		std::cout << "Merged UPDATEs: " << update_stats_.sent << " sent, " << update_stats_.saved
+				<< " saved, " << update_stats_.superseded << " superseded cell write(s)\n";
+	}
+	if(counting_allocations())
+	{
+		std::cout << "Allocations: " << allocation_count() << " for " << requests_ << " request(s)";
+		if(requests_ > 0)
+			std::cout << " (" << allocation_count() / requests_ << " per request)";
+		std::cout << "\n";
+	}
+	std::cout << "Shutting down the server...\n";
+}
+
+ss_message_ptr ss_server::take(ss_message& request)
+{
+	ss_message_ptr taken = boost::make_shared<ss_message>();
+	taken->swap(request);
+	return taken;
+}
+
+ss_session_ptr ss_server::find_session(const std::string& name)
+{
+	boost::mutex::scoped_lock lock(sessions_mutex_);
+	std::map<std::string,ss_session_ptr>::iterator it = sessions_.find(name);
+	if(it == sessions_.end())
+	{
+		return ss_session_ptr();
+	}
+	return it->second;
 }
 
 //Dispatches a message sent by a client (client is responsible for ensuring proper message formatting)
-void ss_server::dispatch_request(ss_client_ptr requester, ss_message request)
+bool ss_server::dispatch_request(ss_client_ptr requester, ss_message& request)
 {
 	std::string reqName;
+	ss_session_ptr session;
+	requests_++;
 	switch(request.command)
 	{
 	case ss_message::CREATE:
 		ss_manager_.handle_create_request(requester, request);
 		break;
 	case ss_message::JOIN:
+	{
 		// Grab the name of spreadsheet requested to join
-		reqName = request.get_val("Name");
+		reqName = request.get(ss_message::NAME);
 
-		// See if there is not already a session
-		if(!sessions_.count(reqName))
+		// Finding the session and adding the client happen under the lock,
+		//  so a LEAVE can't remove the session in between
+		std::vector<ss_session_ptr> evicted;
+		bool added;
 		{
-			// See if we can get the spreadsheet (see if it exists)
-			spreadsheet* curSS = ss_manager_.get_spreadsheet(reqName);
-			// If curSS is a null pointer, it means the spreadsheet was not found
-			// In this case, TODO
-			if(curSS == NULL)
+			boost::mutex::scoped_lock lock(sessions_mutex_);
+			session = open_session(reqName);
+			if(!session)
 			{
-				// Set up a response to go to the requester
-				ss_message response;
-				response.set("Name", reqName);
-				response.command = ss_message::JOIN_FAIL;
-				response.set("message", "The requested spreadsheet does not exist");
-				requester->tell(response);
-				return;
+				// Loading the spreadsheet reads (and rewrites) its files, so it
+				//  is done on a loader thread, not here holding up this io
+				//  thread and every other JOIN.  A JOIN that comes in while it
+				//  loads waits for the same load
+				pending_join waiting;
+				waiting.client = requester;
+				waiting.password = request.get(ss_message::PASSWORD);
+				std::vector<pending_join>& joins = loading_[reqName];
+				joins.push_back(waiting);
+				if(joins.size() == 1)
+					load_service_.post(boost::bind(&ss_server::load_session, this, reqName));
+				return false;
 			}
-			// Load the spreadsheet, and pass it in to a new ss_session
-			curSS->load();
-			// Add a new session for the spreadsheet to our map of sessions.
-			sessions_[reqName] = new ss_session(reqName, curSS);
-
-		}
-		//We've either found or created a session...  lets try to add the requester
-		if(sessions_[reqName]->add_client(requester, request.get_val("Password")))
-		{
-			// Get join ok message from session (session will fill message with appropraite values)
-			ss_message* join_ok_msg = sessions_[reqName]->get_join_ok_msg();
-			requester->tell(*join_ok_msg);
-		}
-		else
-		{
-			// The password did not match
-			ss_message response;
-			response.command = ss_message::JOIN_FAIL;
-			response.set("Name", reqName);
-			response.set("message", "The provided password did not match the requested password");
-			requester->tell(response);
+			added = join_session(session, requester, request.get(ss_message::PASSWORD));
+			close_if_empty(session, evicted);
 		}
+		if(added)
+			requester->joined(reqName, session);
 		break;
+	}
 	case ss_message::CHANGE:
-		reqName = request.get_val("Name");
+		reqName = request.get(ss_message::NAME);
+		session = requester->joined_session(reqName);
+		if(!session)
+			session = find_session(reqName);
 
 		// Check that the session exists - if not, send an appropriate response
-		if(!sessions_.count(reqName))
+		if(!session)
 		{
 			ss_message response;
 			response.command = ss_message::CHANGE_FAIL;
-			response.set("Name", reqName);
+			response.set(ss_message::NAME, reqName);
 			//response.set("Version", "");  //Removed to conform to updated spec
-			response.set("message", "There is no session for the requested spreadsheet");
+			response.set(ss_message::MESSAGE, "There is no session for the requested spreadsheet");
 			requester->tell(response);
-			return;
+			return true;
 		}
 		// The session is valid - pass the request on to the session
-		sessions_[reqName]->handle_change_request(requester, request);
+		session->post(boost::bind(&ss_session::handle_change_request, session, requester, take(request)));
 		break;
 	case ss_message::UNDO:
-		reqName = request.get_val("Name");
+		reqName = request.get(ss_message::NAME);
+		session = requester->joined_session(reqName);
+		if(!session)
+			session = find_session(reqName);
 
 		// Check that the session exists - if not, send an appropriate response
-		if(!sessions_.count(reqName))
+		if(!session)
 		{
 			ss_message response;
 			response.command = ss_message::UNDO_FAIL;
-			response.set("Name", reqName);
+			response.set(ss_message::NAME, reqName);
 			//response.set("Version", "");  //Removed to conform to updated spec
-			response.set("message", "There is no session for the requested spreadsheet");
+			response.set(ss_message::MESSAGE, "There is no session for the requested spreadsheet");
 			requester->tell(response);
-			return;
+			return true;
 		}
 		// The session is valid - pass the request on to the session
-		sessions_[reqName]->handle_undo_request(requester, request);
+		session->post(boost::bind(&ss_session::handle_undo_request, session, requester, take(request)));
 		break;
 	case ss_message::SAVE:
-		reqName = request.get_val("Name");
+		reqName = request.get(ss_message::NAME);
+		session = requester->joined_session(reqName);
+		if(!session)
+			session = find_session(reqName);
 
 		// Check that the session exists - if not, send an appropriate response
-		if(!sessions_.count(reqName))
+		if(!session)
 		{
 			ss_message response;
 			response.command = ss_message::SAVE_FAIL;
-			response.set("Name", reqName);
-			response.set("message", "There is no session for the requested spreadsheet");
+			response.set(ss_message::NAME, reqName);
+			response.set(ss_message::MESSAGE, "There is no session for the requested spreadsheet");
 			requester->tell(response);
-			return;
+			return true;
 		}
 		// The session is valid - pass the request on to the session
-		sessions_[reqName]->handle_save_request(requester, request);
+		session->post(boost::bind(&ss_session::handle_save_request, session, requester, take(request)));
 		break;
 	case ss_message::LEAVE:
-		reqName = request.get_val("Name");
+		reqName = request.get(ss_message::NAME);
+		session = requester->joined_session(reqName);
 
-		// Check that the session exists - if not, send an appropriate response
-		if(sessions_.count(reqName))
+		// Check that the client joined the session - if not, there is
+		//  nothing to do.  Leaving goes through the session's mailbox so it
+		//  is ordered after anything the client sent the session before it.
+		if(session)
 		{
-			sessions_[reqName]->drop_client(requester);
-			if(sessions_[reqName]->empty())
-			{
-				// If no clients left, remove it from
-				//  sessions, and delete it
-				sessions_.erase(reqName);
-			}
+			requester->left(reqName);
+			session->post(boost::bind(&ss_server::leave_session, this, session, requester));
 		}
-		// Else, nothing to do...
 		break;
 	default:
 		break;
 	}
+	return true;
+}
+
+ss_session_ptr ss_server::open_session(const std::string& name)
+{
+	std::map<std::string,ss_session_ptr>::iterator it = sessions_.find(name);
+	if(it != sessions_.end())
+	{
+		return it->second;
+	}
+	// A recently closed session may still be loaded
+	ss_session_ptr session = cache_.take(name);
+	if(session)
+	{
+		sessions_[name] = session;
+	}
+	return session;
+}
+
+bool ss_server::join_session(ss_session_ptr session, ss_client_ptr requester, const std::string& password)
+{
+	if(session->add_client(requester, password))
+	{
+		// The session fills in the JOIN OK itself, ahead of anything
+		//  else the client sends it
+		session->post(boost::bind(&ss_session::send_join_ok, session, requester));
+		return true;
+	}
+
+	// The password did not match
+	ss_message response;
+	response.command = ss_message::JOIN_FAIL;
+	response.set(ss_message::NAME, session->name());
+	response.set(ss_message::MESSAGE, "The provided password did not match the requested password");
+	requester->tell(response);
+	return false;
+}
+
+void ss_server::close_if_empty(ss_session_ptr session, std::vector<ss_session_ptr>& evicted)
+{
+	// Don't leave a session no one joined open
+	if(session->empty())
+	{
+		sessions_.erase(session->name());
+		cache_.put(session, evicted);
+	}
+}
+
+void ss_server::load_session(const std::string& name)
+{
+	// See if we can get the spreadsheet (see if it exists), and load it
+	//  in to a new session
+	ss_session_ptr session;
+	const char* failure = NULL;
+	spreadsheet* curSS = ss_manager_.get_spreadsheet(name);
+	if(curSS == NULL)
+	{
+		failure = "The requested spreadsheet does not exist";
+	}
+	else
+	{
+		try
+		{
+			curSS->load();
+			session.reset(new ss_session(name, curSS, scheduler_,
+					io_service_, save_service_, config_, update_stats_,
+					boost::bind(&ss_server::trim_cache, this)));
+		}
+		catch(...)
+		{
+			delete curSS;
+			failure = "The requested spreadsheet could not be loaded";
+		}
+	}
+
+	// Every JOIN for the spreadsheet since this load started waited for
+	//  it, so nothing else can have opened it in the meantime
+	std::vector<pending_join> joins;
+	std::vector<bool> added;
+	std::vector<ss_session_ptr> evicted;
+	{
+		boost::mutex::scoped_lock lock(sessions_mutex_);
+		loading_[name].swap(joins);
+		loading_.erase(name);
+		if(session)
+		{
+			sessions_[name] = session;
+		}
+		for(unsigned int x = 0; x < joins.size(); x++)
+		{
+			added.push_back(session && join_session(session, joins[x].client, joins[x].password));
+		}
+		if(session)
+		{
+			close_if_empty(session, evicted);
+		}
+	}
+
+	// Let the clients go on with the requests they sent after the JOIN
+	for(unsigned int x = 0; x < joins.size(); x++)
+	{
+		if(failure)
+		{
+			ss_message response;
+			response.set(ss_message::NAME, name);
+			response.command = ss_message::JOIN_FAIL;
+			response.set(ss_message::MESSAGE, failure);
+			joins[x].client->tell(response);
+		}
+		if(added[x])
+			joins[x].client->resume(boost::bind(&ss_client::joined, joins[x].client, name, session));
+		else
+			joins[x].client->resume(boost::function<void()>());
+	}
+}
+
+void ss_server::trim_cache()
+{
+	// Freed once the lock is let go
+	std::vector<ss_session_ptr> evicted;
+	boost::mutex::scoped_lock lock(sessions_mutex_);
+	cache_.trim(evicted);
+}
+
+void ss_server::leave_session(ss_session_ptr session, ss_client_ptr requester)
+{
+	session->drop_client(requester);
+
+	// Sessions pushed out of the cache are freed once the lock is let go,
+	//  as this goes out of scope
+	std::vector<ss_session_ptr> evicted;
+	boost::mutex::scoped_lock lock(sessions_mutex_);
+	// A JOIN may have slipped in since the drop - only remove the session
+	//  if it is still empty
+	std::map<std::string,ss_session_ptr>::iterator it = sessions_.find(session->name());
+	if(it != sessions_.end() && it->second == session && session->empty())
+	{
+		// If no clients left, save it, and move it from sessions to the
+		//  cache (which frees it once it is pushed out)
+		sessions_.erase(it);
+		session->flush();
+		cache_.put(session, evicted);
+	}
 }
 
 //Listens for incoming connections
@@ -177,7 +404,7 @@ void ss_server::start_accept_client()
 {
 	//Set up a new ss_client object, to attach the next
 	//  incoming connection to.
-	next_client_.reset(new ss_client(io_service_, *this));
+	next_client_.reset(new ss_client(io_service_, *this, config_, client_stats_));
 
 	//Tell this->acceptor_ to start accepting asynchronously, and tell
 	//  it to put the new socket in the tcp_connection we just created
@@ -196,16 +423,37 @@ void ss_server::start_accept_client()
 //  is created.
 void ss_server::handle_accept_client(const boost::system::error_code& error)
 {
+	// The acceptor was closed - the server is stopping
+	if(error)
+		return;
+	// Replies are small, and the client's queue already gathers them in
+	//  to one write - don't let Nagle hold them back waiting for an ACK
+	boost::system::error_code ignored;
+	next_client_->socket().set_option(boost::asio::ip::tcp::no_delay(true), ignored);
 	// Start the client
 	next_client_->start();
 	// And add the client to the list of clients
-	clients_.insert(next_client_);
+	{
+		boost::mutex::scoped_lock lock(clients_mutex_);
+		clients_.insert(next_client_);
+	}
 	// Finally, listen for another connection
 	start_accept_client();
 }
 
 void ss_server::remove_client(ss_client_ptr to_drop)
 {
-	clients_.erase(to_drop);
+	{
+		boost::mutex::scoped_lock lock(clients_mutex_);
+		clients_.erase(to_drop);
+	}
+
+	// A client that disconnects without a LEAVE leaves its sessions now
+	std::vector<ss_session_ptr> joined;
+	to_drop->take_sessions(joined);
+	for(unsigned int x = 0; x < joined.size(); x++)
+	{
+		joined[x]->post(boost::bind(&ss_server::leave_session, this, joined[x], to_drop));
+	}
 }
 }
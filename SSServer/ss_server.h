@@ -11,12 +11,19 @@
 #include "ss_client.h"
 #include "ss_message.h"
 #include "ss_session.h"
+#include "session_cache.h"
+#include "ss_scheduler.h"
 #include "spreadsheet_manager.h"
+#include "ss_config.h"
+#include "alloc_counter.h"
 #include <string>
 #include <set>
 #include <map>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 #include <signal.h>
 
 
@@ -31,15 +38,21 @@ namespace ss {
 class ss_server
 {
 public:
-	// Constructor - requires an io_service, a port, and a directory path
-	ss_server(int port, std::string& root_dir, std::string& index_file);
+	// Constructor - requires a port, a directory path, an index file and the
+	//  server tunables
+	ss_server(int port, std::string& root_dir, std::string& index_file, const ss_config& config);
 	// Stops the server - shuts down gracefully
 	void stop();
-	// Start the server service
+	// Start the server service - runs the io_service on config.io_threads
+	//  threads, and returns once they have all finished
 	void run();
-	// Processes a message sent from an ss_client
-	void dispatch_request(ss_client_ptr requester, ss_message message);
-	// Stop tracking a client
+	// Processes a message sent from an ss_client.  A request for a session
+	//  is taken out of message, and handed on without copying.  Returns
+	//  false if the request is still being worked on - the client holds
+	//  back its later requests until the server calls its resume()
+	bool dispatch_request(ss_client_ptr requester, ss_message& message);
+	// Stop tracking a client, and take it out of its sessions - runs on
+	//  the client's strand
 	void remove_client(ss_client_ptr to_drop);
 
 private:
@@ -50,16 +63,75 @@ private:
 	void handle_accept_client(const boost::system::error_code& error);
 	//  Called from process_request - creates a new spreadsheet
 
+	// Runs on an io thread - closes the acceptor and all clients so the
+	//  io_service runs out of work
+	void handle_stop();
+	// Runs in the session - drops the client, and once the session is
+	//  empty, saves it and moves it to the cache
+	void leave_session(ss_session_ptr session, ss_client_ptr requester);
+	// Returns the named session, or null if there is none
+	ss_session_ptr find_session(const std::string& name);
+	// Returns the named session, opening it again if it is in the cache,
+	//  or null if it is not loaded - call with sessions_mutex_ held
+	ss_session_ptr open_session(const std::string& name);
+	// Adds requester to session, or sends it a JOIN FAIL.  Returns
+	//  whether it joined - call with sessions_mutex_ held
+	bool join_session(ss_session_ptr session, ss_client_ptr requester, const std::string& password);
+	// Moves a session no one joined out of sessions_ and in to the cache -
+	//  call with sessions_mutex_ held, and free evicted after letting go
+	void close_if_empty(ss_session_ptr session, std::vector<ss_session_ptr>& evicted);
+	// Runs on a loader thread - loads the named spreadsheet, and joins
+	//  the clients waiting for it
+	void load_session(const std::string& name);
+	// Runs in a session whose save has finished - frees cached sessions
+	//  that were kept over the budget while they saved
+	void trim_cache();
+	// Moves a request in to one of its own, to be posted to a session
+	static ss_message_ptr take(ss_message& request);
+
+	// The server tunables
+	ss_config config_;
+
 	// The boost io_service object - sits between OS sockets and asio sockets
 	boost::asio::io_service io_service_;
+	// The threads running io_service_
+	boost::thread_group workers_;
+	// Runs spreadsheet saves on a thread of its own
+	boost::asio::io_service save_service_;
+	// Loads spreadsheets for JOINs on config.loaders threads
+	boost::asio::io_service load_service_;
+	// Runs the sessions' work
+	ss_scheduler scheduler_;
+	// How the sessions' UPDATEs were merged
+	update_stats update_stats_;
+	// How slow clients were dealt with
+	client_stats client_stats_;
+	// The requests clients have sent, to weigh the allocation count by
+	boost::atomic<unsigned long> requests_;
 	// The boost object that listens for socket connections
 	boost::asio::ip::tcp::acceptor acceptor_;
 	// The next connection to be accepted
 	ss_client_ptr next_client_;
 	// A list of all connections
 	std::set<ss_client_ptr> clients_;
+	// Guards clients_
+	boost::mutex clients_mutex_;
 	// A map of sessions (name,session)
-	std::map<std::string,ss_session*> sessions_;
+	std::map<std::string,ss_session_ptr> sessions_;
+	// Sessions no client is using, kept loaded in case they are opened again
+	session_cache cache_;
+	// A client waiting for a spreadsheet to load, and the password it gave
+	struct pending_join
+	{
+		ss_client_ptr client;
+		std::string password;
+	};
+	// The spreadsheets being loaded, and the clients waiting for each -
+	//  a spreadsheet is only loaded by one JOIN at a time
+	std::map<std::string, std::vector<pending_join> > loading_;
+	// Guards sessions_, cache_ and loading_ - lock before a session's
+	//  client mutex
+	boost::mutex sessions_mutex_;
 	// The spreadsheet manager
 	spreadsheet_manager ss_manager_;
 
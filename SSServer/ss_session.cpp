@@ -9,150 +9,351 @@
 
 namespace ss {
 
+// The most tasks a session runs before it lets other sessions on to its
+//  worker
+static const int mailbox_batch = 64;
 
-ss_session::ss_session(std::string ss_name, spreadsheet* ss)
-	: ss_name_(ss_name),
+// How many recently set cells a session remembers, to accept CHANGEs made
+//  against an older version
+static const std::size_t version_log_entries = 1 << 12;
+
+
+ss_session::ss_session(std::string ss_name, spreadsheet* ss, ss_scheduler& scheduler,
+		boost::asio::io_service& io_service, boost::asio::io_service& save_service,
+		const ss_config& config, update_stats& stats, boost::function<void()> saved)
+	: scheduled_(false),
+	  scheduler_(scheduler),
+	  ss_name_(ss_name),
 	  ssheet_(ss),
 	  version_(0),
-	  password_(ssheet_->get_password())
+	  password_(ssheet_->get_password()),
+	  join_cache_version_(-1),
+	  undo_(config.undo_bytes),
+	  keep_undo_on_save_(config.keep_undo_on_save),
+	  versions_(version_log_entries),
+	  update_interval_(config.update_interval_ms),
+	  update_timer_(io_service),
+	  update_timer_running_(false),
+	  pending_messages_(0),
+	  stats_(stats),
+	  save_service_(save_service),
+	  saving_(false),
+	  saved_(saved)
+{
+
+}
+
+ss_session::~ss_session()
+{
+	delete ssheet_;
+}
+
+void ss_session::post(boost::function<void()> task)
+{
+	mailbox_.push(task);
+	// Schedule the session, unless it is already
+	if(!scheduled_.exchange(true))
+	{
+		scheduler_.schedule(boost::bind(&ss_session::drain, shared_from_this()));
+	}
+}
+
+void ss_session::drain()
 {
+	boost::function<void()> task;
+	for(int x = 0; x < mailbox_batch; x++)
+	{
+		if(!mailbox_.pop(task))
+		{
+			// Out of work.  A post that came in after the pop (or is still
+			//  linking its task in) sees scheduled_ clear and schedules us
+			//  again - unless we get there first
+			scheduled_ = false;
+			if(!mailbox_.empty() && !scheduled_.exchange(true))
+			{
+				scheduler_.schedule(boost::bind(&ss_session::drain, shared_from_this()));
+			}
+			return;
+		}
+		task();
+	}
 
+	// Still busy - go to the back of the queue, so other sessions get a turn
+	scheduler_.schedule(boost::bind(&ss_session::drain, shared_from_this()));
+}
+
+const std::string& ss_session::name()
+{
+	return ss_name_;
 }
 
-void ss_session::handle_change_request(ss_client_ptr requester, ss_message change_request)
+void ss_session::handle_change_request(ss_client_ptr requester, ss_message_ptr change_request)
 {
 	// The response that will be sent
 	ss_message response;
-	response.set("Name", change_request.get_val("Name"));
+	response.set(ss_message::NAME, change_request->get(ss_message::NAME));
 	//Make sure the client is in the session
-	if(clients_.find(requester) == clients_.end())
+	if(!has_client(requester))
 	{
 		response.command = ss_message::CHANGE_FAIL;
 		//Removed to conform to updated spec
 		//response.set("Version", boost::lexical_cast<std::string>(version_));
-		response.set("message", "Client not member of spreadsheet session");
+		response.set(ss_message::MESSAGE, "Client not member of spreadsheet session");
 		requester->tell(response);
 		return;
 	}
 
-	// See if the version is correct
-	if(boost::lexical_cast<int>(change_request.get_val("Version")) != version_ )
+	// Parse the cell names once - the session works with the addresses.
+	//  A batched CHANGE (with a Count:) sets all its cells under one version
+	cell_list cells;
+	if(!take_cells(*change_request, cells))
+	{
+		response.command = ss_message::CHANGE_FAIL;
+		response.set(ss_message::MESSAGE, "Invalid cell name");
+		requester->tell(response);
+		return;
+	}
+
+	// See if the version is correct.  A CHANGE made against an older
+	//  version is fine too, as long as none of its cells have been set
+	//  since - it is applied on top of the changes made in between
+	int request_version = change_request->version;
+	if(request_version > version_ ||
+			(request_version < version_ && !versions_.unchanged_since(cells, request_version)))
 	{
 		response.command = ss_message::CHANGE_WAIT;
-		response.set("Version", boost::lexical_cast<std::string>(version_));
+		response.version = version_;
 		//Removed to conform to updated spec
 		//response.set("message", "Client spreadsheet version out of date");
 		requester->tell(response);
 		return;
 	}
 
-	// Push an undo struct on to the undo stack
-	change chng;
-	chng.cell = change_request.get_val("Cell");
-	chng.old_contents = ssheet_->get_cell_contents(chng.cell);
-	undo_stack_.push(chng);
+	// The server will not take a formula it could not work out
+	if(ssheet_->too_complex(cells))
+	{
+		response.command = ss_message::CHANGE_FAIL;
+		response.set(ss_message::MESSAGE, "Formula too long or too deeply nested");
+		requester->tell(response);
+		return;
+	}
+
+	// A formula may not depend on itself
+	if(ssheet_->creates_cycle(cells))
+	{
+		response.command = ss_message::CHANGE_FAIL;
+		response.set(ss_message::MESSAGE, "Circular dependency");
+		requester->tell(response);
+		return;
+	}
 
-	// The change is good - apply
-	ssheet_->set_cell_contents(change_request.get_val("Cell"), change_request.get_val("content"));
+	// The change is good - apply, recording what each cell held for undo
+	undo_.begin_change();
+	for(cell_list::iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		undo_.add(it->first, ssheet_->get_cell_contents(it->first));
+		ssheet_->set_cell_contents(it->first, it->second);
+	}
 	version_++;
+	record_versions(cells);
+	join_cache_.reset();
+	// The session waits for this - see dependency_graph.h
+	cell_list values;
+	ssheet_->recalculate(cells, values, &scheduler_);
 	response.command = ss_message::CHANGE_OK;
-	response.set("Version", boost::lexical_cast<std::string>(version_));
+	response.version = version_;
+	response.values = values;
 
 
 
 	// Tell the requester and inform the others
 	requester->tell(response);
-	send_updates(version_, change_request.get_val("Cell"), change_request.get_val("content"), requester);
+	send_updates(version_, cells, values, requester);
+
+	// Fold a large journal back in to the spreadsheet file
+	if(ssheet_->needs_compaction())
+	{
+		start_save();
+	}
 }
 
 void ss_session::close()
 {
+	// Nothing to write if every change is already saved
+	if(!ssheet_->modified())
+		return;
 
 	std::cout << "Saving spreadsheet " << ss_name_ << " from open session...\n";
 	ssheet_->save();
-	delete ssheet_;
 	std::cout << ss_name_ << " saved successfully.\n";
 }
 
-void ss_session::handle_undo_request(ss_client_ptr requester, ss_message undo_request)
+void ss_session::flush()
+{
+	if(ssheet_->modified())
+	{
+		start_save();
+	}
+}
+
+bool ss_session::is_saving()
+{
+	return saving_;
+}
+
+std::size_t ss_session::memory_size()
+{
+	return ssheet_->memory_size() + undo_.memory_size();
+}
+
+void ss_session::handle_undo_request(ss_client_ptr requester, ss_message_ptr undo_request)
 {
 	// The response that will be sent
 	ss_message response;
-	response.set("Name", undo_request.get_val("Name"));
+	response.set(ss_message::NAME, undo_request->get(ss_message::NAME));
 	// Make sure the client is part of the session
-	if(clients_.find(requester) == clients_.end())
+	if(!has_client(requester))
 	{
 		response.command = ss_message::UNDO_FAIL;
 		//Removed to conform to updated spec
 		//response.set("Version", boost::lexical_cast<std::string>(version_));
-		response.set("message", "Client not member of spreadsheet session");
+		response.set(ss_message::MESSAGE, "Client not member of spreadsheet session");
 		requester->tell(response);
 		return;
 	}
 
 	// See if the version is correct
-	if(boost::lexical_cast<int>(undo_request.get_val("Version")) != version_ )
+	if(undo_request->version != version_ )
 	{
 		response.command = ss_message::UNDO_WAIT;
-		response.set("Version", boost::lexical_cast<std::string>(version_));
+		response.version = version_;
 		//Removed to conform to updated spec
 		//response.set("message", "Client spreadsheet version out of date");
 		requester->tell(response);
 		return;
 	}
 
-	// See if there are any unsaved changes to undo
-	if(undo_stack_.empty())
+	// See if there are any changes to undo
+	if(undo_.empty())
 	{
 		response.command = ss_message::UNDO_END;
-		response.set("Version", boost::lexical_cast<std::string>(version_));
+		response.version = version_;
 		requester->tell(response);
 		return;
 	}
 
 	// If here, we're good to go.  Let's undo.
-	change undoing = undo_stack_.top();
-	undo_stack_.pop();
-	std::string cell = undoing.cell;
-	std::string contents = undoing.old_contents;
-	ssheet_->set_cell_contents(cell,contents);
+	cell_list cells;
+	undo_.pop(cells);
+	for(cell_list::iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		ssheet_->set_cell_contents(it->first, it->second);
+	}
 	version_++;
+	record_versions(cells);
+	join_cache_.reset();
+	// The session waits for this - see dependency_graph.h
+	cell_list values;
+	ssheet_->recalculate(cells, values, &scheduler_);
 	//Prepare the response for the requester
 	response.command = ss_message::UNDO_OK;
-	response.set("Version", boost::lexical_cast<std::string>(version_));
-	response.set("Cell", cell);
-	response.set("Length", boost::lexical_cast<std::string>(contents.length()));
-	response.set("contents", contents);
+	response.version = version_;
+	response.cells = cells;
+	response.values = values;
 	//Send the response to the requester, and then tell the others
 	requester->tell(response);
-	send_updates(version_, cell, contents, requester);
+	send_updates(version_, cells, values, requester);
+
+	if(ssheet_->needs_compaction())
+	{
+		start_save();
+	}
 
 }
 
-void ss_session::handle_save_request(ss_client_ptr requester, ss_message save_request)
+void ss_session::handle_save_request(ss_client_ptr requester, ss_message_ptr save_request)
 {
 	// The response that will be sent
 	ss_message response;
-	response.set("Name", save_request.get_val("Name"));
+	response.set(ss_message::NAME, save_request->get(ss_message::NAME));
 	// Make sure the client is part of the session
-	if(clients_.find(requester) == clients_.end())
+	if(!has_client(requester))
 	{
 		response.command = ss_message::SAVE_FAIL;
-		response.set("message", "Client not member of spreadsheet session");
+		response.set(ss_message::MESSAGE, "Client not member of spreadsheet session");
 		requester->tell(response);
 		return;
 	}
 
-	// Save the spreadsheet
-	ssheet_->save();
+	// Save the spreadsheet - the response is sent once it is written
+	save_requesters_.push_back(requester);
+	start_save();
 
-	// Empty the undo stack
-	std::stack<change> empty;
-	undo_stack_ = empty;
+	// Start a new undo history, unless it is kept across saves
+	if(!keep_undo_on_save_)
+	{
+		undo_.clear();
+	}
+}
 
-	// And send the response
-	response.command = ss_message::SAVE_OK;
-	requester->tell(response);
+void ss_session::start_save()
+{
+	// finish_save starts another save if anyone asked in the meantime
+	if(saving_)
+		return;
+
+	saving_ = true;
+	std::vector<ss_client_ptr> requesters;
+	requesters.swap(save_requesters_);
+	save_service_.post(boost::bind(&ss_session::write_snapshot, shared_from_this(), ssheet_->snapshot(), requesters));
+}
+
+void ss_session::write_snapshot(spreadsheet_snapshot_ptr snap, std::vector<ss_client_ptr> requesters)
+{
+	bool saved = true;
+	try
+	{
+		spreadsheet::write_snapshot(*snap);
+	}
+	catch(...)
+	{
+		std::cerr << "Could not save spreadsheet " << ss_name_ << std::endl;
+		saved = false;
+	}
+	post(boost::bind(&ss_session::finish_save, shared_from_this(), requesters, saved));
+}
+
+void ss_session::finish_save(std::vector<ss_client_ptr> requesters, bool saved)
+{
+	saving_ = false;
+
+	// Send the responses
+	ss_message response;
+	response.set(ss_message::NAME, ss_name_);
+	if(saved)
+	{
+		response.command = ss_message::SAVE_OK;
+	}
+	else
+	{
+		response.command = ss_message::SAVE_FAIL;
+		response.set(ss_message::MESSAGE, "The spreadsheet could not be written to disk");
+	}
+	ss_buffer_ptr encoded = response.encode();
+	for(unsigned int x = 0; x < requesters.size(); x++)
+	{
+		requesters[x]->tell(encoded);
+	}
+
+	// Save again for anyone who asked while that save was being written
+	if(!save_requesters_.empty() || ssheet_->needs_compaction())
+	{
+		start_save();
+	}
+	else if(saved_)
+	{
+		saved_();
+	}
 }
 
 // Just adds a client to the clients_ set
@@ -161,6 +362,7 @@ bool ss_session::add_client(ss_client_ptr new_client, std::string password)
 	// Make sure the password matches
 	if(password == password_)
 	{
+		boost::mutex::scoped_lock lock(clients_mutex_);
 		clients_.insert(new_client);
 		return true;
 	}
@@ -174,39 +376,127 @@ bool ss_session::add_client(ss_client_ptr new_client, std::string password)
 void ss_session::drop_client(ss_client_ptr old_client)
 {
 	// Remove the session
+	boost::mutex::scoped_lock lock(clients_mutex_);
 	clients_.erase(old_client);
 	//If no clients remain, self-destruct
 }
 
 bool ss_session::empty()
 {
+	boost::mutex::scoped_lock lock(clients_mutex_);
 	return clients_.empty();
 }
 
-ss_message* ss_session::get_join_ok_msg()
+bool ss_session::has_client(ss_client_ptr client)
+{
+	boost::mutex::scoped_lock lock(clients_mutex_);
+	return clients_.find(client) != clients_.end();
+}
+
+ss_buffer_ptr ss_session::get_join_ok_msg()
+{
+	// Nothing has changed since the last JOIN - share its message
+	if(join_cache_ && join_cache_version_ == version_)
+	{
+		return join_cache_;
+	}
+
+	ss_message join_ok_msg;
+	join_ok_msg.command = ss_message::JOIN_OK;
+	join_ok_msg.set(ss_message::NAME, ss_name_);
+	join_ok_msg.version = version_;
+	ssheet_->as_xml_string(join_ok_msg.document);
+	join_ok_msg.length = join_ok_msg.document.length();
+	ssheet_->formula_values(join_ok_msg.values);
+
+	join_cache_ = join_ok_msg.encode();
+	join_cache_version_ = version_;
+	return join_cache_;
+}
+
+void ss_session::send_join_ok(ss_client_ptr requester)
+{
+	std::size_t xml_length = ssheet_->xml_length();
+	if(xml_length <= max_join_buffer)
+	{
+		requester->tell(get_join_ok_msg());
+		return;
+	}
+
+	// Too big to build in one piece - send the headers, then stream the
+	//  xml from a snapshot of the spreadsheet as the socket takes it
+	ss_message join_ok_msg;
+	join_ok_msg.command = ss_message::JOIN_OK;
+	join_ok_msg.set(ss_message::NAME, ss_name_);
+	join_ok_msg.version = version_;
+	join_ok_msg.length = xml_length;
+	requester->tell(join_ok_msg.encode());
+	requester->tell(ssheet_->xml_stream());
+	std::string* tail = new std::string("\n");
+	ss_buffer_ptr encoded_tail(tail);
+	cell_list values;
+	ssheet_->formula_values(values);
+	append_values(*tail, values);
+	requester->tell(encoded_tail);
+}
+
+void ss_session::record_versions(const cell_list& cells)
+{
+	for(cell_list::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		versions_.record(it->first, version_);
+	}
+}
+
+bool ss_session::take_cells(ss_message& change_request, cell_list& cells)
+{
+	cells.swap(change_request.cells);
+	for(cell_list::iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		if(it->first == no_cell)
+			return false;
+	}
+	return !cells.empty();
+}
+
+void ss_session::resync_client(ss_client_ptr client)
+{
+	// The UPDATEs that follow the JOIN OK are not dropped
+	client->end_resync(shared_from_this());
+	if(has_client(client))
+	{
+		send_join_ok(client);
+	}
+}
+
+void ss_session::append_values(std::string& out, const cell_list& values)
 {
-	ss_message* join_ok_msg = new ss_message();
-	join_ok_msg->command = ss_message::JOIN_OK;
-	join_ok_msg->set("Name", ss_name_);
-	join_ok_msg->set("Version", boost::lexical_cast<std::string>(version_));
-	std::string ss_xml;
-	ssheet_->as_xml_string(ss_xml);
-	join_ok_msg->set("Length", boost::lexical_cast<std::string>(ss_xml.length()));
-	join_ok_msg->set("xml", ss_xml);
-	return join_ok_msg;
+	if(values.empty())
+		return;
+	out += "Values:" + boost::lexical_cast<std::string>(values.size()) + "\n";
+	ss_message::encode_cells(values, out);
 }
 
-void ss_session::send_updates(int version, std::string cell, std::string contents, ss_client_ptr initiator)
+void ss_session::send_updates(int version, const cell_list& cells, const cell_list& values, ss_client_ptr initiator)
 {
-	// Build the update message
+	if(update_interval_.total_milliseconds() > 0)
+	{
+		gather_updates(cells, values, initiator);
+		return;
+	}
+
+	// Build the update message - one for every cell the change set
 	ss_message update;
 	update.command = ss_message::UPDATE;
-	update.set("Name", ss_name_);
-	update.set("Version", boost::lexical_cast<std::string>(version));
-	update.set("Cell", cell);
-	update.set("Length", boost::lexical_cast<std::string>(contents.length()));
-	update.set("content", contents);
+	update.set(ss_message::NAME, ss_name_);
+	update.version = version;
+	update.cells = cells;
+	update.values = values;
+	// Encode it once - every client queues the same buffer
+	ss_buffer_ptr encoded = update.encode();
+	ss_session_ptr self = shared_from_this();
 
+	boost::mutex::scoped_lock lock(clients_mutex_);
 	std::set<ss_client_ptr>::iterator it;
 	// And send the update message to each attached client
 	for(it = clients_.begin(); it != clients_.end(); ++it)
@@ -214,10 +504,131 @@ void ss_session::send_updates(int version, std::string cell, std::string content
 		// Send to all attached clients except the initiator
 		if((*it) != initiator)
 		{
-			(*it)->tell(update);
+			(*it)->tell_update(encoded, self);
 		}
 	}
 }
 
+void ss_session::gather_updates(const cell_list& cells, const cell_list& values, ss_client_ptr initiator)
+{
+	// Values go to every client - only the last one for each cell
+	for(cell_list::const_iterator it = values.begin(); it != values.end(); ++it)
+	{
+		std::pair<boost::unordered_map<cell_address, std::size_t>::iterator, bool> added =
+				pending_value_index_.insert(std::make_pair(it->first, pending_values_.size()));
+		if(added.second)
+			pending_values_.push_back(*it);
+		else
+			pending_values_[added.first->second].second = it->second;
+	}
+
+	for(cell_list::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		// A cell already waiting to go out just takes the newer contents
+		boost::unordered_map<cell_address, std::size_t>::iterator found = pending_index_.find(it->first);
+		if(found != pending_index_.end())
+		{
+			pending_update& update = pending_updates_[found->second];
+			update.contents = it->second;
+			update.writer = initiator;
+			stats_.superseded++;
+			continue;
+		}
+		pending_index_[it->first] = pending_updates_.size();
+		pending_updates_.push_back(pending_update());
+		pending_updates_.back().cell = it->first;
+		pending_updates_.back().contents = it->second;
+		pending_updates_.back().writer = initiator;
+	}
+
+	// Count the UPDATEs this would have been without merging
+	{
+		boost::mutex::scoped_lock lock(clients_mutex_);
+		pending_messages_ += clients_.size() - clients_.count(initiator);
+	}
+
+	if(!update_timer_running_)
+	{
+		update_timer_running_ = true;
+		update_timer_.expires_from_now(update_interval_);
+		update_timer_.async_wait(boost::bind(&ss_session::handle_update_timer, shared_from_this(),
+				boost::asio::placeholders::error));
+	}
+}
+
+void ss_session::handle_update_timer(const boost::system::error_code& error)
+{
+	// The timer is only cancelled when the io_service shuts down, and then
+	//  there is no one left to send to
+	if(error == boost::asio::error::operation_aborted)
+		return;
+	post(boost::bind(&ss_session::flush_updates, shared_from_this()));
 }
 
+void ss_session::flush_updates()
+{
+	update_timer_running_ = false;
+	if(pending_updates_.empty() && pending_values_.empty())
+		return;
+
+	// The clients that set one of the cells get an UPDATE without them -
+	//  everyone else shares one of all the cells
+	std::set<ss_client_ptr> writers;
+	cell_list all;
+	for(std::vector<pending_update>::iterator it = pending_updates_.begin(); it != pending_updates_.end(); ++it)
+	{
+		writers.insert(it->writer);
+		all.push_back(std::make_pair(it->cell, std::string()));
+		all.back().second.swap(it->contents);
+	}
+
+	ss_message update;
+	update.command = ss_message::UPDATE;
+	update.set(ss_message::NAME, ss_name_);
+	update.version = version_;
+	ss_message shared_update(update);
+	shared_update.cells.swap(all);
+	shared_update.values = pending_values_;
+	ss_buffer_ptr shared_encoded = shared_update.encode();
+	ss_session_ptr self = shared_from_this();
+
+	unsigned long sent = 0;
+	{
+		boost::mutex::scoped_lock lock(clients_mutex_);
+		std::set<ss_client_ptr>::iterator it;
+		for(it = clients_.begin(); it != clients_.end(); ++it)
+		{
+			if(writers.find(*it) == writers.end())
+			{
+				(*it)->tell_update(shared_encoded, self);
+				sent++;
+				continue;
+			}
+
+			cell_list theirs;
+			for(std::size_t x = 0; x < shared_update.cells.size(); x++)
+			{
+				if(pending_updates_[x].writer != *it)
+					theirs.push_back(shared_update.cells[x]);
+			}
+			if(theirs.empty() && pending_values_.empty())
+				continue;
+			ss_message own_update(update);
+			own_update.cells.swap(theirs);
+			own_update.values = pending_values_;
+			(*it)->tell_update(own_update.encode(), self);
+			sent++;
+		}
+	}
+
+	stats_.sent += sent;
+	if(pending_messages_ > sent)
+		stats_.saved += pending_messages_ - sent;
+	pending_messages_ = 0;
+	pending_updates_.clear();
+	pending_index_.clear();
+	pending_values_.clear();
+	pending_value_index_.clear();
+}
+
+}
@@ -10,34 +10,113 @@
 
 #include "ss_client.h"
 #include "spreadsheet.h"
+#include "ss_scheduler.h"
+#include "mpsc_queue.h"
+#include "undo_log.h"
+#include "version_log.h"
+#include "ss_config.h"
 #include <set>
 #include <string>
-#include <stack>
+#include <vector>
 #include <boost/lexical_cast.hpp>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
 
 
 namespace ss {
 
+// Counts of how UPDATEs were merged, across every session
+struct update_stats
+{
+	update_stats() : sent(0), saved(0), superseded(0) {}
 
-class ss_session {
+	// UPDATE messages sent to clients
+	boost::atomic<unsigned long> sent;
+	// UPDATE messages that would have been sent, but were merged in to
+	//  another
+	boost::atomic<unsigned long> saved;
+	// Cell writes replaced by a later write before being sent
+	boost::atomic<unsigned long> superseded;
+};
+
+
+// Everything that reads or changes the spreadsheet (CHANGE, UNDO, SAVE,
+//  JOIN OK) must run in the session - use post().  Posted work goes in to
+//  the session's mailbox, a lock-free queue, and the session is scheduled
+//  on the server's scheduler to work through it, one task at a time.  So
+//  the network threads only ever queue work for a session, never wait on
+//  it.  The client list is also read by the server while it looks up
+//  sessions, so it has its own lock.
+//
+// Saves are written by the server's background save service from a
+//  snapshot of the spreadsheet, so a big save never holds up the io
+//  threads.  Only one save per session is written at a time; SAVE OK is
+//  sent once the write has finished.
+//
+// With config.formulas set, CHANGE OK, UNDO OK, UPDATE and JOIN OK end
+//  with the values of the formulas that changed (every formula, for JOIN
+//  OK): Values:<n>, then n Cell:, Length: and value groups.
+//
+// With config.update_interval_ms set, UPDATEs are not sent as each change
+//  is made.  The changed cells are gathered for the interval, each cell
+//  keeping only its last write, and then every client is sent one UPDATE
+//  of the cells it did not set itself, at the session's version.
+//
+// Sessions are held by shared pointer - anything posted for a session
+//  (including a save being written) keeps it alive until it has run.
+class ss_session : public boost::enable_shared_from_this<ss_session> {
 public:
-	//Create a new spreadsheet session for the spreadsheet filename
-	ss_session(std::string ss_name, spreadsheet* ss);
+	//Create a new spreadsheet session for the spreadsheet filename.  The
+	//  session owns the spreadsheet.  config sets the size of the undo
+	//  history, whether it survives a save, and how long UPDATEs are
+	//  gathered for (timed on io_service, and counted in stats).  saved is
+	//  called in the session each time a save has finished
+	ss_session(std::string ss_name, spreadsheet* ss, ss_scheduler& scheduler,
+			boost::asio::io_service& io_service, boost::asio::io_service& save_service,
+			const ss_config& config, update_stats& stats, boost::function<void()> saved);
 
 	//Destroys a spreadsheet session
+	~ss_session();
+
+	// Saves any unsaved changes, before the session is destroyed.  Only
+	//  for shutdown, once nothing else is running
 	void close();
 
+	// Starts saving any unsaved changes (run in the session)
+	void flush();
+
+	// Returns whether a save is being written
+	bool is_saving();
+
+	// Returns roughly how much memory the spreadsheet and the undo history
+	//  use
+	std::size_t memory_size();
 
-	//Processes a change cell request
+	// Queues a task to run in the session - may be called from any thread
+	void post(boost::function<void()> task);
+
+	// Returns the name of the spreadsheet this session is for
+	const std::string& name();
+
+
+	//Processes a change cell request - of one cell, or a batch of cells
+	//  applied as one change (one version, one UPDATE, one undo).  A
+	//  request against an older version is accepted if none of its cells
+	//  have been set since
 	//Invoked by dispatch after receiving a CHANGE request
-	void handle_change_request(ss_client_ptr requester, ss_message change_request);
+	void handle_change_request(ss_client_ptr requester, ss_message_ptr change_request);
 
 	//Processes an undo request
 	//Invoked by dispatch after receiving an UNDO request
-	void handle_undo_request(ss_client_ptr requester, ss_message undo_request);
+	void handle_undo_request(ss_client_ptr requester, ss_message_ptr undo_request);
 
 	// Processes a SAVE request
-	void handle_save_request(ss_client_ptr requester, ss_message save_request);
+	void handle_save_request(ss_client_ptr requester, ss_message_ptr save_request);
 
 	// Adds a client to the session returns false if password does not match
 	bool add_client(ss_client_ptr new_client, std::string password);
@@ -48,16 +127,78 @@ public:
 	// Returns whether the session has clients
 	bool empty();
 
-	// Returns a properly formatted JOIN OK message, to be sent to client
-	//  (called by server - server is responsible for join/leave handling)
-	ss_message* get_join_ok_msg();
+	// Returns whether the client is part of the session
+	bool has_client(ss_client_ptr client);
+
+	// Returns a properly formatted JOIN OK message, to be sent to client.
+	//  The encoded message is cached until the next change, so clients
+	//  joining at the same version share one buffer.
+	ss_buffer_ptr get_join_ok_msg();
+
+	// Sends a JOIN OK message to a client that has just been added.  The
+	//  xml of a large spreadsheet is streamed, rather than built in memory
+	void send_join_ok(ss_client_ptr requester);
+
+	// Sends the spreadsheet afresh to a client whose UPDATEs were dropped
+	//  because it was too slow to take them
+	void resync_client(ss_client_ptr client);
 
 private:
-	void send_updates(int version, std::string cell, std::string contents, ss_client_ptr initiator);
+	// Sends an UPDATE for the cells a change set to every client but the
+	//  initiator - or gathers the cells to send later, if UPDATEs are
+	//  being merged
+	void send_updates(int version, const cell_list& cells, const cell_list& values, ss_client_ptr initiator);
+
+	// Adds cells and formula values to the UPDATEs being gathered, and
+	//  starts the timer if it is not running
+	void gather_updates(const cell_list& cells, const cell_list& values, ss_client_ptr initiator);
+
+	// Runs on an io thread when the update timer goes off
+	void handle_update_timer(const boost::system::error_code& error);
+
+	// Sends the gathered UPDATEs (run in the session)
+	void flush_updates();
+
+	// Notes that cells were set in the current version
+	void record_versions(const cell_list& cells);
+
+	// Moves the cells and contents of a CHANGE (one, or a batch) in to
+	//  cells.  Returns false if a cell name is not valid
+	static bool take_cells(ss_message& change_request, cell_list& cells);
+
+	// Appends the Values lines of an encoded message (see ss_message)
+	static void append_values(std::string& out, const cell_list& values);
+
+	// Snapshots the spreadsheet and hands it to the save service, unless
+	//  a save is already being written (it is started again afterwards)
+	void start_save();
+
+	// Runs on the save service - writes the snapshot to disk
+	void write_snapshot(spreadsheet_snapshot_ptr snap, std::vector<ss_client_ptr> requesters);
+
+	// Runs in the session once a snapshot has been written - tells the
+	//  requesters how it went
+	void finish_save(std::vector<ss_client_ptr> requesters, bool saved);
+
+	// Runs the tasks in the mailbox, a batch at a time, on the scheduler
+	void drain();
+
+	// Work posted to the session, waiting to run
+	mpsc_queue<boost::function<void()> > mailbox_;
+
+	// Whether the session is scheduled to drain its mailbox (or is
+	//  draining it)
+	boost::atomic<bool> scheduled_;
+
+	// Runs the session's work
+	ss_scheduler& scheduler_;
 
 	// A list of string sockets representing participants in the session
 	std::set<ss_client_ptr> clients_;
 
+	// Guards clients_
+	boost::mutex clients_mutex_;
+
 	// The name of the spreadsheet this session is for
 	std::string ss_name_;
 
@@ -70,14 +211,70 @@ private:
 	// The password for the spreadsheet
 	std::string password_;
 
-	// Items for the undo stack
-	struct change
+	// The encoded JOIN OK message for join_cache_version_ - reset when a
+	//  change is applied
+	ss_buffer_ptr join_cache_;
+
+	// The version join_cache_ was built for
+	int join_cache_version_;
+
+	// The undo history
+	undo_log undo_;
+
+	// Whether SAVE keeps the undo history
+	bool keep_undo_on_save_;
+
+	// The version each recently set cell was set in
+	version_log versions_;
+
+	// A cell write waiting to go out in the next merged UPDATE
+	struct pending_update
 	{
-		std::string cell;
-		std::string old_contents;
+		cell_address cell;
+		std::string contents;
+		// The client that set the cell - it already has the contents
+		ss_client_ptr writer;
 	};
-	//The undo stack
-	std::stack<change> undo_stack_;
+
+	// How long UPDATEs are gathered for - 0 if they are not
+	boost::posix_time::milliseconds update_interval_;
+
+	// Goes off when the gathered UPDATEs are to be sent
+	boost::asio::deadline_timer update_timer_;
+
+	// Whether update_timer_ is running
+	bool update_timer_running_;
+
+	// The gathered cell writes, in the order the cells were first set,
+	//  and where each cell is in pending_updates_
+	std::vector<pending_update> pending_updates_;
+	boost::unordered_map<cell_address, std::size_t> pending_index_;
+
+	// The formula values waiting to go out, and where each cell is in
+	//  pending_values_
+	cell_list pending_values_;
+	boost::unordered_map<cell_address, std::size_t> pending_value_index_;
+
+	// The number of UPDATE messages the gathered writes stand for
+	unsigned long pending_messages_;
+
+	// The server's UPDATE counts
+	update_stats& stats_;
+
+	// Where the snapshots are written
+	boost::asio::io_service& save_service_;
+
+	// Whether a snapshot is being written - read by the session cache
+	//  from other threads
+	boost::atomic<bool> saving_;
+
+	// Clients waiting for the next snapshot to be written
+	std::vector<ss_client_ptr> save_requesters_;
+
+	// Called once a save has finished, and no other has been started
+	boost::function<void()> saved_;
 };
+
+typedef boost::shared_ptr<ss_session> ss_session_ptr;
 }
 #endif /* SS_SESSION_H_ */
@@ -0,0 +1,33 @@
+/*
+ * ss_stream.h
+ *
+ *  Created on: Apr 25, 2013
+ *      Author: montgomc
+ */
+
+#ifndef SS_STREAM_H_
+#define SS_STREAM_H_
+
+#include <string>
+#include <cstddef>
+#include <boost/shared_ptr.hpp>
+
+namespace ss {
+
+// Part of a message that is produced a piece at a time, rather than built
+//  in memory all at once (e.g. the spreadsheet xml in a large JOIN OK).
+//  A client pulls the next piece only once the last one has been written
+//  to its socket.
+class ss_stream {
+public:
+	virtual ~ss_stream() {}
+
+	// Replaces chunk with the next piece of the stream - at most max
+	//  bytes.  Returns false (with chunk empty) once the stream is done.
+	virtual bool next_chunk(std::string& chunk, std::size_t max) = 0;
+};
+
+typedef boost::shared_ptr<ss_stream> ss_stream_ptr;
+
+}
+#endif /* SS_STREAM_H_ */
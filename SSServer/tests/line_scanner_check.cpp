@@ -0,0 +1,177 @@
+/*
+ * line_scanner_check.cpp
+ *
+ * Checks line_scanner against memchr on random buffers, or with --bench,
+ *  times the two over a buffer of request traffic.  Build it once for
+ *  each block method, from the SSServer directory:
+ *
+ *   g++ -std=gnu++11 -O2 -g -fsanitize=address,undefined -I. \
+ *       tests/line_scanner_check.cpp line_scanner.cpp -o scan_avx2 \
+ *       -lboost_timer -lboost_chrono -lboost_system
+ *
+ * adding -DSS_SCAN_NO_AVX2 for scan_sse2 and -DSS_SCAN_NO_SSE2 for
+ *  scan_none, and leaving out the sanitizers for --bench.  On a CPU without
+ *  AVX2 the first build tests SSE2 too.  Run with a number of buffers to
+ *  check more than the default 200000.
+ */
+
+#include "line_scanner.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/timer/timer.hpp>
+
+using namespace ss;
+
+static boost::random::mt19937 rng;
+
+static std::size_t random(std::size_t low, std::size_t high)
+{
+	return boost::random::uniform_int_distribution<std::size_t>(low, high)(rng);
+}
+
+// Scans one buffer, jumping forward at random between calls, and checks
+//  every answer against memchr.  Returns false on the first mismatch
+static bool check_buffer(const char* data, std::size_t size)
+{
+	const char* end = data + size;
+	line_scanner scanner(end);
+	const char* pos = data;
+	while(pos < end)
+	{
+		const char* expected = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+		const char* found = scanner.next(pos);
+		if(found != expected)
+		{
+			std::printf("size %lu, from %ld: expected %ld, found %ld\n",
+					(unsigned long)size, (long)(pos - data),
+					expected ? (long)(expected - data) : -1L,
+					found ? (long)(found - data) : -1L);
+			return false;
+		}
+		if(found == NULL)
+			break;
+
+		// Mostly go on from the line just found, as the parser does, but
+		//  sometimes skip ahead, as it does over contents
+		if(random(0, 3) == 0)
+			pos += random(0, end - pos);
+		else
+			pos = found + 1;
+	}
+	return true;
+}
+
+static int check(unsigned long rounds)
+{
+	for(unsigned long round = 0; round < rounds; round++)
+	{
+		// An exact allocation, so reading past the end is caught
+		std::size_t size = random(0, 300);
+		std::size_t odds = random(1, 64);
+		char* data = static_cast<char*>(std::malloc(size + 1));
+		for(std::size_t x = 0; x < size; x++)
+			data[x] = random(1, odds) == 1 ? '\n' : char(random(0, 255));
+		bool ok = check_buffer(data, size);
+		std::free(data);
+		if(!ok)
+		{
+			std::printf("FAIL in round %lu\n", round);
+			return 1;
+		}
+	}
+	std::printf("ok: %lu buffers\n", rounds);
+	return 0;
+}
+
+// The traffic a busy editor sends - CHANGE and UNDO requests with short
+//  contents
+static std::string make_traffic(std::size_t size)
+{
+	std::string traffic;
+	char request[160];
+	for(unsigned long x = 0; traffic.size() < size; x++)
+	{
+		if(x % 8 == 7)
+			std::sprintf(request, "UNDO\nName:sheet\nVersion:%lu\n\n", x);
+		else
+			std::sprintf(request, "CHANGE\nName:sheet\nVersion:%lu\nCell:A%lu\nLength:4\n%04lu\n", x, x % 1000, x % 10000);
+		traffic += request;
+	}
+	return traffic;
+}
+
+// Returns bytes per second for finding every line, one way or the other
+template<typename Finder>
+static double time_scan(const std::string& traffic, Finder& find, std::size_t& lines)
+{
+	const char* data = traffic.data();
+	const char* end = data + traffic.size();
+	boost::timer::cpu_timer timer;
+	unsigned int passes = 0;
+	do
+	{
+		lines = 0;
+		for(const char* pos = data; (pos = find(pos, end)) != NULL; pos++)
+			lines++;
+		passes++;
+	}
+	while(timer.elapsed().wall < 1000000000LL);
+	return double(traffic.size()) * passes / (timer.elapsed().wall / 1e9);
+}
+
+struct memchr_finder
+{
+	const char* operator()(const char* pos, const char* end) const
+	{
+		return static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+	}
+};
+
+struct scanner_finder
+{
+	const char* operator()(const char* pos, const char* end)
+	{
+		if(scanner == NULL || end != scanner_end || pos == start)
+		{
+			delete scanner;
+			scanner = new line_scanner(end);
+			scanner_end = end;
+		}
+		return scanner->next(pos);
+	}
+	line_scanner* scanner;
+	const char* scanner_end;
+	const char* start;
+};
+
+static int bench()
+{
+	std::string traffic = make_traffic(8 << 20);
+	std::size_t expected, lines;
+	memchr_finder by_memchr_finder;
+	double by_memchr = time_scan(traffic, by_memchr_finder, expected);
+	scanner_finder finder = { NULL, NULL, traffic.data() };
+	double by_scanner = time_scan(traffic, finder, lines);
+	delete finder.scanner;
+	if(lines != expected)
+	{
+		std::printf("FAIL: memchr found %lu lines, the scanner %lu\n",
+				(unsigned long)expected, (unsigned long)lines);
+		return 1;
+	}
+	std::printf("%lu lines in %lu bytes\n", (unsigned long)lines, (unsigned long)traffic.size());
+	std::printf("memchr   %.2f GB/s\n", by_memchr / 1e9);
+	std::printf("scanner  %.2f GB/s\n", by_scanner / 1e9);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc > 1 && std::strcmp(argv[1], "--bench") == 0)
+		return bench();
+	return check(argc > 1 ? std::strtoul(argv[1], NULL, 10) : 200000);
+}
@@ -0,0 +1,445 @@
+#!/usr/bin/env python3
+"""
+ss_bench.py
+
+Repeatable benchmarks for SSServer, each run against a fresh server on a
+scratch directory.
+
+    python3 tests/ss_bench.py path/to/SSServer [benchmark ...] [--seconds=N]
+
+Benchmarks: cells, editors, threads, broadcast, lookups, contention,
+pipelined, join_save, recalc.  A request id (user-010) in place of a name
+runs the benchmarks that measure that request.  Compare two builds by
+running the same command against each binary.
+"""
+
+import asyncio
+import os
+import re
+import sys
+import time
+
+from ss_harness import Server, Client
+
+benchmarks = []
+seconds = 3.0
+
+
+def benchmark(*options, measures=''):
+    """Registers a benchmark, run against a fresh server started with
+    options.  measures names the requests whose changes it times"""
+    def register(fn):
+        benchmarks.append((fn.__name__, fn, list(options), measures.split()))
+        return fn
+    return register
+
+
+def report(name, value, unit):
+    print('  %-36s %12.1f %s' % (name, value, unit))
+
+
+async def editor(server, name, index, state):
+    """Changes its own cell as fast as the server accepts the changes"""
+    reader, writer = await asyncio.open_connection('127.0.0.1', server.port)
+    writer.write(Client.join_msg(name).encode())
+    cell = '%s%d' % (chr(ord('A') + index % 26), 1 + index // 26)
+    version, count, buf, ready = 0, 0, b'', False
+
+    def send():
+        nonlocal count
+        count += 1
+        writer.write(Client.change_msg(name, version, cell, 'v%d' % count).encode())
+
+    while not state['stop']:
+        try:
+            data = await asyncio.wait_for(reader.read(1 << 16), 0.1)
+        except asyncio.TimeoutError:
+            if not ready and state['go']:
+                ready = True
+                send()
+            continue
+        if not data:
+            break
+        buf += data
+        lines = buf.split(b'\n')
+        buf = lines.pop()
+        answered = False
+        for line in lines:
+            if line == b'CHANGE OK':
+                state['ok'] += 1
+                answered = True
+            elif line == b'CHANGE WAIT':
+                state['wait'] += 1
+                answered = True
+            elif line.startswith(b'Version:'):
+                version = max(version, int(line[8:]))
+                if answered and not state['stop']:
+                    answered = False
+                    send()
+        await writer.drain()
+    writer.close()
+
+
+async def run_editors(server, editors, sheets=1, label=None):
+    """Runs editors spread over sheets new spreadsheets, and reports how
+    many CHANGEs a second were accepted"""
+    label = label or '%d editor(s)' % editors
+    names = ['%s %d' % (label, x) for x in range(sheets)]
+    c = Client(server)
+    for name in names:
+        c.create(name)
+    state = {'go': False, 'stop': False, 'ok': 0, 'wait': 0}
+    tasks = [asyncio.ensure_future(editor(server, names[x % sheets], x // sheets, state))
+             for x in range(editors)]
+    await asyncio.sleep(0.5)
+    state['go'] = True
+    await asyncio.sleep(0.25)
+    ok, wait, start = state['ok'], state['wait'], time.time()
+    await asyncio.sleep(seconds)
+    elapsed = time.time() - start
+    ok, wait = state['ok'] - ok, state['wait'] - wait
+    state['stop'] = True
+    await asyncio.gather(*tasks)
+    report('%s: accepted' % label, ok / elapsed, 'CHANGE/s')
+    report('%s: CHANGE WAIT' % label, wait / elapsed, 'CHANGE/s')
+
+
+def cell_name(x):
+    return '%s%d' % (chr(ord('A') + x % 26), 1 + x // 26)
+
+
+@benchmark(measures='user-001')
+def cells(server):
+    """Setting and getting cells of 1k, 10k and 100k cell spreadsheets, one
+    CHANGE per cell, so it runs against builds without batch CHANGE too"""
+    for size in (1000, 10000, 100000):
+        name = 'cells%d' % size
+        c = Client(server, 600)
+        c.create(name)
+        c.join(name)
+        # A build that slows down as the spreadsheet grows is given up on
+        #  after a while
+        start, filled = time.time(), 0
+        while filled < size and time.time() - start < seconds * 20:
+            c.send(''.join(Client.change_msg(name, v, cell_name(v), 'value %d' % v)
+                           for v in range(filled, filled + 1000)))
+            filled += 1000
+            c.read_until('Version:%d\n' % filled, 600)
+        report('%d cells: fill' % size, filled / (time.time() - start), 'CHANGE/s')
+        if filled < size:
+            report('%d cells: gave up filling at' % size, filled, 'cells')
+        else:
+            times = []
+            for v in range(size, size + 20):
+                start = time.time()
+                c.change(name, v, cell_name(v % size), 'changed %d' % v)
+                times.append(time.time() - start)
+            report('%d cells: CHANGE' % size, min(times) * 1e6, 'us')
+            times = []
+            for x in range(5):
+                start = time.time()
+                Client(server, 600).join(name)
+                times.append(time.time() - start)
+            report('%d cells: JOIN' % size, min(times) * 1000, 'ms')
+        c.close()
+
+
+@benchmark(measures='user-002 user-003')
+def editors(server):
+    for count in (1, 8, 64):
+        asyncio.run(run_editors(server, count))
+
+
+@benchmark(measures='user-002')
+def threads(server):
+    """64 editors over 16 spreadsheets, with the server's default threads
+    and then with --threads=1, 2, 4 and 8"""
+    asyncio.run(run_editors(server, 64, 16, 'default threads'))
+    for count in (1, 2, 4, 8):
+        server.options = ['--threads=%d' % count]
+        try:
+            server.restart()
+        except RuntimeError:
+            report('--threads not supported, stopped at', count, 'threads')
+            return
+        asyncio.run(run_editors(server, 64, 16, '%d thread(s)' % count))
+
+
+def cpu_seconds(server):
+    """The CPU time the server process has used"""
+    with open('/proc/%d/stat' % server.proc.pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+
+
+def broadcast_run(server, watchers, changes):
+    """Makes changes CHANGEs with watchers other clients joined, on a fresh
+    server process.  Returns the server's CPU time for them, and its
+    allocation count at shutdown (None unless it was built with
+    SS_COUNT_ALLOCATIONS)"""
+    server.restart()
+    name = 'broadcast%d_%d' % (watchers, changes)
+    a = Client(server, 60)
+    a.create(name)
+    a.join(name)
+    others = [Client(server, 60) for x in range(watchers)]
+    for c in others:
+        c.join(name)
+    cpu = cpu_seconds(server)
+    for v in range(changes):
+        a.change(name, v, cell_name(v % 100), 'value %d' % v)
+    for c in others:
+        c.read_until('Version:%d\n' % changes, 60)
+    cpu = cpu_seconds(server) - cpu
+    for c in [a] + others:
+        c.close()
+    found = re.search(r'Allocations: (\d+) for', server.stop())
+    server.start()
+    return cpu, int(found.group(1)) if found else None
+
+
+@benchmark(measures='user-004 user-020')
+def broadcast(server):
+    """The cost of each UPDATE sent, with 1, 10 and 100 clients watching a
+    spreadsheet.  Allocations are the difference between runs of 200 and
+    5200 CHANGEs, so setting up does not count"""
+    for watchers in (1, 10, 100):
+        cpu, few = broadcast_run(server, watchers, 200)
+        cpu, many = broadcast_run(server, watchers, 5200)
+        report('%d watcher(s): CPU per UPDATE' % watchers, cpu / (5200 * watchers) * 1e6, 'us')
+        if few is not None and many is not None:
+            per_change = (many - few) / 5000.0
+            report('%d watcher(s): allocations per CHANGE' % watchers, per_change, '')
+            report('%d watcher(s): allocations per UPDATE' % watchers, per_change / watchers, '')
+
+
+def write_index(root, count, files):
+    """Writes an index of count spreadsheets straight to root, as the
+    server would have after count CREATEs, and the files of the first
+    files of them"""
+    for name in ('index.xml.log', 'index.xml.log.old'):
+        if os.path.exists(os.path.join(root, name)):
+            os.remove(os.path.join(root, name))
+    with open(os.path.join(root, 'index.xml'), 'w') as f:
+        f.write('<?xml version="1.0" encoding="UTF-8"?>\n<index nextID="%d">\n' % (count + 1))
+        for x in range(count):
+            f.write('  <ss filename="%d.ss">sheet%06d</ss>\n' % (x + 1, x))
+        f.write('</index>\n')
+    for x in range(files):
+        with open(os.path.join(root, '%d.ss' % (x + 1)), 'w') as f:
+            f.write('<?xml version="1.0" encoding="UTF-8"?>\n<server_ss><ssName>sheet%06d</ssName>'
+                    '<password>pw</password><spreadsheet/></server_ss>\n' % x)
+
+
+@benchmark(measures='user-010')
+def lookups(server):
+    """Looking spreadsheets up by name with 1k, 10k and 100k of them in the
+    index, which is written out up front so builds that are slow to CREATE
+    can be measured too"""
+    joins = 50
+    for size in (1000, 10000, 100000):
+        server.stop()
+        write_index(server.root, size, joins)
+        server.start()
+        c = Client(server, 600)
+        # The server takes connections while it is still reading the index
+        c.send(Client.create_msg('sheet000000'))
+        c.read_until('CREATE FAIL\nName:sheet000000\n', 600)
+        c.read_until('\n', 600)
+
+        # CREATE of a name that is taken is just a lookup
+        taken = ['sheet%06d' % (x * (size // 200)) for x in range(200)]
+        start = time.time()
+        c.send(''.join(Client.create_msg(name) for name in taken))
+        c.read_until('Name:%s\n' % taken[-1], 600)
+        c.read_until('\n', 600)
+        report('%d sheets: CREATE of a taken name' % size, (time.time() - start) / len(taken) * 1e6, 'us')
+
+        times = []
+        for x in range(joins):
+            name = 'sheet%06d' % x
+            start = time.time()
+            c.join(name)
+            times.append(time.time() - start)
+            c.send('LEAVE\nName:%s\n' % name)
+        report('%d sheets: JOIN' % size, sorted(times)[joins // 2] * 1000, 'ms')
+
+        times = []
+        for x in range(20):
+            start = time.time()
+            c.create('new%d_%d' % (size, x))
+            times.append(time.time() - start)
+        report('%d sheets: CREATE' % size, sorted(times)[10] * 1000, 'ms')
+        c.close()
+
+
+async def undoer(server, name, state):
+    """Keeps a window of UNDO requests outstanding on a spreadsheet with
+    nothing to undo, so each one is a trip through the session and back"""
+    reader, writer = await asyncio.open_connection('127.0.0.1', server.port)
+    writer.write(Client.join_msg(name).encode())
+    request = Client.undo_msg(name, 0).encode()
+    window, buf, joined = 16, b'', False
+    while not state['stop']:
+        data = await reader.read(1 << 16)
+        if not data:
+            break
+        buf += data
+        if not joined:
+            if b'JOIN OK' not in buf:
+                continue
+            joined, buf = True, b''
+            writer.write(request * window)
+            continue
+        answered = buf.count(b'\nName:')
+        buf = buf[buf.rfind(b'\nName:') + 1:] if answered else buf
+        if state['go']:
+            state['answered'] += answered
+        writer.write(request * answered)
+        await writer.drain()
+    writer.close()
+
+
+async def run_contention(server, clients, sessions):
+    names = ['contention%d_%d' % (clients, x) for x in range(sessions)]
+    c = Client(server)
+    for name in names:
+        c.create(name)
+    state = {'go': False, 'stop': False, 'answered': 0}
+    tasks = [asyncio.ensure_future(undoer(server, names[x % sessions], state)) for x in range(clients)]
+    await asyncio.sleep(1.0)
+    state['go'] = True
+    start = time.time()
+    await asyncio.sleep(seconds)
+    answered, elapsed = state['answered'], time.time() - start
+    state['stop'] = True
+    await asyncio.gather(*tasks)
+    report('%d clients, %d sessions' % (clients, sessions), answered / elapsed, 'UNDO/s')
+
+
+@benchmark(measures='user-015')
+def contention(server):
+    """Many clients over many sessions, each pipelining UNDOs, so the cost
+    of handing requests to sessions dominates"""
+    for clients, sessions in ((64, 16), (256, 64)):
+        asyncio.run(run_contention(server, clients, sessions))
+
+
+@benchmark(measures='user-005 user-024 user-025')
+def pipelined(server):
+    """Many small CHANGEs sent in one go, so the parser sees full buffers"""
+    c = Client(server, 60)
+    c.create('pipe')
+    c.join('pipe')
+    total = 50000
+    data = ''.join(Client.change_msg('pipe', v, 'A%d' % (v % 1000 + 1), 'value %d' % v)
+                   for v in range(total)).encode()
+    start = time.time()
+    c.send(data)
+    c.read_until('Version:%d\n' % total, 120)
+    elapsed = time.time() - start
+    report('pipelined CHANGEs', total / elapsed, 'CHANGE/s')
+    report('request bytes', len(data) / elapsed / 1e6, 'MB/s')
+
+
+def fill(c, name, cells, width=200):
+    """Fills cells cells of name in batches, and returns the version"""
+    version = 0
+    for first in range(0, cells, 1000):
+        batch = [('%s%d' % (chr(ord('A') + x % 26), 1 + x // 26), 'cell %d ' % x * (width // 10))
+                 for x in range(first, min(cells, first + 1000))]
+        c.send(Client.batch_msg(name, version, batch))
+        version += 1
+        c.expect('CHANGE OK\nName:%s\nVersion:%d\n' % (name, version), 60)
+    return version
+
+
+@benchmark(measures='user-007 user-008 user-009')
+def join_save(server):
+    c = Client(server, 60)
+    c.create('big')
+    c.join('big')
+    version = fill(c, 'big', 50000)
+
+    start = time.time()
+    c.send('SAVE\nName:big\n')
+    c.expect('SAVE OK\nName:big\n', 60)
+    report('SAVE, 50000 cells', (time.time() - start) * 1000, 'ms')
+
+    # The first CHANGE after a snapshot is taken, while it is written
+    start = time.time()
+    c.send('SAVE\nName:big\n' + Client.change_msg('big', version, 'A1', 'after'))
+    c.read_until('CHANGE OK\n', 60)
+    report('CHANGE behind a SAVE', (time.time() - start) * 1000, 'ms')
+    c.read_until('SAVE OK\nName:big\n', 60)
+
+    start = time.time()
+    other = Client(server, 60)
+    other.join('big')
+    report('JOIN of an open session', (time.time() - start) * 1000, 'ms')
+
+    c.close()
+    other.close()
+    server.restart()
+    start = time.time()
+    Client(server, 60).join('big')
+    report('JOIN from disk', (time.time() - start) * 1000, 'ms')
+
+
+def recalc_latency(server, name, cells, changed):
+    """Time from a CHANGE to the watcher receiving the recalculated values"""
+    a = Client(server, 60)
+    a.create(name)
+    a.join(name)
+    watcher = Client(server, 60)
+    watcher.join(name)
+    version = 0
+    for first in range(0, len(cells), 1000):
+        a.send(Client.batch_msg(name, version, cells[first:first + 1000]))
+        version += 1
+        a.expect('CHANGE OK\nName:%s\nVersion:%d\nValues:' % (name, version), 60)
+        a.read_cells(60)
+        watcher.read_until('Values:', 60)
+        watcher.read_cells(60)
+    times = []
+    for x in range(5):
+        start = time.time()
+        a.send(Client.change_msg(name, version, changed, str(x + 2)))
+        version += 1
+        watcher.read_until('Values:', 60)
+        watcher.read_cells(60)
+        times.append(time.time() - start)
+        a.read_until('Values:', 60)
+        a.read_cells(60)
+    return min(times) * 1000
+
+
+@benchmark('--formulas=on', measures='user-022 user-023')
+def recalc(server):
+    cells = [('A1', '1')] + [('B%d' % (x + 1), '=A1+%d' % x) for x in range(20000)]
+    report('wide: 20000 cells on A1', recalc_latency(server, 'wide', cells, 'A1'), 'ms')
+    cells = [('A1', '1')] + [('A%d' % (x + 2), '=A%d+1' % (x + 1)) for x in range(2000)]
+    report('deep: chain of 2000 cells', recalc_latency(server, 'deep', cells, 'A1'), 'ms')
+
+
+def main(argv):
+    global seconds
+    args = [a for a in argv[1:] if not a.startswith('--')]
+    for a in argv[1:]:
+        if a.startswith('--seconds='):
+            seconds = float(a[10:])
+    if not args:
+        print('usage: %s path/to/SSServer [benchmark or request ...] [--seconds=N]' % argv[0])
+        return 2
+    wanted = set(args[1:])
+    for name, fn, options, requests in benchmarks:
+        if wanted and name not in wanted and not wanted.intersection(requests):
+            continue
+        print('%s (%s)' % (name, ', '.join(requests)))
+        with Server(args[0], options) as server:
+            fn(server)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
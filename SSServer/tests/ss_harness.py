@@ -0,0 +1,236 @@
+"""
+ss_harness.py
+
+Starts an SSServer on a scratch directory and talks to it over the
+protocol.  Used by ss_test.py and ss_bench.py.
+"""
+
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import tempfile
+import time
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+class Server(object):
+    """An SSServer process with a root directory of its own.  The same root
+    can be started again (restart) to see what was saved."""
+
+    def __init__(self, binary, options=(), root=None):
+        self.binary = os.path.abspath(binary)
+        self.options = list(options)
+        self.own_root = root is None
+        self.root = root or tempfile.mkdtemp(prefix='ss_test_')
+        self.proc = None
+        self.output = ''
+
+    def start(self):
+        self.port = free_port()
+        self.log = open(os.path.join(self.root, 'server.log'), 'w')
+        self.proc = subprocess.Popen(
+            [self.binary, str(self.port), self.root + '/', 'index.xml'] + self.options,
+            stdout=self.log, stderr=subprocess.STDOUT)
+        deadline = time.time() + 10
+        while time.time() < deadline:
+            if self.proc.poll() is not None:
+                raise RuntimeError('server exited with %d' % self.proc.returncode)
+            try:
+                socket.create_connection(('127.0.0.1', self.port), 0.2).close()
+                return self
+            except socket.error:
+                time.sleep(0.05)
+        raise RuntimeError('server did not start listening')
+
+    def alive(self):
+        return self.proc is not None and self.proc.poll() is None
+
+    def stop(self):
+        """Stops the server the way Ctrl+C does, and returns what it printed"""
+        if self.proc is None:
+            return self.output
+        if self.proc.poll() is None:
+            self.proc.send_signal(signal.SIGINT)
+            try:
+                self.proc.wait(30)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+        self.proc = None
+        self.log.close()
+        with open(os.path.join(self.root, 'server.log')) as f:
+            self.output = f.read()
+        return self.output
+
+    def crash(self):
+        """Kills the server without letting it save anything"""
+        self.proc.kill()
+        self.proc.wait()
+        return self.stop()
+
+    def restart(self):
+        self.stop()
+        return self.start()
+
+    def close(self):
+        self.stop()
+        if self.own_root:
+            shutil.rmtree(self.root, ignore_errors=True)
+
+    def __enter__(self):
+        return self.start()
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+class Client(object):
+    """One connection.  Responses are checked byte for byte with expect(),
+    so framing mistakes show up as a mismatch."""
+
+    def __init__(self, server, timeout=10.0):
+        self.sock = socket.create_connection(('127.0.0.1', server.port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.timeout = timeout
+        self.buf = b''
+
+    def send(self, data):
+        if isinstance(data, str):
+            data = data.encode()
+        self.sock.sendall(data)
+
+    def send_split(self, data, size=1, pause=0.0):
+        """Sends data a few bytes at a time, so the server reads it in pieces"""
+        if isinstance(data, str):
+            data = data.encode()
+        for x in range(0, len(data), size):
+            self.sock.sendall(data[x:x + size])
+            if pause:
+                time.sleep(pause)
+
+    def fill(self, wanted, timeout=None):
+        deadline = time.time() + (timeout or self.timeout)
+        while len(self.buf) < wanted:
+            left = deadline - time.time()
+            if left <= 0:
+                return False
+            self.sock.settimeout(left)
+            try:
+                data = self.sock.recv(1 << 20)
+            except socket.timeout:
+                return False
+            if not data:
+                return False
+            self.buf += data
+        return True
+
+    def expect(self, data, timeout=None):
+        """Reads exactly data from the connection, or raises AssertionError"""
+        if isinstance(data, str):
+            data = data.encode()
+        self.fill(len(data), timeout)
+        got, self.buf = self.buf[:len(data)], self.buf[len(data):]
+        if got != data:
+            raise AssertionError('expected %r\n     got %r' % (data, got + self.buf[:200]))
+
+    def read_until(self, marker, timeout=None):
+        """Reads up to and including marker, and returns what was read"""
+        if isinstance(marker, str):
+            marker = marker.encode()
+        deadline = time.time() + (timeout or self.timeout)
+        while marker not in self.buf:
+            if not self.fill(len(self.buf) + 1, max(0.01, deadline - time.time())):
+                raise AssertionError('never got %r (have %r)' % (marker, self.buf[:200]))
+        end = self.buf.index(marker) + len(marker)
+        got, self.buf = self.buf[:end], self.buf[end:]
+        return got
+
+    def read_cells(self, timeout=None):
+        """Reads a Count: or Values: number and that many cells, and returns them"""
+        count = int(self.read_until('\n', timeout)[:-1])
+        cells = []
+        for x in range(count):
+            cell = self.read_until('\n', timeout)[5:-1].decode()
+            self.read_until('Length:', timeout)
+            length = int(self.read_until('\n', timeout)[:-1])
+            self.fill(length + 1, timeout)
+            cells.append((cell, self.buf[:length].decode()))
+            self.buf = self.buf[length + 1:]
+        return cells
+
+    def expect_nothing(self, wait=0.3):
+        self.fill(len(self.buf) + 1, wait)
+        if self.buf:
+            raise AssertionError('expected nothing, got %r' % self.buf[:200])
+
+    def closed(self, wait=2.0):
+        """Returns whether the server closed the connection"""
+        self.sock.settimeout(wait)
+        try:
+            while True:
+                data = self.sock.recv(1 << 20)
+                if not data:
+                    return True
+        except socket.timeout:
+            return False
+        except socket.error:
+            return True
+
+    def close(self):
+        self.sock.close()
+
+    # Requests, in protocol format
+    @staticmethod
+    def create_msg(name, password='pw'):
+        return 'CREATE\nName:%s\nPassword:%s\n' % (name, password)
+
+    @staticmethod
+    def join_msg(name, password='pw'):
+        return 'JOIN\nName:%s\nPassword:%s\n' % (name, password)
+
+    @staticmethod
+    def change_msg(name, version, cell, contents):
+        return 'CHANGE\nName:%s\nVersion:%d\nCell:%s\nLength:%d\n%s\n' % (
+            name, version, cell, len(contents.encode()), contents)
+
+    @staticmethod
+    def batch_msg(name, version, cells):
+        return 'CHANGE\nName:%s\nVersion:%d\nCount:%d\n' % (name, version, len(cells)) + ''.join(
+            'Cell:%s\nLength:%d\n%s\n' % (cell, len(contents.encode()), contents) for cell, contents in cells)
+
+    @staticmethod
+    def undo_msg(name, version):
+        return 'UNDO\nName:%s\nVersion:%d\n' % (name, version)
+
+    def create(self, name, password='pw'):
+        self.send(self.create_msg(name, password))
+        self.expect('CREATE OK\nName:%s\nPassword:%s\n' % (name, password))
+
+    def join(self, name, password='pw'):
+        """Joins, and returns (version, xml)"""
+        self.send(self.join_msg(name, password))
+        return self.join_ok(name)
+
+    def join_ok(self, name):
+        """Reads up to a JOIN OK, and returns (version, xml).  UPDATEs the
+        session sent while the JOIN OK was on its way are skipped"""
+        self.read_until('JOIN OK\nName:%s\nVersion:' % name)
+        version = int(self.read_until('\n')[:-1])
+        self.read_until('Length:')
+        length = int(self.read_until('\n')[:-1])
+        self.fill(length + 1)
+        xml, self.buf = self.buf[:length], self.buf[length + 1:]
+        return version, xml.decode()
+
+    def change(self, name, version, cell, contents):
+        self.send(self.change_msg(name, version, cell, contents))
+        self.expect('CHANGE OK\nName:%s\nVersion:%d\n' % (name, version + 1))
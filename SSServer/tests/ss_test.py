@@ -0,0 +1,532 @@
+#!/usr/bin/env python3
+"""
+ss_test.py
+
+Protocol tests for SSServer.  Each test starts the server binary on a
+scratch directory and checks its responses byte for byte.
+
+    python3 tests/ss_test.py path/to/SSServer [test name ...]
+
+Each test names the requests it verifies, and a request id (user-018) in
+place of a test name runs those tests.  Exits non-zero if any test fails.
+"""
+
+import os
+import random
+import sys
+import threading
+import time
+import traceback
+from xml.etree import ElementTree
+
+from ss_harness import Server, Client
+
+tests = []
+
+
+def test(*options, verifies=''):
+    """Registers a test, run against a fresh server started with options.
+    verifies names the requests whose behaviour it checks"""
+    def register(fn):
+        tests.append((fn.__name__, fn, list(options), verifies.split()))
+        return fn
+    return register
+
+
+def joined(server, name='sheet', clients=1):
+    """Creates name and joins it from clients connections"""
+    first = Client(server)
+    first.create(name)
+    result = [first]
+    for x in range(clients - 1):
+        result.append(Client(server))
+    for c in result:
+        c.join(name)
+    return result
+
+
+# Request parsing (user-005, user-024, user-025)
+
+@test(verifies='user-005 user-024')
+def split_one_byte_at_a_time(server):
+    c = Client(server)
+    c.send_split(Client.create_msg('split'), 1, 0.001)
+    c.expect('CREATE OK\nName:split\nPassword:pw\n')
+    c.send_split(Client.join_msg('split'), 1, 0.001)
+    c.join_ok('split')
+    c.send_split(Client.change_msg('split', 0, 'A1', 'hello\r\nworld'), 1, 0.001)
+    c.expect('CHANGE OK\nName:split\nVersion:1\n')
+
+
+@test(verifies='user-005 user-024')
+def split_at_every_boundary(server):
+    c, = joined(server, 'bounds')
+    version = 0
+    # Every split point of a CHANGE whose blob holds line breaks of its own
+    for x in range(1, len(Client.change_msg('bounds', 0, 'B7', 'a\nb\r\nc'))):
+        request = Client.change_msg('bounds', version, 'B7', 'a\nb\r\nc')
+        c.send(request[:x])
+        time.sleep(0.002)
+        c.send(request[x:])
+        version += 1
+        c.expect('CHANGE OK\nName:bounds\nVersion:%d\n' % version)
+
+
+@test(verifies='user-005 user-024')
+def crlf_line_endings(server):
+    c = Client(server)
+    c.send('CREATE\r\nName:crlf\r\nPassword:pw\r\n')
+    c.expect('CREATE OK\nName:crlf\nPassword:pw\n')
+    c.join('crlf')
+    c.send_split('CHANGE\r\nName:crlf\r\nVersion:0\r\nCell:A1\r\nLength:2\r\nab\r\n', 3, 0.002)
+    c.expect('CHANGE OK\nName:crlf\nVersion:1\n')
+
+
+@test(verifies='user-003 user-005 user-025')
+def coalesced_requests(server):
+    c = Client(server)
+    c.send(Client.create_msg('many') + Client.join_msg('many') +
+           ''.join(Client.change_msg('many', v, 'C%d' % (v + 1), 'x' * v) for v in range(50)) +
+           Client.undo_msg('many', 50) + 'SAVE\nName:many\n')
+    c.expect('CREATE OK\nName:many\nPassword:pw\n')
+    c.expect('JOIN OK\nName:many\nVersion:0\n')
+    c.read_until('\n')
+    c.read_until('\n')
+    for v in range(50):
+        c.expect('CHANGE OK\nName:many\nVersion:%d\n' % (v + 1))
+    c.expect('UNDO OK\nName:many\nVersion:51\nCell:C50\nLength:0\n\n')
+    c.expect('SAVE OK\nName:many\n')
+
+
+@test(verifies='user-005 user-025')
+def unknown_command(server):
+    c = Client(server)
+    c.send('BOGUS\n' + Client.create_msg('after'))
+    c.expect('ERROR\n')
+    c.expect('CREATE OK\nName:after\nPassword:pw\n')
+
+
+# Batch CHANGE (user-018) and stale CHANGEs (user-019)
+
+@test(verifies='user-018')
+def batch_change(server):
+    a, b = joined(server, 'batch', 2)
+    cells = [('A1', 'a'), ('B2', 'bb'), ('C3', '')]
+    a.send(Client.batch_msg('batch', 0, cells))
+    a.expect('CHANGE OK\nName:batch\nVersion:1\n')
+    b.expect('UPDATE\nName:batch\nVersion:1\nCount:3\n'
+             'Cell:A1\nLength:1\na\nCell:B2\nLength:2\nbb\nCell:C3\nLength:0\n\n')
+    a.send(Client.undo_msg('batch', 1))
+    a.expect('UNDO OK\nName:batch\nVersion:2\nCount:3\n'
+             'Cell:C3\nLength:0\n\nCell:B2\nLength:0\n\nCell:A1\nLength:0\n\n')
+
+
+@test(verifies='user-018 user-005')
+def batch_change_split(server):
+    a, b = joined(server, 'bsplit', 2)
+    a.send_split(Client.batch_msg('bsplit', 0, [('A1', '1\n2'), ('A2', 'x')]), 2, 0.001)
+    a.expect('CHANGE OK\nName:bsplit\nVersion:1\n')
+    b.expect('UPDATE\nName:bsplit\nVersion:1\nCount:2\nCell:A1\nLength:3\n1\n2\nCell:A2\nLength:1\nx\n')
+
+
+@test(verifies='user-018')
+def batch_of_none(server):
+    a, = joined(server, 'none')
+    a.send('CHANGE\nName:none\nVersion:0\nCount:0\n')
+    a.expect('ERROR\nName:none\nVersion:0\n')
+    a.change('none', 0, 'A1', 'still in step')
+
+
+@test(verifies='user-018')
+def batch_with_bad_cell(server):
+    a, b = joined(server, 'bad', 2)
+    a.send(Client.batch_msg('bad', 0, [('A1', 'z'), ('ZZZZ9', 'q')]))
+    a.expect('CHANGE FAIL\nName:bad\nInvalid cell name\n')
+    b.expect_nothing()
+    # Nothing was applied, so the version has not moved
+    a.change('bad', 0, 'A1', 'ok')
+    b.expect('UPDATE\nName:bad\nVersion:1\nCell:A1\nLength:2\nok\n')
+
+
+@test(verifies='user-019')
+def change_out_of_date(server):
+    a, = joined(server, 'late')
+    a.change('late', 0, 'A1', 'x')
+    a.send(Client.change_msg('late', 0, 'A1', 'y'))
+    a.expect('CHANGE WAIT\nName:late\nVersion:1\n')
+
+
+# Formulas (user-022)
+
+@test('--formulas=on', verifies='user-022')
+def formula_too_deep(server):
+    a, b = joined(server, 'deep', 2)
+    for contents in ('=' + '(' * 2000000 + '1', '=' + '-' * 100000 + '1', '=1' + '+1' * 5000):
+        a.send(Client.change_msg('deep', 0, 'A1', contents))
+        a.expect('CHANGE FAIL\nName:deep\nFormula too long or too deeply nested\n', 30)
+    b.expect_nothing()
+    # Nesting up to the cap is fine
+    a.send(Client.change_msg('deep', 0, 'A1', '=' + '(' * 256 + '2' + ')' * 256))
+    a.expect('CHANGE OK\nName:deep\nVersion:1\nValues:1\nCell:A1\nLength:1\n2\n')
+    a.send(Client.change_msg('deep', 1, 'A2', '=' + '(' * 257 + '2' + ')' * 257))
+    a.expect('CHANGE FAIL\nName:deep\nFormula too long or too deeply nested\n')
+
+
+
+@test('--formulas=on', verifies='user-022')
+def long_chain_in_one_batch(server):
+    """Checking a batch for cycles is linear in the formulas it reaches,
+    so the largest batch of chained formulas is answered promptly"""
+    a, = joined(server, 'chain')
+    count = 1 << 16
+    cells = [('A%d' % (x + 1), '=A%d' % (x + 2)) for x in range(count)]
+    start = time.time()
+    a.send(Client.batch_msg('chain', 0, cells))
+    a.expect('CHANGE OK\nName:chain\nVersion:1\nValues:', 30)
+    assert len(a.read_cells(30)) == count
+    assert time.time() - start < 10, 'took %.1fs' % (time.time() - start)
+    # Closing the chain, directly or through a batch, is a cycle
+    a.send(Client.change_msg('chain', 1, 'A%d' % (count + 1), '=A1'))
+    a.expect('CHANGE FAIL\nName:chain\nCircular dependency\n', 30)
+    a.send(Client.batch_msg('chain', 1, [('B1', '=B2+A1'), ('B2', '=A%d' % count), ('A%d' % (count + 1), '=B1')]))
+    a.expect('CHANGE FAIL\nName:chain\nCircular dependency\n', 30)
+    a.send(Client.batch_msg('chain', 1, [('B1', '=A1'), ('B2', '=B1+A1')]))
+    a.expect('CHANGE OK\nName:chain\nVersion:2\nValues:', 30)
+
+# Slow clients (user-021)
+
+@test('--client-queue-kb=16', verifies='user-021 user-009')
+def join_ok_bigger_than_client_queue(server):
+    """A JOIN OK near the size that is still sent whole fits in the client's
+    queue, however small the queue was asked to be"""
+    a, = joined(server, 'wide')
+    cells = [('A%d' % (x + 1), 'x' * 900) for x in range(1000)]
+    a.send(Client.batch_msg('wide', 0, cells))
+    a.expect('CHANGE OK\nName:wide\nVersion:1\n', 30)
+    b = Client(server, 30)
+    version, xml = b.join('wide')
+    assert version == 1 and len(cells_of(xml)) == 1000
+    b.change('wide', 1, 'B1', 'still here')
+
+
+# Sessions, loading and saving
+
+def cells_of(xml):
+    """The cells in a JOIN OK's xml, as a dict"""
+    root = ElementTree.fromstring(xml.encode())
+    return dict((cell.find('name').text, cell.find('contents').text or '') for cell in root)
+
+
+def changes_while_shared(server):
+    """Changes made while saves and JOINs that are not being read share
+    the spreadsheet's cells end up where they belong, and don't leak in to
+    what was shared"""
+    rand = random.Random(7)
+    names = ['%s%d' % (chr(ord('A') + x % 26), 1 + x // 26) for x in range(5000)]
+    state = dict((name, 'initial %s ' % name * 20) for name in names)
+    a, = joined(server, 'shared')
+    a.send(Client.batch_msg('shared', 0, sorted(state.items())))
+    a.expect('CHANGE OK\nName:shared\nVersion:1\n', 30)
+    a.send('SAVE\nName:shared\n')
+    a.expect('SAVE OK\nName:shared\n', 30)
+    a.close()
+    server.restart()
+
+    a = Client(server, 30)
+    version, xml = a.join('shared')
+    assert cells_of(xml) == state
+    history = {version: dict(state)}
+    # Clients that JOIN and don't read, so their JOIN OK streams hold on
+    #  to the cells as they were
+    idle = []
+    for step in range(400):
+        roll = rand.random()
+        if roll < 0.05:
+            c = Client(server, 30)
+            c.send(Client.join_msg('shared'))
+            idle.append(c)
+            continue
+        if roll < 0.1:
+            a.send('SAVE\nName:shared\n')
+            a.expect('SAVE OK\nName:shared\n', 30)
+            continue
+        cell = rand.choice(names) if rand.random() < 0.8 else 'Z%d' % rand.randint(200, 300)
+        contents = rand.choice(['', '<&>', 'step %d' % step, 'x' * rand.randint(1, 500)])
+        a.change('shared', version, cell, contents)
+        version += 1
+        state[cell] = contents
+        history[version] = dict(state)
+
+    for c in idle:
+        v, xml = c.join_ok('shared')
+        assert cells_of(xml) == history[v], 'JOIN OK at version %d is not as it was' % v
+    a.send('SAVE\nName:shared\n')
+    a.expect('SAVE OK\nName:shared\n', 30)
+    a.close()
+    server.restart()
+    version, xml = Client(server, 30).join('shared')
+    assert cells_of(xml) == state
+
+
+@test(verifies='user-007 user-009 user-013 user-016')
+def changes_while_shared_lazy(server):
+    changes_while_shared(server)
+
+
+@test('--load=eager', verifies='user-007 user-009 user-012 user-016')
+def changes_while_shared_eager(server):
+    changes_while_shared(server)
+
+
+@test('--format=xml', verifies='user-007 user-009 user-016')
+def changes_while_shared_xml(server):
+    changes_while_shared(server)
+
+
+@test(verifies='user-002 user-008')
+def concurrent_joins(server):
+    owner = Client(server)
+    owner.create('crowd')
+    owner.join('crowd')
+    for v in range(20):
+        owner.change('crowd', v, 'A%d' % (v + 1), 'row %d' % v)
+    owner.send('SAVE\nName:crowd\nLEAVE\nName:crowd\n')
+    owner.expect('SAVE OK\nName:crowd\n')
+    time.sleep(0.2)
+
+    results = []
+    def join():
+        c = Client(server)
+        results.append(c.join('crowd'))
+        c.close()
+    threads = [threading.Thread(target=join) for x in range(16)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert len(results) == 16, results
+    assert all(r == results[0] for r in results), set(r[0] for r in results)
+    assert results[0][0] == 20 and 'row 19' in results[0][1], results[0]
+
+
+@test(verifies='user-013')
+def requests_after_a_loading_join(server):
+    a, = joined(server, 'cold')
+    a.change('cold', 0, 'A1', 'x' * 100000)
+    a.close()
+    server.restart()
+
+    # The CHANGE and SAVE wait for the JOIN's load, and are answered after it
+    c = Client(server)
+    c.send(Client.join_msg('cold') + Client.change_msg('cold', 0, 'B1', 'y') + 'SAVE\nName:cold\n')
+    version, xml = c.join_ok('cold')
+    assert 'x' * 100000 in xml
+    c.expect('CHANGE OK\nName:cold\nVersion:1\nSAVE OK\nName:cold\n')
+
+
+@test('--format=xml', verifies='user-013')
+def cold_join_during_save(server):
+    """Loading a spreadsheet for a JOIN does not wait for the save of
+    another one to be written"""
+    a, = joined(server, 'big')
+    a.create('small')
+    for version in range(100):
+        cells = [('%s%d' % (chr(ord('A') + x % 26), 1 + x // 26), 'cell %d ' % x * 20)
+                 for x in range(version * 1000, version * 1000 + 1000)]
+        a.send(Client.batch_msg('big', version, cells))
+        a.expect('CHANGE OK\nName:big\nVersion:%d\n' % (version + 1), 30)
+    start = time.time()
+    a.send('SAVE\nName:big\n')
+    a.expect('SAVE OK\nName:big\n', 60)
+    saving = time.time() - start
+
+    a.change('big', 100, 'A1', 'changed')
+    a.send('SAVE\nName:big\n')
+    time.sleep(0.01)
+    start = time.time()
+    Client(server, 30).join('small')
+    joining = time.time() - start
+    a.expect('SAVE OK\nName:big\n', 60)
+    assert joining < saving / 2, 'JOIN took %.3fs, a save %.3fs' % (joining, saving)
+
+
+@test(verifies='user-013')
+def joins_waiting_on_one_load(server):
+    a, = joined(server, 'shared')
+    a.change('shared', 0, 'A1', 'x' * 100000)
+    a.close()
+    server.restart()
+
+    clients = [Client(server) for x in range(6)]
+    for x, c in enumerate(clients):
+        c.send(Client.join_msg('shared', 'pw' if x % 2 == 0 else 'wrong'))
+    missing = Client(server)
+    missing.send(Client.join_msg('missing'))
+    for x, c in enumerate(clients):
+        if x % 2 == 0:
+            version, xml = c.join_ok('shared')
+            assert 'x' * 100000 in xml
+        else:
+            c.expect('JOIN FAIL\nName:shared\nThe provided password did not match the requested password\n')
+    missing.expect('JOIN FAIL\nName:missing\nThe requested spreadsheet does not exist\n')
+
+    clients[0].change('shared', 0, 'A2', 'joined')
+    clients[2].expect('UPDATE\nName:shared\nVersion:1\nCell:A2\nLength:6\njoined\n')
+    clients[1].send(Client.change_msg('shared', 1, 'A3', 'not joined'))
+    clients[1].expect('CHANGE FAIL\nName:shared\nClient not member of spreadsheet session\n')
+
+
+@test('--cache-mb=0', '--format=xml', verifies='user-014')
+def cache_trimmed_after_save(server):
+    """A session left while it saves stays cached over the budget only
+    until its save is written"""
+    a, = joined(server, 'held')
+    cells = [('A%d' % (x + 1), 'value %d ' % x * 20) for x in range(20000)]
+    a.send(Client.batch_msg('held', 0, cells))
+    a.expect('CHANGE OK\nName:held\nVersion:1\n', 30)
+    a.send('LEAVE\nName:held\n')
+    a.close()
+    time.sleep(3)
+    output = server.stop()
+    assert ', 1 eviction(s)' in output, output
+    server.start()
+
+
+@test(verifies='user-011')
+def creates_survive_a_crash(server):
+    # Enough to fold the index log in to the index twice
+    names = ['sheet %d' % x for x in range(2500)]
+    c = Client(server)
+    c.send(''.join(Client.create_msg(name) for name in names))
+    for name in names:
+        c.expect('CREATE OK\nName:%s\nPassword:pw\n' % name, 30)
+    c.close()
+    server.crash()
+    server.start()
+
+    c = Client(server)
+    c.send(''.join(Client.create_msg(name) for name in names))
+    for name in names:
+        c.expect('CREATE FAIL\nName:%s\nThe spreadsheet already exists\n' % name, 30)
+    for name in names[::500] + names[-1:]:
+        c.join(name)
+    c.create('one more')
+
+
+@test(verifies='user-011')
+def compaction_retried_after_failure(server):
+    """When the index can not be written, the log is folded in to it again
+    once it has filled up again"""
+    index = os.path.join(server.root, 'index.xml')
+    old_log = index + '.log.old'
+    c = Client(server, 30)
+    def create(names):
+        c.send(''.join(Client.create_msg(name) for name in names))
+        for name in names:
+            c.expect('CREATE OK\nName:%s\nPassword:pw\n' % name, 30)
+        time.sleep(0.5)
+
+    # A directory where the index is written first makes the write fail -
+    #  once the server has written the index it starts with
+    c.create('warm up')
+    os.mkdir(index + '.tmp')
+    create(['first %d' % x for x in range(1100)])
+    assert os.path.exists(old_log)
+    os.rmdir(index + '.tmp')
+    create(['second %d' % x for x in range(1100)])
+    assert not os.path.exists(old_log)
+    with open(index) as f:
+        written = f.read()
+    assert '>first 1099<' in written and '>second 900<' in written
+
+    server.restart()
+    c = Client(server)
+    for name in ('first 0', 'first 1099', 'second 1099'):
+        c.join(name)
+
+
+@test(verifies='user-007 user-012')
+def save_survives_restart(server):
+    a, = joined(server, 'kept')
+    a.change('kept', 0, 'A1', 'first')
+    a.change('kept', 1, 'B2', 'second & <third>')
+    a.send('SAVE\nName:kept\n')
+    a.expect('SAVE OK\nName:kept\n')
+    a.close()
+
+    server.restart()
+    c = Client(server)
+    version, xml = c.join('kept')
+    assert 'first' in xml and 'second &amp; &lt;third&gt;' in xml, xml
+
+
+@test(verifies='user-006')
+def unsaved_changes_survive_restart(server):
+    a, = joined(server, 'journal')
+    for v in range(10):
+        a.change('journal', v, 'D%d' % (v + 1), 'j%d' % v)
+    a.close()
+
+    server.restart()
+    c = Client(server)
+    version, xml = c.join('journal')
+    assert all('j%d' % v in xml for v in range(10)), xml
+
+
+@test(verifies='user-007')
+def changes_answered_during_save(server):
+    a, b = joined(server, 'busy', 2)
+    cells = [('A%d' % (x + 1), 'value %d ' % x * 20) for x in range(5000)]
+    a.send(Client.batch_msg('busy', 0, cells))
+    a.expect('CHANGE OK\nName:busy\nVersion:1\n')
+    b.read_until('Cell:A5000\n')
+    b.read_until('\n')
+    b.read_until('\n')
+
+    a.send('SAVE\nName:busy\n' + ''.join(
+        Client.change_msg('busy', v, 'B1', 'during %d' % v) for v in range(1, 21)))
+    # The save runs beside the session, so SAVE OK can come after CHANGE OKs
+    version, saved = 1, False
+    while version < 21 or not saved:
+        if a.read_until('\n') == b'SAVE OK\n':
+            a.expect('Name:busy\n')
+            saved = True
+        else:
+            version += 1
+            a.expect('Name:busy\nVersion:%d\n' % version)
+
+    server.restart()
+    c = Client(server)
+    version, xml = c.join('busy')
+    assert 'during 20' in xml and 'value 4999' in xml, xml[-200:]
+
+
+def main(argv):
+    if len(argv) < 2:
+        print('usage: %s path/to/SSServer [test name or request ...]' % argv[0])
+        return 2
+    wanted = set(argv[2:])
+    failed = 0
+    for name, fn, options, requests in tests:
+        if wanted and name not in wanted and not wanted.intersection(requests):
+            continue
+        server = Server(argv[1], options)
+        try:
+            server.start()
+            fn(server)
+            if not server.alive():
+                raise AssertionError('server exited')
+            print('ok      %-36s %s' % (name, ' '.join(requests)))
+        except Exception:
+            failed += 1
+            print('FAILED  %-36s %s' % (name, ' '.join(requests)))
+            traceback.print_exc()
+            print(server.stop())
+        finally:
+            server.close()
+    print('%d failed' % failed if failed else 'all passed')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,125 @@
+/*
+ * undo_log_check.cpp
+ *
+ * Checks undo_log against a plain list of changes, with random changes,
+ *  undos and clears under random memory caps, and that the log's memory
+ *  never goes over its cap.  Build from the SSServer directory:
+ *
+ *   g++ -std=gnu++11 -O1 -g -fsanitize=address,undefined -I. \
+ *       tests/undo_log_check.cpp undo_log.cpp -o undo_check
+ *
+ * Run with a number of caps to try more than the default 300.
+ */
+
+#include "undo_log.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+
+using namespace ss;
+
+static boost::random::mt19937 rng;
+
+static std::size_t random(std::size_t low, std::size_t high)
+{
+	return boost::random::uniform_int_distribution<std::size_t>(low, high)(rng);
+}
+
+// Mostly short contents, with now and then a long one
+static std::string random_contents(std::size_t longest)
+{
+	return std::string(random(0, random(0, 3) == 0 ? longest : 20), char('a' + random(0, 25)));
+}
+
+// Runs one log through a random history.  Returns false on the first
+//  difference from the expected history
+static bool check_log(std::size_t cap)
+{
+	undo_log log(cap);
+	std::vector<cell_list> expected;
+	for(int step = 0; step < 3000; step++)
+	{
+		std::size_t roll = random(0, 9);
+		if(roll < 6)
+		{
+			// A change of one cell, or a batch
+			cell_list change;
+			std::size_t cells = random(0, 2) == 0 ? random(1, 12) : 1;
+			if(cells == 1 && random(0, 1) == 0)
+			{
+				change.push_back(std::make_pair(cell_address(random(0, 1 << 20)), random_contents(3000)));
+				log.push(change[0].first, change[0].second);
+			}
+			else
+			{
+				log.begin_change();
+				for(std::size_t x = 0; x < cells; x++)
+				{
+					change.push_back(std::make_pair(cell_address(random(0, 1 << 20)), random_contents(900)));
+					log.add(change[x].first, change[x].second);
+				}
+			}
+			expected.push_back(change);
+
+			// The log forgets from the oldest end
+			if(expected.size() > log.size())
+				expected.erase(expected.begin(), expected.begin() + (expected.size() - log.size()));
+		}
+		else if(roll < 9)
+		{
+			cell_list cells;
+			if(log.pop(cells) != !expected.empty())
+			{
+				std::printf("cap %lu, step %d: undo of %lu changes\n", (unsigned long)cap, step, (unsigned long)expected.size());
+				return false;
+			}
+			if(!expected.empty())
+			{
+				// Newest cell first
+				cell_list undone(expected.back().rbegin(), expected.back().rend());
+				expected.pop_back();
+				if(cells != undone)
+				{
+					std::printf("cap %lu, step %d: wrong cells undone\n", (unsigned long)cap, step);
+					return false;
+				}
+			}
+		}
+		else if(random(0, 19) == 0)
+		{
+			log.clear();
+			expected.clear();
+		}
+
+		if(log.size() != expected.size() || log.empty() != expected.empty())
+		{
+			std::printf("cap %lu, step %d: %lu changes, expected %lu\n", (unsigned long)cap, step,
+					(unsigned long)log.size(), (unsigned long)expected.size());
+			return false;
+		}
+		if(log.memory_size() > cap)
+		{
+			std::printf("cap %lu, step %d: %lu bytes used\n", (unsigned long)cap, step, (unsigned long)log.memory_size());
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned long caps = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 300;
+	for(unsigned long x = 0; x < caps; x++)
+	{
+		if(!check_log(random(64, 8192)))
+		{
+			std::printf("FAIL\n");
+			return 1;
+		}
+	}
+	std::printf("ok: %lu caps\n", caps);
+	return 0;
+}
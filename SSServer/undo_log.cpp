@@ -0,0 +1,250 @@
+/*
+ * undo_log.cpp
+ *
+ *  Created on: May 1, 2013
+ *      Author: montgomc
+ */
+
+#include "undo_log.h"
+#include <algorithm>
+#include <cstring>
+
+namespace ss {
+
+// The size of an arena block.  Old contents longer than this get a block
+//  of their own
+static const std::size_t block_size = 16 << 10;
+
+// The number of records the ring starts with
+static const std::size_t initial_ring = 16;
+
+undo_log::undo_log(std::size_t max_bytes)
+	: start_(0),
+	  count_(0),
+	  changes_(0),
+	  change_start_(0),
+	  dropping_(false),
+	  first_block_(0),
+	  block_used_(0),
+	  max_bytes_(max_bytes),
+	  block_bytes_(0)
+{
+}
+
+undo_log::record& undo_log::at(std::size_t index)
+{
+	return ring_[(start_ + index) % ring_.size()];
+}
+
+std::size_t undo_log::ring_bytes(std::size_t records)
+{
+	std::size_t size = ring_.size();
+	if(records > size)
+		size = size == 0 ? initial_ring : size * 2;
+	return size * sizeof(record);
+}
+
+void undo_log::push(cell_address cell, const std::string& old_contents)
+{
+	begin_change();
+	add(cell, old_contents);
+}
+
+void undo_log::begin_change()
+{
+	change_start_ = count_;
+	dropping_ = false;
+}
+
+void undo_log::add(cell_address cell, const std::string& old_contents)
+{
+	if(dropping_)
+		return;
+
+	std::size_t length = old_contents.length();
+
+	// A change too big for the cap can not be kept - and the changes
+	//  before it can not be undone without undoing it first
+	if(length + sizeof(record) > max_bytes_)
+	{
+		drop_change();
+		return;
+	}
+
+	// Blocks are smaller with a small cap, so a few of them fit
+	std::size_t new_block_length = std::max(length, std::min(block_size, max_bytes_ / 4));
+
+	// Forget the oldest changes until this cell fits under the cap.  The
+	//  ring is counted as memory_size() counts it, at its size once it has
+	//  grown for the new record - it never shrinks, so once it is as big
+	//  as the cap allows, old records are forgotten instead
+	while(true)
+	{
+		bool new_block = length > 0 && (blocks_.empty() || block_used_ + length > blocks_.back().size());
+		std::size_t needed = block_bytes_ + (new_block ? new_block_length : 0) + ring_bytes(count_ + 1);
+		if(needed <= max_bytes_)
+			break;
+		// Only the change being added is left, and it does not fit
+		if(change_start_ == 0)
+		{
+			drop_change();
+			return;
+		}
+		evict();
+	}
+
+	// Copy the old contents in to the arena
+	if(length > 0 && (blocks_.empty() || block_used_ + length > blocks_.back().size()))
+	{
+		blocks_.push_back(std::vector<char>());
+		blocks_.back().resize(new_block_length);
+		block_bytes_ += new_block_length;
+		block_used_ = 0;
+	}
+	record rec;
+	rec.cell = cell;
+	rec.block = blocks_.empty() ? first_block_ : first_block_ + blocks_.size() - 1;
+	rec.offset = block_used_;
+	rec.length = length;
+	rec.first = count_ == change_start_;
+	if(length > 0)
+	{
+		std::memcpy(&blocks_.back()[block_used_], old_contents.data(), length);
+		block_used_ += length;
+	}
+
+	// Add the record, doubling the ring if it is full
+	if(count_ == ring_.size())
+	{
+		std::vector<record> bigger(ring_.empty() ? initial_ring : ring_.size() * 2);
+		for(std::size_t x = 0; x < count_; x++)
+		{
+			bigger[x] = at(x);
+		}
+		ring_.swap(bigger);
+		start_ = 0;
+	}
+	at(count_) = rec;
+	count_++;
+	if(rec.first)
+		changes_++;
+}
+
+bool undo_log::pop(cell_list& cells)
+{
+	cells.clear();
+	if(count_ == 0)
+		return false;
+
+	// Take records off the back up to the first cell of the change
+	bool first = false;
+	while(!first)
+	{
+		const record& rec = at(count_ - 1);
+		cells.push_back(std::make_pair(rec.cell, std::string()));
+		if(rec.length > 0)
+			cells.back().second.assign(&blocks_[rec.block - first_block_][rec.offset], rec.length);
+		first = rec.first;
+		count_--;
+	}
+	changes_--;
+	change_start_ = count_;
+	trim_blocks();
+	return true;
+}
+
+void undo_log::evict()
+{
+	// Forget the oldest record, and the rest of its change with it
+	do
+	{
+		evict_record();
+	}
+	while(count_ > 0 && !at(0).first);
+	changes_--;
+}
+
+void undo_log::evict_record()
+{
+	start_ = (start_ + 1) % ring_.size();
+	count_--;
+	if(change_start_ > 0)
+		change_start_--;
+	if(count_ == 0)
+	{
+		blocks_.clear();
+		block_bytes_ = 0;
+		block_used_ = 0;
+		first_block_ = 0;
+		return;
+	}
+
+	// Free the blocks only older changes used
+	while(!blocks_.empty() && first_block_ < at(0).block)
+	{
+		block_bytes_ -= blocks_.front().size();
+		blocks_.pop_front();
+		first_block_++;
+	}
+}
+
+void undo_log::drop_change()
+{
+	clear();
+	dropping_ = true;
+}
+
+void undo_log::trim_blocks()
+{
+	if(count_ == 0)
+	{
+		// Hang on to one block for the next change
+		while(blocks_.size() > 1)
+		{
+			block_bytes_ -= blocks_.back().size();
+			blocks_.pop_back();
+		}
+		block_used_ = 0;
+		return;
+	}
+
+	// The arena is used in order - everything after the newest change's
+	//  contents is free again
+	const record& newest = at(count_ - 1);
+	while(!blocks_.empty() && first_block_ + blocks_.size() - 1 > newest.block)
+	{
+		block_bytes_ -= blocks_.back().size();
+		blocks_.pop_back();
+	}
+	block_used_ = newest.offset + newest.length;
+}
+
+void undo_log::clear()
+{
+	start_ = 0;
+	count_ = 0;
+	changes_ = 0;
+	change_start_ = 0;
+	dropping_ = false;
+	blocks_.clear();
+	first_block_ = 0;
+	block_used_ = 0;
+	block_bytes_ = 0;
+}
+
+bool undo_log::empty()
+{
+	return count_ == 0;
+}
+
+std::size_t undo_log::size()
+{
+	return changes_;
+}
+
+std::size_t undo_log::memory_size()
+{
+	return block_bytes_ + ring_.size() * sizeof(record);
+}
+
+}
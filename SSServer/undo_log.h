@@ -0,0 +1,123 @@
+/*
+ * undo_log.h
+ *
+ *  Created on: May 1, 2013
+ *      Author: montgomc
+ */
+
+#ifndef UNDO_LOG_H_
+#define UNDO_LOG_H_
+
+#include "cell_address.h"
+#include <deque>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace ss {
+
+// A session's undo history: for each change, the cells it set and what
+//  they held before.  Undo takes the newest change back off - all of its
+//  cells at once, so a batched CHANGE is undone in one go.
+//
+// The changes are kept as small fixed size records in a ring, and the old
+//  contents are copied one after another in to an arena of large blocks,
+//  so a change costs one record and its bytes rather than two strings of
+//  its own.  The history has a memory cap - once it is reached, the
+//  oldest changes are forgotten to make room for new ones (a block is
+//  freed once every change in it is gone).  The ring counts against the
+//  cap at its full size, so memory_size() never goes over it.
+class undo_log : private boost::noncopyable {
+public:
+	// Creates an empty history that holds up to max_bytes
+	undo_log(std::size_t max_bytes);
+
+	// Records a change to cell, which held old_contents before it
+	void push(cell_address cell, const std::string& old_contents);
+
+	// Starts a change of several cells - add() each cell before it is set
+	void begin_change();
+
+	// Adds a cell, which held old_contents, to the change begun last
+	void add(cell_address cell, const std::string& old_contents);
+
+	// Takes the newest change off, setting cells to what its cells held
+	//  before (newest first, the order to put them back in).  Returns
+	//  false if there is none
+	bool pop(cell_list& cells);
+
+	// Forgets every change
+	void clear();
+
+	// Returns whether there are no changes to undo
+	bool empty();
+
+	// Returns the number of changes that can be undone
+	std::size_t size();
+
+	// Returns how much memory the history uses
+	std::size_t memory_size();
+
+private:
+	struct record
+	{
+		cell_address cell;
+		// The block the old contents are in (counting every block the
+		//  log has used), and where in it
+		boost::uint32_t block;
+		boost::uint32_t offset;
+		boost::uint32_t length : 31;
+		// Whether this is the first cell of its change
+		boost::uint32_t first : 1;
+	};
+
+	// Forgets the oldest change
+	void evict();
+
+	// Forgets the oldest cell
+	void evict_record();
+
+	// Forgets everything, along with the rest of the change being added
+	//  - for a change too big to keep
+	void drop_change();
+
+	// Frees the blocks at the back that the newest change does not use
+	void trim_blocks();
+
+	// Returns the record at index (0 is the oldest)
+	record& at(std::size_t index);
+
+	// Returns how much memory the ring takes once it holds records
+	std::size_t ring_bytes(std::size_t records);
+
+	// The records, in a ring: count_ of them, the oldest at start_
+	std::vector<record> ring_;
+	std::size_t start_;
+	std::size_t count_;
+
+	// The number of changes in the ring
+	std::size_t changes_;
+
+	// Where the change being added starts in the ring
+	std::size_t change_start_;
+
+	// Whether the rest of the change being added is being dropped
+	bool dropping_;
+
+	// The arena, oldest block first
+	std::deque<std::vector<char> > blocks_;
+
+	// The number of the first block in blocks_
+	boost::uint32_t first_block_;
+
+	// How much of the last block is used
+	std::size_t block_used_;
+
+	// The memory cap, and how much of it the blocks use
+	std::size_t max_bytes_;
+	std::size_t block_bytes_;
+};
+
+}
+#endif /* UNDO_LOG_H_ */
@@ -0,0 +1,54 @@
+/*
+ * version_log.cpp
+ *
+ *  Created on: May 2, 2013
+ *      Author: montgomc
+ */
+
+#include "version_log.h"
+
+namespace ss {
+
+version_log::version_log(std::size_t max_entries)
+	: floor_(0),
+	  max_entries_(max_entries)
+{
+}
+
+void version_log::record(cell_address cell, int version)
+{
+	// Forget the oldest cell, moving the floor up to its version
+	if(entries_.size() == max_entries_)
+	{
+		const entry& oldest = entries_.front();
+		floor_ = oldest.version;
+		boost::unordered_map<cell_address, int>::iterator it = last_set_.find(oldest.cell);
+		if(it != last_set_.end() && it->second == oldest.version)
+		{
+			last_set_.erase(it);
+		}
+		entries_.pop_front();
+	}
+
+	entry e;
+	e.version = version;
+	e.cell = cell;
+	entries_.push_back(e);
+	last_set_[cell] = version;
+}
+
+bool version_log::unchanged_since(const cell_list& cells, int version)
+{
+	if(version < floor_)
+		return false;
+
+	for(cell_list::const_iterator it = cells.begin(); it != cells.end(); ++it)
+	{
+		boost::unordered_map<cell_address, int>::const_iterator found = last_set_.find(it->first);
+		if(found != last_set_.end() && found->second > version)
+			return false;
+	}
+	return true;
+}
+
+}
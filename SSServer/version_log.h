@@ -0,0 +1,58 @@
+/*
+ * version_log.h
+ *
+ *  Created on: May 2, 2013
+ *      Author: montgomc
+ */
+
+#ifndef VERSION_LOG_H_
+#define VERSION_LOG_H_
+
+#include "cell_address.h"
+#include <deque>
+#include <boost/unordered_map.hpp>
+
+namespace ss {
+
+// The session's recent changes: which cells were set in which version.
+//  It lets a CHANGE made against an older version be accepted as long as
+//  none of its cells have been set since - the change is simply applied
+//  on top of the newer ones.  Only a CHANGE to a cell someone else has
+//  set in the meantime is a real conflict.
+//
+// Only the last few thousand cells set are remembered.  A CHANGE older
+//  than that can not be checked, and has to wait as before.
+class version_log {
+public:
+	// Creates a log that remembers the last max_entries cells set
+	version_log(std::size_t max_entries);
+
+	// Records that cell was set in version (which is never older than
+	//  the versions recorded before it)
+	void record(cell_address cell, int version);
+
+	// Returns whether none of cells have been set after version.  Returns
+	//  false if version is older than the log remembers
+	bool unchanged_since(const cell_list& cells, int version);
+
+private:
+	struct entry
+	{
+		int version;
+		cell_address cell;
+	};
+
+	// The cells set, oldest first
+	std::deque<entry> entries_;
+
+	// The version each cell in entries_ was last set in
+	boost::unordered_map<cell_address, int> last_set_;
+
+	// Every cell set after this version is in entries_
+	int floor_;
+
+	std::size_t max_entries_;
+};
+
+}
+#endif /* VERSION_LOG_H_ */